@@ -101,6 +101,7 @@ unsigned ReadRewriteFile(const string & sFile, cmstring& sRepName);
 
 MapNameToString n2sTbl[] = {
 		{  "CacheDir",                &cachedir}
+		,{  "FastCacheDir",            &fastcachedir}
 		,{  "LogDir",                  &logdir}
 		,{  "SupportDir",              &suppdir}
 		,{  "SocketPath",              &udspath}
@@ -146,6 +147,8 @@ MapNameToInt n2iTbl[] = {
 		,{  "ExTreshold",                        &extreshhold,      nullptr,    10, true} // wrong spelling :-(
 		,{  "MaxStandbyConThreads",              &tpstandbymax,     nullptr,    10, false}
 		,{  "MaxConThreads",                     &tpthreadmax,      nullptr,    10, false}
+		,{  "ParkIdleConnections",               &parkidle,         nullptr,    10, false}
+		,{  "AcceptThreads",                     &acceptthreads,    nullptr,    10, false}
 		,{  "DlMaxRetries",                      &dlretriesmax,     nullptr,    10, false}
 		,{  "DnsCacheSeconds",                   &dnscachetime,     nullptr,    10, false}
 		,{  "UnbufferLogs",                      &debug,            nullptr,    10, false}
@@ -165,16 +168,36 @@ MapNameToInt n2iTbl[] = {
 		,{  "VfileUseRangeOps",                  &vrangeops,        nullptr,    10, false}
 		,{  "ResponseFreezeDetectTime",          &stucksecs,        nullptr,    10, false}
 		,{  "ReuseConnections",                  &persistoutgoing,  nullptr,    10, false}
+		,{  "ConnPoolPerHost",                   &conpoolperhost,   nullptr,    10, false}
+		,{  "ConnPoolSize",                      &conpoolsize,      nullptr,    10, false}
+		,{  "PrewarmConnections",                &prewarmcons,      nullptr,    10, false}
+		,{  "KernelTls",                         &kerneltls,        nullptr,    10, false}
 		,{  "PipelineDepth",                     &pipelinelen,      nullptr,    10, false}
 		,{  "ExSuppressAdminNotification",       &exsupcount,       nullptr,    10, false}
 		,{  "OptProxyTimeout",                   &optproxytimeout,  nullptr,    10, false}
 		,{  "MaxDlSpeed",                        &maxdlspeed,       nullptr,    10, false}
+		,{  "MaxDlSpeedPerHost",                 &maxdlspeedperhost, nullptr,   10, false}
+		,{  "MaxServeSpeed",                     &maxservespeed,    nullptr,    10, false}
 		,{  "MaxInresponsiveDlSize",             &maxredlsize,      nullptr,    10, false}
 		,{  "OptProxyCheckInterval",             &optProxyCheckInt, nullptr,    10, false}
 		,{  "TrackFileUse",		             	 &trackfileuse,		nullptr,    10, false}
 		,{  "FollowIndexFileRemoval",            &follow404,		nullptr,    10, false}
         ,{  "ReserveSpace",                      &allocspace, 		nullptr ,   10, false}
         ,{  "EvDnsOpts",                	     &dnsopts,	 		nullptr ,   10, false}
+		,{  "MetaCacheSize",                     &metacachesize,    nullptr,    10, false}
+		,{  "RamCacheSize",                      &ramcachesize,     nullptr,    10, false}
+		,{  "RamCacheMaxFileSize",               &ramcachemaxfile,  nullptr,    10, false}
+		,{  "UseIoUring",                        &useiouring,       nullptr,    10, false}
+		,{  "DlThreads",                         &dlthreads,        nullptr,    10, false}
+		,{  "ClientDlStreams",                   &clientdlstreams,  nullptr,    10, false}
+		,{  "WriteBehindBuffer",                 &wbbufsize,        nullptr,    10, false}
+		,{  "MetaDb",                            &metadb,           nullptr,    10, false}
+		,{  "DedupStorage",                      &dedup,            nullptr,    10, false}
+		,{  "FastCacheSize",                     &fastcachesize,    nullptr,    10, false}
+		,{  "FastCachePromoteHits",              &fastcachehits,    nullptr,    10, false}
+		,{  "SegmentedDlMinSize",                &segdlminsize,     nullptr,    10, false}
+		,{  "SegmentedDlStreams",                &segdlstreams,     nullptr,    10, false}
+		,{  "PriorityDownloads",                 &priodl,           nullptr,    10, false}
 
         // octal base interpretation of UNIX file permissions
 		,{  "DirPerms",                          &dirperms,         nullptr,    8, false}
@@ -755,6 +778,11 @@ void PostProcConfig()
 
 	cacheDirSlash=cachedir+CPATHSEP;
 
+	while (fastcachedir.size() > 1 && fastcachedir.back() == CPATHSEP)
+		fastcachedir.pop_back();
+	if (!fastcachedir.empty() && fastcachedir[0] != CPATHSEP)
+		BARF("FastCacheDir must be an absolute path, terminating...");
+
    if(!pidfile.empty() && pidfile.at(0) != CPATHSEP)
 	   BARF("Pid file path must be absolute, terminating...");
    
@@ -27,7 +27,7 @@ extern mstring cachedir, logdir, confdir, udspath, user, group, pidfile, suppdir
 reportpage, vfilepat, pfilepat, wfilepat, agentname, adminauth, adminauthB64,
 bindaddr, sUmask,
 tmpDontcacheReq, tmpDontcachetgt, tmpDontcache, mirrorsrcs, requestapx,
-cafile, capath, spfilepat, svfilepat, badredmime, sigbuscmd, connectPermPattern;
+cafile, capath, spfilepat, svfilepat, badredmime, sigbuscmd, connectPermPattern, fastcachedir;
 
 extern mstring pfilepatEx, vfilepatEx, wfilepatEx, spfilepatEx, svfilepatEx; // for customization by user
 
@@ -38,7 +38,11 @@ verboselog, extreshhold, exfailabort, tpstandbymax, tpthreadmax, dnscachetime, d
 exporigin, logxff, oldupdate, recompbz2, nettimeout, updinterval, forwardsoap, dirperms, fileperms,
 maxtempdelay, redirmax, vrangeops, stucksecs, persistoutgoing, pipelinelen, exsupcount,
 optproxytimeout, patrace, maxdlspeed, maxredlsize, dlretriesmax, nsafriendly, trackfileuse, exstarttradeoff,
-fasttimeout, discotimeout, allocspace, dnsopts, minilog, follow404;
+fasttimeout, discotimeout, allocspace, dnsopts, minilog, follow404, parkidle, acceptthreads, metacachesize,
+ramcachesize, ramcachemaxfile, useiouring, dlthreads, segdlminsize, segdlstreams,
+conpoolperhost, conpoolsize, prewarmcons, kerneltls,
+maxdlspeedperhost, maxservespeed, priodl, clientdlstreams, wbbufsize, metadb, dedup,
+fastcachesize, fastcachehits;
 
 // processed config settings
 extern const tHttpUrl* GetProxyInfo();
@@ -90,6 +94,8 @@ extern bool g_bQuiet, g_bNoComplex;
 
 static const cmstring privStoreRelSnapSufix("_xstore/rsnap");
 static const cmstring privStoreRelQstatsSfx("_xstore/qstats");
+static const cmstring privStoreRelMetaDb("_xstore/metadb");
+static const cmstring privStoreRelBlobs("_xstore/blobs");
 
 } // namespace cfg
 
@@ -18,7 +18,7 @@ namespace cfg
 
 string ACNG_API cachedir(CACHEDIR), logdir(LOGDIR), udspath(UDSPATH), pidfile, reportpage,
 confdir, adminauth, adminauthB64, bindaddr, mirrorsrcs, suppdir(LIBDIR),
-capath("/etc/ssl/certs"), cafile, badredmime("text/html");
+capath("/etc/ssl/certs"), cafile, badredmime("text/html"), fastcachedir;
 
 #define INFOLDER "(^|.*/)"
 #define COMPRLIST "(\\.gz|\\.bz2|\\.lzma|\\.xz|\\.zst)"
@@ -126,7 +126,13 @@ logxff(false), oldupdate(false), recompbz2(false), nettimeout(17), updinterval(0
 forwardsoap(RESERVED_DEFVAL), usewrap(RESERVED_DEFVAL), redirmax(RESERVED_DEFVAL),
 stucksecs(RESERVED_DEFVAL), persistoutgoing(1), pipelinelen(10), exsupcount(RESERVED_DEFVAL),
 optproxytimeout(-1), patrace(false), maxredlsize(1<<16), nsafriendly(false),
-trackfileuse(false), exstarttradeoff(500000000), fasttimeout(4), discotimeout(15), follow404(true);
+trackfileuse(false), exstarttradeoff(500000000), fasttimeout(4), discotimeout(15), follow404(true),
+parkidle(true), acceptthreads(0), metacachesize(10000),
+ramcachesize(0), ramcachemaxfile(262144), useiouring(false), dlthreads(0),
+segdlminsize(0), segdlstreams(3),
+conpoolperhost(8), conpoolsize(50), prewarmcons(0), kerneltls(0),
+maxdlspeedperhost(0), maxservespeed(0), priodl(1), clientdlstreams(1), wbbufsize(256), metadb(0), dedup(0),
+fastcachesize(4096), fastcachehits(2);
 
 int maxdlspeed(RESERVED_DEFVAL);
 
@@ -17,6 +17,7 @@
 #include "csmapping.h"
 #include "cleaner.h"
 #include "ebrunner.h"
+#include "metadb.h"
 
 #include <functional>
 #include <thread>
@@ -227,11 +228,15 @@ static void usage(int retCode = 0, LPCSTR cmd = nullptr)
 			"-v: more verbosity" << endl <<
 			"-x: also drop index files (can be dangerous)" <<endl <<
 			"Suffix X can be k,K,m,M,g,G (for kb,KiB,mb,MiB,gb,GiB)" << endl;
+		else if(0 == strcmp(cmd, "migrateheads"))
+			cerr << "USAGE: acngtool migrateheads MetaDb=1 [--verbose] [variable assignments...]" << endl <<
+			"Moves the .head files of the cache into the metadata store (see MetaDb)." << endl <<
+			"The server must not be running meanwhile." << endl;
 	}
 	else
 		(retCode ? cout : cerr) <<
 		"Usage: acngtool command parameter... [options]\n\n"
-			"command := { printvar, cfgdump, retest, patch, curl, encb64, maint, shrink }\n"
+			"command := { printvar, cfgdump, retest, patch, curl, encb64, maint, shrink, migrateheads }\n"
 			"parameter := (specific to command)\n"
 			"options := (see apt-cacher-ng options)\n"
 			"extra options := -h, --verbose\n"
@@ -319,7 +324,13 @@ int shrink(off_t wantedSize, bool dryrun, bool apply, bool verbose, bool incIfil
 
 	// there might be some unmatched remains...
 	for(auto kv: related)
+	{
+		// no .head files with MetaDb, the last use is recorded there
+		metadb::tRecord rec;
+		if (cfg::trackfileuse && metadb::Get(kv.first.substr(CACHE_BASE_LEN), rec) && rec.atime)
+			kv.second.first = rec.atime;
 		delQ.push({kv.first, kv.second.first, kv.second.second});
+	}
 	related.clear();
 
 	auto foundSizeString = offttosHdotted(totalBlocks*512);
@@ -352,7 +363,7 @@ int shrink(off_t wantedSize, bool dryrun, bool apply, bool verbose, bool incIfil
 		if(todel && apply)
 		{
 			unlink(delpath.c_str());
-			unlink(mstring(delpath + ".head").c_str());
+			RemoveHeadFromStorage(delpath + ".head");
 		}
 		delQ.pop();
 	}
@@ -364,6 +375,47 @@ int shrink(off_t wantedSize, bool dryrun, bool apply, bool verbose, bool incIfil
 	return 0;
 }
 
+int migrate_heads()
+{
+	mstring sErr;
+	if (!metadb::Open(&sErr))
+	{
+		cerr << "Error: " << sErr << endl;
+		return EXIT_FAILURE;
+	}
+	unsigned nMoved = 0, nFailed = 0;
+	IFileHandler::FindFiles(cfg::cachedir,
+			[&](cmstring & path, const struct stat& finfo) -> bool
+			{
+		mstring sPathRel;
+		if (!metadb::KeyFromHeadPath(path, sPathRel))
+			return true;
+		metadb::tRecord rec;
+		// an existing record wins, the file would not be used anyway
+		if (!metadb::Get(sPathRel, rec))
+		{
+			if (!ParseHeadFromStorage(path, &rec.contLen, &rec.lastModified, &rec.origin, &rec.sha256))
+				return true;
+			// the file date tells the last use in TrackFileUse mode
+			rec.atime = finfo.st_mtime;
+			if (!metadb::Put(sPathRel, rec))
+			{
+				cerr << "Cannot store metadata of " << sPathRel << endl;
+				nFailed++;
+				return true;
+			}
+		}
+		if (g_bVerbose)
+			cout << path << endl;
+		unlink(path.c_str());
+		nMoved++;
+		return true;
+			}
+	, true, false);
+	cout << "Moved " << nMoved << " header files into " << CACHE_BASE << cfg::privStoreRelMetaDb << endl;
+	return nFailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 #if SUPPWHASH
 
 int hashpwd()
@@ -975,6 +1027,17 @@ std::unordered_map<string, parm> parms = {
 				}
 			}
 		}
+	,
+		{
+			"migrateheads",
+			{
+				0, 0, [](LPCSTR)
+				{
+					warn_cfgdir();
+					g_exitCode+=migrate_heads();
+				}
+			}
+		}
    ,
    {
 		   "shrink",
@@ -4,11 +4,13 @@
 #include "acfg.h"
 #include "cleaner.h"
 #include "evabase.h"
+#include "ramcache.h"
 
 #include <list>
 #include <algorithm>
 
 #define IN_ABOUT_ONE_DAY 100000
+#define REGISTRY_SHARDS 32
 
 using namespace std;
 
@@ -19,7 +21,29 @@ class TFileItemRegistry : public IFileItemRegistry, public enable_shared_from_th
 {
 		// IFileItemRegistry interface
 
-		tFiGlobMap mapItems;
+		struct tShard : public base_with_mutex
+		{
+				tFiGlobMap items;
+				std::atomic<unsigned long> nLocked = 0, nContended = 0;
+		};
+		tShard m_shards[REGISTRY_SHARDS];
+
+		static unsigned GetShardIndex(cmstring& sPathRel)
+		{
+				return std::hash<mstring>()(sPathRel) % REGISTRY_SHARDS;
+		}
+		static lockuniq LockShard(tShard& shard)
+		{
+				lockuniq ret;
+				ret._guard = std::unique_lock<std::mutex>(shard.m_obj_mutex, std::try_to_lock);
+				shard.nLocked++;
+				if (!ret._guard.owns_lock())
+				{
+						shard.nContended++;
+						ret.reLock();
+				}
+				return ret;
+		}
 
 		struct TExpiredEntry
 		{
@@ -40,10 +64,20 @@ public:
 public:
 		void Unreg(fileitem& item) override
 		{
-				mapItems.erase(item.m_globRef);
-				item.m_globRef = mapItems.end();
+				if (item.m_globRef)
+				{
+						auto& items = m_shards[item.m_nGlobShard].items;
+						auto it = items.find(item.m_globRef->first);
+						if (it != items.end())
+								items.erase(it);
+				}
+				item.m_globRef = nullptr;
 				item.m_owner.reset();
 		}
+		lockuniq LockForItem(const fileitem& item) override
+		{
+				return LockShard(m_shards[item.m_nGlobShard]);
+		}
 };
 
 void SetupServerItemRegistry()
@@ -67,7 +101,7 @@ TFileItemHolder::~TFileItemHolder()
 	lockuniq mangerLock;
 	auto manger = local_ptr->m_owner.lock();
 	if (manger)
-		mangerLock.assign(*manger, true);
+		mangerLock = manger->LockForItem(*local_ptr);
 
 	lockguard fitemLock(*local_ptr);
 
@@ -137,7 +171,9 @@ TFileItemHolder TFileItemRegistry::Create(cmstring &sPathUnescaped, ESharingHow
 	try
 	{
 		mstring sPathRel(fileitem_with_storage::NormalizePath(sPathUnescaped));
-		lockguard lockGlobalMap(this);
+		auto nShard = GetShardIndex(sPathRel);
+		auto& mapItems = m_shards[nShard].items;
+		auto lockGlobalMap = LockShard(m_shards[nShard]);
 		LOG("Normalized: " << sPathRel );
 		auto regnew = [&]()
 		{
@@ -149,7 +185,8 @@ TFileItemHolder TFileItemRegistry::Create(cmstring &sPathUnescaped, ESharingHow
 			ASSERT(res.second);
 
 			sp->m_owner = shared_from_this();
-			sp->m_globRef = res.first;
+			sp->m_globRef = &*res.first;
+			sp->m_nGlobShard = nShard;
 
 			return TFileItemHolder(sp);
 		};
@@ -226,10 +263,11 @@ TFileItemHolder TFileItemRegistry::Create(cmstring &sPathUnescaped, ESharingHow
 			return TFileItemHolder();
 
 		auto abandon_replace = [&]() {
+			ramcache::Drop(fi->m_sPathRel);
 			fi->m_sPathRel = replPathAbs;
 			fi->m_eDestroy = fileitem::EDestroyMode::ABANDONED;
 
-			fi->m_globRef = mapItems.end();
+			fi->m_globRef = nullptr;
 			fi->m_owner.reset();
 
 			mapItems.erase(it);
@@ -274,16 +312,18 @@ TFileItemHolder TFileItemRegistry::Create(tFileItemPtr spCustomFileItem, bool is
 		ret.m_ptr = spCustomFileItem;
 	}
 
-	lockguard lockGlobalMap(this);
+	auto nShard = GetShardIndex(spCustomFileItem->m_sPathRel);
+	auto lockGlobalMap = LockShard(m_shards[nShard]);
 
 	dbgline;
-	auto installed = mapItems.emplace(spCustomFileItem->m_sPathRel,
+	auto installed = m_shards[nShard].items.emplace(spCustomFileItem->m_sPathRel,
 									  spCustomFileItem);
 
 	if(!installed.second)
 		return ret; // conflict, another agent is already active
 	dbgline;
-	spCustomFileItem->m_globRef = installed.first;
+	spCustomFileItem->m_globRef = &*installed.first;
+	spCustomFileItem->m_nGlobShard = nShard;
 	spCustomFileItem->m_owner = shared_from_this();
 	spCustomFileItem->usercount++;
 	ret.m_ptr = spCustomFileItem;
@@ -313,28 +353,40 @@ time_t TFileItemRegistry::BackgroundCleanup()
 void TFileItemRegistry::dump_status()
 {
 	tSS fmt;
+	log::err("Registry shards (items, locked, contended):\n");
+	for(auto& shard: m_shards)
+	{
+		lockguard g(shard);
+		fmt << " " << shard.items.size() << "/" << shard.nLocked.load()
+				<< "/" << shard.nContended.load();
+	}
+	log::err(fmt);
 	log::err("File descriptor table:\n");
-	for(const auto& item : mapItems)
+	for(auto& shard: m_shards)
 	{
-		fmt.clear();
-		fmt << "FREF: " << item.first << " [" << item.second->usercount << "]:\n";
-		if(! item.second)
+		lockguard g(shard);
+		for(const auto& item : shard.items)
 		{
-			fmt << "\tBAD REF!\n";
-			continue;
-		}
-		else
-		{
-			fmt << "\t" << item.second->m_sPathRel
-				<< "\n\tDlRefCount: " << item.second->m_nDlRefsCount
-				<< "\n\tState: " << (int)  item.second->m_status
-				<< "\n\tFilePos: " << item.second->m_nIncommingCount << " , "
-					//<< item.second->m_nRangeLimit << " , "
-				<< item.second->m_nSizeChecked << " , "
-					<< item.second->m_nSizeCachedInitial
-					<< "\n\tGotAt: " << item.second->m_nTimeDlStarted << "\n\n";
+			fmt.clear();
+			fmt << "FREF: " << item.first << " [" << item.second->usercount << "]:\n";
+			if(! item.second)
+			{
+				fmt << "\tBAD REF!\n";
+				continue;
+			}
+			else
+			{
+				fmt << "\t" << item.second->m_sPathRel
+					<< "\n\tDlRefCount: " << item.second->m_nDlRefsCount
+					<< "\n\tState: " << (int)  item.second->m_status
+					<< "\n\tFilePos: " << item.second->m_nIncommingCount << " , "
+						//<< item.second->m_nRangeLimit << " , "
+					<< item.second->m_nSizeChecked << " , "
+						<< item.second->m_nSizeCachedInitial
+						<< "\n\tGotAt: " << item.second->m_nTimeDlStarted << "\n\n";
+			}
+			log::err(fmt);
 		}
-		log::err(fmt);
 	}
 	log::flush();
 }
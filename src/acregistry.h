@@ -26,7 +26,7 @@ private:
 	explicit TFileItemHolder(const tFileItemPtr& p) : m_ptr(p) {}
 };
 
-class ACNG_API IFileItemRegistry : public base_with_mutex
+class ACNG_API IFileItemRegistry
 {
 public:
 
@@ -46,7 +46,11 @@ public:
 
 	virtual void AddToProlongedQueue(TFileItemHolder&&, time_t expTime) =0;
 
+	//! Must be called with the lock from LockForItem held
 	virtual void Unreg(fileitem& ptr) =0;
+
+	//! Lock the part of the registry where the item is registered
+	virtual lockuniq LockForItem(const fileitem& item) =0;
 };
 
 // global registry handling, used only in server
@@ -11,6 +11,9 @@
 #include "ac3rdparty.h"
 #include "filereader.h"
 #include "csmapping.h"
+#include "tcpconnect.h"
+#include "metadb.h"
+#include "fasttier.h"
 #ifdef DEBUG
 #include <regex.h>
 #endif
@@ -261,6 +264,8 @@ struct tAppStartStop
 		setup_sighandler();
 
 		SetupCacheDir();
+		// scan the metadata store before serving anything
+		metadb::Open();
 
 		//DelTree(cfg::cacheDirSlash + sReplDir);
 		SetupServerItemRegistry();
@@ -291,6 +296,9 @@ struct tAppStartStop
 				checkForceFclose(PID_FILE);
 			}
 		}
+		// not before forking, the worker thread would be lost
+		g_tcp_con_factory.StartPrewarm();
+		fasttier::Start();
 	}
 	~tAppStartStop()
 	{
@@ -299,6 +307,7 @@ struct tAppStartStop
 		if (!cfg::pidfile.empty())
 			unlink(cfg::pidfile.c_str());
 		conserver::Shutdown();
+		fasttier::Stop();
 		CloseAllCachedConnections();
 		TeardownServerItemRegistry();
 		TeardownCleaner();
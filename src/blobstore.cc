@@ -0,0 +1,168 @@
+#include "blobstore.h"
+#include "acfg.h"
+#include "meta.h"
+#include "debug.h"
+#include "fileio.h"
+#include "dirwalk.h"
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+using namespace std;
+
+namespace acng
+{
+namespace blobstore
+{
+
+enum : int
+{
+	MODE_OFF, MODE_HARDLINK, MODE_REFLINK
+};
+
+static bool IsDigest(cmstring& s)
+{
+	if (s.length() != 64)
+		return false;
+	for (auto c : s)
+		if (!isdigit((unsigned char) c) && (c < 'a' || c > 'f'))
+			return false;
+	return true;
+}
+
+static mstring BlobPath(cmstring& sSha256)
+{
+	return CACHE_BASE + cfg::privStoreRelBlobs + sPathSep + sSha256.substr(0, 2) + sPathSep + sSha256;
+}
+
+// another name for the contents, as link or as clone, depending on the mode
+static bool Clone(cmstring& sFrom, cmstring& sTo)
+{
+#ifdef FICLONE
+	if (cfg::dedup == MODE_REFLINK)
+	{
+		unique_fd src(open(sFrom.c_str(), O_RDONLY | O_BINARY));
+		if (src.m_p == -1)
+			return false;
+		unique_fd tgt(open(sTo.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_BINARY, cfg::fileperms));
+		if (tgt.m_p == -1)
+			return false;
+		if (0 == ioctl(tgt.m_p, FICLONE, src.m_p))
+			return true;
+		unlink(sTo.c_str());
+		return false;
+	}
+#endif
+	return 0 == link(sFrom.c_str(), sTo.c_str());
+}
+
+bool IsActive()
+{
+	return cfg::dedup > MODE_OFF;
+}
+
+bool Adopt(cmstring& sPathAbs, cmstring& sSha256, off_t size)
+{
+	LOGSTARTFUNCxs(sPathAbs, sSha256, size);
+	if (!IsActive() || size <= 0 || !IsDigest(sSha256))
+		return false;
+
+	auto sBlob(BlobPath(sSha256));
+	Cstat stBlob(sBlob);
+	if (!stBlob || stBlob.st_size != size)
+	{
+		// new contents, or replacing broken ones; the blob is always a plain link because
+		// that's how unused blobs are recognized, see Sweep
+		if (stBlob)
+			unlink(sBlob.c_str());
+		mkbasedir(sBlob);
+		if (0 != link(sPathAbs.c_str(), sBlob.c_str()) && errno != EEXIST)
+		{
+			LOG("cannot link to " << sBlob << ": " << tErrnoFmter());
+		}
+		return false;
+	}
+	Cstat stFile(sPathAbs);
+	if (!stFile || stFile.st_size != size
+			|| (stFile.st_ino == stBlob.st_ino && stFile.st_dev == stBlob.st_dev))
+	{
+		return false;
+	}
+	// readers of the old file keep their view, until then the blocks are not released
+	auto sTemp(sPathAbs + ".dedup");
+	unlink(sTemp.c_str());
+	if (!Clone(sBlob, sTemp))
+		return false;
+	if (0 != rename(sTemp.c_str(), sPathAbs.c_str()))
+	{
+		unlink(sTemp.c_str());
+		return false;
+	}
+	return true;
+}
+
+off_t Provide(cmstring& sSha256, cmstring& sPathAbs, time_t* pModTime)
+{
+	LOGSTARTFUNCxs(sSha256, sPathAbs);
+	if (!IsActive() || !IsDigest(sSha256))
+		return -1;
+	auto sBlob(BlobPath(sSha256));
+	Cstat stBlob(sBlob);
+	if (!stBlob)
+		return -1;
+	mkbasedir(sPathAbs);
+	if (!Clone(sBlob, sPathAbs))
+		return -1;
+	if (pModTime)
+		*pModTime = stBlob.st_mtime;
+	return stBlob.st_size;
+}
+
+unsigned Sweep()
+{
+	unsigned nRemoved = 0;
+	IFileHandler::FindFiles(CACHE_BASE + cfg::privStoreRelBlobs,
+			[&nRemoved](cmstring& sPath, const struct stat& st)
+			{
+				// not linked from the cache anymore
+				if (st.st_nlink <= 1 && 0 == unlink(sPath.c_str()))
+					nRemoved++;
+				return true;
+			}, true, false);
+	return nRemoved;
+}
+
+bool Unshare(cmstring& sPathAbs)
+{
+	Cstat st(sPathAbs);
+	if (!st || st.st_nlink < 2)
+		return true;
+	auto sTemp(sPathAbs + ".dedup");
+	unlink(sTemp.c_str());
+	if (FileCopy(sPathAbs, sTemp) || 0 != rename(sTemp.c_str(), sPathAbs.c_str()))
+	{
+		unlink(sTemp.c_str());
+		return false;
+	}
+	return true;
+}
+
+int TruncateUnshared(cmstring& sPathAbs)
+{
+	Cstat st(sPathAbs);
+	if (!st || st.st_nlink < 2)
+		return truncate(sPathAbs.c_str(), 0);
+	// replace with a new empty file
+	if (0 != unlink(sPathAbs.c_str()))
+		return -1;
+	unique_fd fd(open(sPathAbs.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_BINARY, cfg::fileperms));
+	return fd.m_p == -1 ? -1 : 0;
+}
+
+}
+}
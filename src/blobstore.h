@@ -0,0 +1,54 @@
+#ifndef BLOBSTORE_H
+#define BLOBSTORE_H
+
+#include "actypes.h"
+
+namespace acng
+{
+
+/**
+ * Content-addressed store of cached data (DedupStorage option).
+ *
+ * Completed downloads are registered with their SHA256 digest in the private cache area,
+ * as one hard link per distinct content. When the same content is stored again under a
+ * different name, that file is replaced by a link (or reflink) to the known one.
+ *
+ * Files in the cache may therefore share their inode with other files. Whoever modifies
+ * a cached file in-place must break the link first, see TruncateUnshared.
+ */
+namespace blobstore
+{
+
+//! Deduplication is enabled
+bool IsActive();
+
+/**
+ * Register a completely stored file with the digest of its contents. If the same
+ * contents are known already, the file is replaced with a link to them.
+ * @return true if the file was replaced
+ */
+bool Adopt(cmstring& sPathAbs, cmstring& sSha256, off_t size);
+
+/**
+ * Create a file from the known contents with the specified digest.
+ * @param pModTime Optional, receives the modification time of the stored contents
+ * @return Size of the created file, -1 if the contents are unknown or cannot be linked
+ */
+off_t Provide(cmstring& sSha256, cmstring& sPathAbs, time_t* pModTime = nullptr);
+
+/**
+ * Remove the stored contents which are no longer used by any cached file.
+ * @return Number of removed entries
+ */
+unsigned Sweep();
+
+//! Replace the file with a private copy if its contents are shared with other files
+bool Unshare(cmstring& sPathAbs);
+
+//! Like truncate(2) to zero length, but keeps the contents of other links to that file intact
+int TruncateUnshared(cmstring& sPathAbs);
+
+}
+}
+
+#endif // BLOBSTORE_H
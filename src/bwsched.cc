@@ -0,0 +1,192 @@
+#include "bwsched.h"
+#include "acfg.h"
+#include "ahttpurl.h"
+#include "remotedb.h"
+#include "evabase.h"
+#include "meta.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+
+// the bucket can save up at most this fraction of one second
+#define BW_BURST_DIVISOR 8
+#define BW_BURST_MIN 8192
+// drop dead entries from the registries when they grow beyond this
+#define BW_REG_SWEEP 64
+
+using namespace std;
+using namespace std::chrono;
+
+namespace acng
+{
+namespace bwsched
+{
+
+class tBucket
+{
+	mutex m_mx;
+	condition_variable m_cv;
+	const double m_rate, m_burst;
+	double m_tokens;
+	steady_clock::time_point m_last;
+	// start tag of the request served most recently
+	double m_vtime = 0;
+	uint64_t m_nSeq = 0;
+	// waiting requests, by start tag and arrival
+	set<pair<double, uint64_t>> m_queue;
+
+	void Refill()
+	{
+		auto now = steady_clock::now();
+		m_tokens = min(m_burst, m_tokens + m_rate * duration<double>(now - m_last).count());
+		m_last = now;
+	}
+
+public:
+	tBucket(uint64_t rate) :
+			m_rate(rate), m_burst(max(double(rate / BW_BURST_DIVISOR), double(BW_BURST_MIN))),
+			m_tokens(m_burst), m_last(steady_clock::now())
+	{
+	}
+
+	size_t GetBurst() const { return m_burst; }
+
+	void Take(size_t n, double weight, double &tag)
+	{
+		unique_lock<mutex> g(m_mx);
+		auto start = max(m_vtime, tag);
+		tag = start + n / weight;
+		auto me = m_queue.emplace(start, ++m_nSeq).first;
+		while (true)
+		{
+			if (m_queue.begin() != me)
+			{
+				m_cv.wait(g);
+				continue;
+			}
+			Refill();
+			if (m_tokens >= n || evabase::in_shutdown)
+				break;
+			m_cv.wait_for(g, duration<double>((n - m_tokens) / m_rate));
+		}
+		m_tokens -= n;
+		m_vtime = start;
+		m_queue.erase(me);
+		m_cv.notify_all();
+	}
+
+	void Refund(size_t n, double weight, double &tag)
+	{
+		lock_guard<mutex> g(m_mx);
+		m_tokens = min(m_burst, m_tokens + n);
+		tag -= n / weight;
+	}
+};
+
+shared_ptr<tBucket> MakeBucket(uint64_t rate)
+{
+	return make_shared<tBucket>(rate);
+}
+
+tFlow::tFlow(vector<shared_ptr<tBucket>> chain, unsigned weight) :
+		m_weight(max(weight, 1u)), m_nMaxTake(MAX_VAL(size_t))
+{
+	for (auto& b : chain)
+	{
+		m_nMaxTake = min(m_nMaxTake, b->GetBurst());
+		m_chain.push_back({move(b), 0});
+	}
+}
+
+size_t tFlow::Acquire(size_t nWanted)
+{
+	nWanted = min(nWanted, m_nMaxTake);
+	if (!nWanted)
+		return 0;
+	for (auto& l : m_chain)
+		l.bucket->Take(nWanted, m_weight, l.tag);
+	return nWanted;
+}
+
+void tFlow::Refund(size_t nUnused)
+{
+	if (!nUnused)
+		return;
+	for (auto& l : m_chain)
+		l.bucket->Refund(nUnused, m_weight, l.tag);
+}
+
+// the shared buckets live as long as some flow uses them
+static mutex g_regMx;
+static weak_ptr<tBucket> g_dlBucket, g_serveBucket;
+static unordered_map<string, weak_ptr<tBucket>> g_hostBuckets;
+static map<const tRepoData*, weak_ptr<tBucket>> g_repoBuckets;
+static unordered_map<string, weak_ptr<tFlow>> g_clientFlows;
+
+template<typename TMap>
+static void Sweep(TMap& reg)
+{
+	if (reg.size() < BW_REG_SWEEP)
+		return;
+	for (auto it = reg.begin(); it != reg.end();)
+		it = it->second.expired() ? reg.erase(it) : next(it);
+}
+
+template<typename T>
+static shared_ptr<T> Lookup(weak_ptr<T>& ref, std::function<shared_ptr<T>()> creator)
+{
+	auto ret = ref.lock();
+	if (!ret)
+		ref = ret = creator();
+	return ret;
+}
+
+tFlowPtr GetDownloadFlow(const tHttpUrl& host, const tRepoData* repo)
+{
+	vector<shared_ptr<tBucket>> chain;
+	lock_guard<mutex> g(g_regMx);
+	if (repo && repo->m_nMaxDlSpeed > 0)
+	{
+		Sweep(g_repoBuckets);
+		chain.emplace_back(Lookup<tBucket>(g_repoBuckets[repo],
+				[&]() { return MakeBucket(uint64_t(repo->m_nMaxDlSpeed) * 1024); }));
+	}
+	if (cfg::maxdlspeedperhost > 0)
+	{
+		Sweep(g_hostBuckets);
+		chain.emplace_back(Lookup<tBucket>(g_hostBuckets[host.GetHostPortKey()],
+				[]() { return MakeBucket(uint64_t(cfg::maxdlspeedperhost) * 1024); }));
+	}
+	if (cfg::maxdlspeed != cfg::RESERVED_DEFVAL && cfg::maxdlspeed > 0)
+	{
+		chain.emplace_back(Lookup<tBucket>(g_dlBucket,
+				[]() { return MakeBucket(uint64_t(cfg::maxdlspeed) * 1024); }));
+	}
+	if (chain.empty())
+		return tFlowPtr();
+	return make_shared<tFlow>(move(chain), repo ? repo->m_nDlWeight : 1);
+}
+
+tFlowPtr GetServeFlow(cmstring& clientHost)
+{
+	if (cfg::maxservespeed <= 0)
+		return tFlowPtr();
+	lock_guard<mutex> g(g_regMx);
+	Sweep(g_clientFlows);
+	auto& ref = g_clientFlows[clientHost];
+	auto ret = ref.lock();
+	if (ret)
+		return ret;
+	auto bucket = Lookup<tBucket>(g_serveBucket,
+			[]() { return MakeBucket(uint64_t(cfg::maxservespeed) * 1024); });
+	ref = ret = make_shared<tFlow>(vector<shared_ptr<tBucket>> { bucket }, 1);
+	return ret;
+}
+
+}
+}
@@ -0,0 +1,71 @@
+#ifndef BWSCHED_H
+#define BWSCHED_H
+
+#include "actypes.h"
+
+#include <memory>
+#include <vector>
+
+namespace acng
+{
+class tHttpUrl;
+struct tRepoData;
+
+/**
+ * Central bandwidth scheduling with token buckets. A flow (a download stream, or all
+ * connections of one client) takes its data quota from a chain of buckets, e.g. the
+ * global download limit, the limit of the remote host and the limit of the repository.
+ * Flows competing for the same bucket are served in start-time fair queuing order,
+ * proportionally to their weights.
+ */
+namespace bwsched
+{
+
+class tBucket;
+
+//! Token bucket, rate in bytes per second
+std::shared_ptr<tBucket> MakeBucket(uint64_t rate);
+
+class tFlow
+{
+public:
+	tFlow(std::vector<std::shared_ptr<tBucket>> chain, unsigned weight);
+
+	/**
+	 * Wait until the data quota is granted by all buckets.
+	 * @return Granted amount, less than nWanted if that exceeds the burst size of a bucket
+	 */
+	size_t Acquire(size_t nWanted);
+	//! Return the unused part of the last grant
+	void Refund(size_t nUnused);
+
+private:
+	struct tLink
+	{
+		std::shared_ptr<tBucket> bucket;
+		// finish tag of the last request in the virtual time of the bucket
+		double tag;
+	};
+	std::vector<tLink> m_chain;
+	double m_weight;
+	size_t m_nMaxTake;
+};
+typedef std::shared_ptr<tFlow> tFlowPtr;
+
+/**
+ * Flow for downloading from a remote host, limited by MaxDlSpeed, MaxDlSpeedPerHost and
+ * the limit of the repository (if specified).
+ * @return nullptr if no limit applies
+ */
+tFlowPtr GetDownloadFlow(const tHttpUrl& host, const tRepoData* repo);
+
+/**
+ * Flow shared by all connections of a client, limited by MaxServeSpeed.
+ * @return nullptr if no limit applies
+ */
+tFlowPtr GetServeFlow(cmstring& clientHost);
+
+}
+}
+
+#endif // BWSCHED_H
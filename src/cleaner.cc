@@ -176,7 +176,8 @@ void cleaner::dump_status()
 }
 
 void ACNG_API dump_handler(evutil_socket_t fd, short what, void *arg) {
-	// XXX: access the global instance? TFileItemHolder::dump_status();
+	if (g_registry)
+		g_registry->dump_status();
 	cleaner::GetInstance().dump_status();
 	g_tcp_con_factory.dump_status();
 	cfg::dump_trace();
@@ -13,11 +13,14 @@
 #include "lockable.h"
 #include "sockio.h"
 #include "evabase.h"
+#include "fileio.h"
 
 #include <iostream>
 #include <thread>
+#include <unordered_set>
 
-#include <sys/select.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <string.h>
 #include <errno.h>
@@ -41,6 +44,7 @@ class conn::Impl
 	bool m_badState = false;
 
 	deque<job> m_jobs2send;
+	acbuf m_inBuf;
 
 #ifdef KILLABLE
       // to awake select with dummy data
@@ -103,7 +107,8 @@ class conn::Impl
 		conserver::FinishConnection(m_confd);
 	}
 
-  	void WorkLoop();
+	bool WorkLoop(bool bReturnWhenIdle);
+	void ReleaseIdleResources();
 };
 
 // call forwarding
@@ -112,7 +117,8 @@ conn::conn(unique_fd&& fd, mstring sClient, std::shared_ptr<IFileItemRegistry> i
 
 std::shared_ptr<IFileItemRegistry> conn::GetItemRegistry() { return _p->m_itemRegistry; };
 conn::~conn() { delete _p; }
-void conn::WorkLoop() {	_p->WorkLoop(); }
+bool conn::WorkLoop(bool bReturnWhenIdle) { return _p->WorkLoop(bReturnWhenIdle); }
+int conn::GetFD() const { return _p->m_confd; }
 void conn::LogDataCounts(cmstring &file, mstring xff, off_t countIn, off_t countOut,
         bool bAsError) {return _p->LogDataCounts(file, move(xff), countIn, countOut, bAsError); }
 dlcon* conn::SetupDownloader()
@@ -141,7 +147,225 @@ inline static void RedirectBto2https(int fdClient, cmstring& uri)
 	// fully stupid client should cope with that. Maybe this should be investigate better.
 	return;
 }
-void PassThrough(acbuf &clientBufIn, int fdClient, cmstring& uri)
+#ifdef HAVE_LINUX_SPLICE
+/**
+ * Tunnel relay running in the event loop. Data is moved between the sockets through
+ * kernel pipes, without copying it to user space.
+ */
+class tSpliceRelay
+{
+	struct tDirection
+	{
+		int from = -1, to = -1;
+		int pipe[2] = { -1, -1 };
+		size_t nInPipe = 0;
+		bool eof = false, done = false;
+		event *evRead = nullptr, *evWrite = nullptr;
+	};
+	tDirection m_c2s, m_s2c;
+	tDlStreamHandle m_upstream;
+	int m_fdClient;
+
+	// how many socket reads per wakeup, to not starve other connections
+	static constexpr int MAX_ROUNDS = 16;
+	static constexpr size_t MAX_CHUNK = 64 * 1024;
+
+	// running relays, only used in the event thread; they are found through this at teardown
+	// since their own events might be inactive at that moment
+	static inline std::unordered_set<tSpliceRelay*> s_running;
+	static inline event *s_marker = nullptr;
+
+	tSpliceRelay(tDlStreamHandle upstream, int fdClient) : m_upstream(move(upstream)), m_fdClient(fdClient)
+	{
+		m_c2s.from = m_s2c.to = fdClient;
+		m_c2s.to = m_s2c.from = m_upstream->GetFD();
+	}
+
+public:
+	~tSpliceRelay()
+	{
+		for (auto d : { &m_c2s, &m_s2c })
+		{
+			if (d->evRead)
+				event_free(d->evRead);
+			if (d->evWrite)
+				event_free(d->evWrite);
+			checkforceclose(d->pipe[0]);
+			checkforceclose(d->pipe[1]);
+		}
+		m_upstream.reset();
+		conserver::FinishConnection(m_fdClient);
+		s_running.erase(this);
+	}
+
+private:
+
+	/**
+	 * Push pipe contents to the target and adjust the event interest.
+	 * @return false on fatal errors
+	 */
+	bool Flush(tDirection &d)
+	{
+		while (d.nInPipe > 0)
+		{
+			auto n = splice(d.pipe[0], nullptr, d.to, nullptr, d.nInPipe,
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n > 0)
+			{
+				d.nInPipe -= n;
+				continue;
+			}
+			if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			{
+				// target is congested, stop reading until it can take more
+				event_del(d.evRead);
+				event_add(d.evWrite, nullptr);
+				return true;
+			}
+			return false;
+		}
+		event_del(d.evWrite);
+		if (d.eof)
+		{
+			shutdown(d.to, SHUT_WR);
+			d.done = true;
+			event_del(d.evRead);
+		}
+		else
+			event_add(d.evRead, nullptr);
+		return true;
+	}
+
+	bool Pump(tDirection &d)
+	{
+		for (int i = 0; i < MAX_ROUNDS && !d.eof; ++i)
+		{
+			auto n = splice(d.from, nullptr, d.pipe[1], nullptr, MAX_CHUNK,
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n == 0)
+				d.eof = true;
+			else if (n > 0)
+				d.nInPipe += n;
+			else if (errno == EINTR)
+				continue;
+			else if (errno != EAGAIN)
+				return false;
+
+			if (!Flush(d))
+				return false;
+			// nothing more to read now or target is congested?
+			if (n < 0 || d.nInPipe > 0)
+				break;
+		}
+		return true;
+	}
+
+	static void cb_io(evutil_socket_t fd, short what, void *arg)
+	{
+		auto me = (tSpliceRelay*) arg;
+		auto& d = (what & EV_READ)
+				? (fd == me->m_fdClient ? me->m_c2s : me->m_s2c)
+				: (fd == me->m_fdClient ? me->m_s2c : me->m_c2s);
+		bool ok = !evabase::in_shutdown
+				&& ((what & EV_READ) ? me->Pump(d) : me->Flush(d));
+		if (!ok || (me->m_c2s.done && me->m_s2c.done))
+			delete me;
+	}
+
+	// callback of the marker event, which only exists to be found by the teardown hook
+	static void cb_teardown(evutil_socket_t, short, void*)
+	{
+		if (!evabase::in_shutdown)
+			return;
+		auto relays = move(s_running);
+		for (auto p : relays)
+			delete p;
+		if (s_marker)
+			event_free(s_marker);
+		s_marker = nullptr;
+	}
+
+public:
+	/**
+	 * Prepare and start the relay. On success, the client socket belongs to the relay.
+	 * @param pending Data which was already received from the client
+	 * @return false if splice cannot be used for this connection
+	 */
+	static bool Start(tDlStreamHandle& upstream, int fdClient, acbuf &pending)
+	{
+#ifdef HAVE_SSL
+		if (upstream->GetBIO())
+			return false;
+#endif
+		unique_ptr<tSpliceRelay> relay(new tSpliceRelay(upstream, fdClient));
+		auto giveUp = [&relay]() { relay->m_fdClient = -1; return false; };
+		for (auto d : { &relay->m_c2s, &relay->m_s2c })
+		{
+			if (pipe2(d->pipe, O_NONBLOCK | O_CLOEXEC))
+				return giveUp();
+			evutil_make_socket_nonblocking(d->from);
+		}
+		if (!pending.empty())
+		{
+			auto n = write(relay->m_c2s.pipe[1], pending.rptr(), pending.size());
+			if (n != (ssize_t) pending.size())
+				return giveUp();
+			relay->m_c2s.nInPipe = n;
+			pending.clear();
+		}
+		upstream.reset();
+		evabase::Post([me = relay.release()](bool down)
+		{
+			if (down)
+			{
+				delete me;
+				return;
+			}
+			if (!s_marker)
+			{
+				// a long period, firing is harmless
+				timeval tmout { 86400, 0 };
+				s_marker = event_new(evabase::base, -1, EV_PERSIST, cb_teardown, nullptr);
+				if (!s_marker || event_add(s_marker, &tmout))
+				{
+					if (s_marker)
+						event_free(s_marker);
+					s_marker = nullptr;
+					delete me;
+					return;
+				}
+				static bool teardownRegistered = false;
+				if (!teardownRegistered)
+				{
+					teardownRegistered = true;
+					evabase::addTeardownAction(cb_teardown, [](t_event_desctor el) {
+						el.callback(el.fd, EV_TIMEOUT, el.arg);
+					});
+				}
+			}
+			s_running.insert(me);
+			auto& c2s = me->m_c2s;
+			auto& s2c = me->m_s2c;
+			c2s.evRead = event_new(evabase::base, c2s.from, EV_READ | EV_PERSIST, cb_io, me);
+			c2s.evWrite = event_new(evabase::base, c2s.to, EV_WRITE | EV_PERSIST, cb_io, me);
+			s2c.evRead = event_new(evabase::base, s2c.from, EV_READ | EV_PERSIST, cb_io, me);
+			s2c.evWrite = event_new(evabase::base, s2c.to, EV_WRITE | EV_PERSIST, cb_io, me);
+			if (!c2s.evRead || !c2s.evWrite || !s2c.evRead || !s2c.evWrite
+					|| !me->Flush(c2s) || !me->Flush(s2c))
+			{
+				delete me;
+			}
+		});
+		return true;
+	}
+};
+#endif
+
+/**
+ * Connect to the target and forward data in both directions.
+ * @return true if the client connection was handed over to an asynchronous relay
+ */
+bool PassThrough(acbuf &clientBufIn, int fdClient, cmstring& uri)
 {
 	tDlStreamHandle m_spOutCon;
 
@@ -152,7 +376,7 @@ void PassThrough(acbuf &clientBufIn, int fdClient, cmstring& uri)
 	// arbitrary target/port, client cares about SSL handshake and other stuff
 	tHttpUrl url;
 	if (!url.SetHttpUrl(uri))
-		return;
+		return false;
 	auto proxy = cfg::GetProxyInfo();
 
 	signal(SIGPIPE, SIG_IGN);
@@ -192,71 +416,92 @@ void PassThrough(acbuf &clientBufIn, int fdClient, cmstring& uri)
 	{
 		clientBufOut << "HTTP/1.0 502 CONNECT error: " << sErr << "\r\n\r\n";
 		clientBufOut.send(fdClient);
-		return;
+		return false;
 	}
 
 	if (!m_spOutCon)
-		return;
+		return false;
+
+#ifdef HAVE_LINUX_SPLICE
+	if (clientBufOut.dumpall(fdClient) < 0)
+		return false;
+	if (clientBufOut.empty() && tSpliceRelay::Start(m_spOutCon, fdClient, clientBufIn))
+		return true;
+#endif
 
 	// for convenience
 	int ofd = m_spOutCon->GetFD();
 	acbuf &serverBufOut = clientBufIn, &serverBufIn = clientBufOut;
 
-	int maxfd = 1 + std::max(fdClient, ofd);
-
 	while (true)
 	{
-		fd_set rfds, wfds;
-		FD_ZERO(&rfds);
-		FD_ZERO(&wfds);
+		pollfd pfds[2] { { fdClient, 0, 0 }, { ofd, 0, 0 } };
+		auto &pcli = pfds[0], &psrv = pfds[1];
 
 		// can send to client?
 		if (clientBufOut.size() > 0)
-			FD_SET(fdClient, &wfds);
+			pcli.events |= POLLOUT;
 
 		// can receive from client?
 		if (clientBufIn.freecapa() > 0)
-			FD_SET(fdClient, &rfds);
+			pcli.events |= POLLIN;
 
 		if (serverBufOut.size() > 0)
-			FD_SET(ofd, &wfds);
+			psrv.events |= POLLOUT;
 
 		if (serverBufIn.freecapa() > 0)
-			FD_SET(ofd, &rfds);
+			psrv.events |= POLLIN;
 
-		int nReady = select(maxfd, &rfds, &wfds, nullptr, nullptr);
+		int nReady = poll(pfds, 2, -1);
 		if (nReady < 0)
-			return;
+		{
+			if (EINTR == errno)
+				continue;
+			return false;
+		}
 
-		if (FD_ISSET(ofd, &wfds))
+		if (psrv.revents & POLLOUT)
 		{
 			if (serverBufOut.dumpall(ofd) < 0)
-				return;
+				return false;
 		}
 
-		if (FD_ISSET(fdClient, &wfds))
+		if (pcli.revents & POLLOUT)
 		{
 			if (clientBufOut.dumpall(fdClient) < 0)
-				return;
+				return false;
 		}
 
-		if (FD_ISSET(ofd, &rfds))
+		if (psrv.revents & (POLLIN | POLLHUP | POLLERR))
 		{
 			if (serverBufIn.sysread(ofd) <= 0)
-				return;
+				return false;
 		}
 
-		if (FD_ISSET(fdClient, &rfds))
+		if (pcli.revents & (POLLIN | POLLHUP | POLLERR))
 		{
 			if (clientBufIn.sysread(fdClient) <= 0)
-				return;
+				return false;
 		}
 	}
-	return;
+	return false;
+}
 }
+
+void conn::Impl::ReleaseIdleResources()
+{
+	// the downloader is created again on demand, its connection goes back to the pool
+	if(m_pDlClient)
+		m_pDlClient->SignalStop();
+	if(m_dlerthr.joinable())
+		m_dlerthr.join();
+	m_pDlClient.reset();
+	m_inBuf.clear();
+	m_inBuf.setsize(0);
+	log::flush();
 }
 
-void conn::Impl::WorkLoop() {
+bool conn::Impl::WorkLoop(bool bReturnWhenIdle) {
 
 	LOGSTART("con::WorkLoop");
 
@@ -273,28 +518,33 @@ void conn::Impl::WorkLoop() {
 	});
 #endif
 
-	acbuf inBuf;
-	inBuf.setsize(32*1024);
+	auto& inBuf = m_inBuf;
+	if(!inBuf.setsize(32*1024))
+		return false;
 
 	// define a much shorter timeout than network timeout in order to be able to disconnect bad clients quickly
 	auto client_timeout(GetTime() + cfg::nettimeout);
 
-	int maxfd=m_confd;
-	while(!evabase::in_shutdown && !m_badState) {
-		fd_set rfds, wfds;
-		FD_ZERO(&wfds);
-		FD_ZERO(&rfds);
+	// when resumed, the caller has seen incoming data, therefore don't return before having read it
+	for(bool bMayReturn = false; !evabase::in_shutdown && !m_badState; bMayReturn = bReturnWhenIdle)
+	{
+		if(bMayReturn && m_jobs2send.empty() && inBuf.empty())
+		{
+			ldbg("connection idle, releasing");
+			ReleaseIdleResources();
+			return true;
+		}
 
-		FD_SET(m_confd, &rfds);
 		if(inBuf.freecapa()==0)
-			return; // shouldn't even get here
+			return false; // shouldn't even get here
 
 		bool hasMoreJobs = m_jobs2send.size()>1;
 
-		if ( !m_jobs2send.empty()) FD_SET(m_confd, &wfds);
+		pollfd pfd { m_confd, POLLIN, 0 };
+		if ( !m_jobs2send.empty()) pfd.events |= POLLOUT;
 
-		ldbg("select con");
-		int ready = select(maxfd+1, &rfds, &wfds, nullptr, CTimeVal().For(SHORT_TIMEOUT));
+		ldbg("poll con");
+		int ready = poll(&pfd, 1, SHORT_TIMEOUT * 1000);
 
 		if(evabase::in_shutdown)
 			break;
@@ -304,7 +554,7 @@ void conn::Impl::WorkLoop() {
 			if(GetTime() > client_timeout)
 			{
 				USRDBG("Timeout occurred, apt client disappeared silently?");
-				return; // yeah, time to leave
+				return false; // yeah, time to leave
 			}
 			continue;
 		}
@@ -313,8 +563,8 @@ void conn::Impl::WorkLoop() {
 			if (EINTR == errno)
 				continue;
 
-			ldbg("select error in con, errno: " << errno);
-			return; // FIXME: good error message?
+			ldbg("poll error in con, errno: " << errno);
+			return false; // FIXME: good error message?
 		}
 		else
 		{
@@ -322,9 +572,9 @@ void conn::Impl::WorkLoop() {
 			client_timeout = GetTime() + cfg::nettimeout;
 		}
 
-		ldbg("select con back");
+		ldbg("poll con back");
 
-		if(FD_ISSET(m_confd, &rfds))
+		if(pfd.revents & (POLLIN | POLLHUP | POLLERR))
 		{
 			int n=inBuf.sysread(m_confd);
 			ldbg("got data: " << n <<", inbuf size: "<< inBuf.size());
@@ -335,7 +585,7 @@ void conn::Impl::WorkLoop() {
 				else
 				{
 					ldbg("client closed connection");
-					return;
+					return false;
 				}
 			}
         }
@@ -356,7 +606,7 @@ void conn::Impl::WorkLoop() {
 				if(nHeadBytes < 0)
 				{
 					ldbg("Bad request: " << inBuf.rptr() );
-					return;
+					return false;
 				}
 
 				// also must be identified before
@@ -373,10 +623,10 @@ void conn::Impl::WorkLoop() {
 							ldbg("not bugs.d.o: " << inBuf.rptr());
 						}
 						// disconnect anyhow
-						return;
+						return false;
 					}
 					ldbg("not allowed POST request: " << inBuf.rptr());
-					return;
+					return false;
 				}
 
 				if(h.type == header::CONNECT)
@@ -384,7 +634,11 @@ void conn::Impl::WorkLoop() {
 					const auto& tgt = h.getRequestUrl();
 					inBuf.drop(nHeadBytes);
 					if(rex::Match(tgt, rex::PASSTHROUGH))
-						RawPassThrough::PassThrough(inBuf, m_confd, tgt);
+					{
+						// the relay owns the client socket now
+						if (RawPassThrough::PassThrough(inBuf, m_confd, tgt))
+							m_confd = -1;
+					}
 					else
 					{
 						tSS response;
@@ -392,7 +646,7 @@ void conn::Impl::WorkLoop() {
 						response.dumpall(m_confd);
 					}
 
-					return;
+					return false;
 				}
 
 				if (m_sClientHost.empty()) // may come from wrapper... MUST identify itself
@@ -406,7 +660,7 @@ void conn::Impl::WorkLoop() {
 						continue; // OK
 					}
 					else
-						return;
+						return false;
 				}
 
 				ldbg("Parsed REQUEST: " << h.type << " " << h.getRequestUrl());
@@ -414,7 +668,7 @@ void conn::Impl::WorkLoop() {
                 m_jobs2send.emplace_back(*_q);
 				m_jobs2send.back().Prepare(h, inBuf.view(), m_sClientHost);
 				if (m_badState)
-					return;
+					return false;
 				inBuf.drop(nHeadBytes);
 #ifdef DEBUG
 				m_nProcessedJobs++;
@@ -422,14 +676,14 @@ void conn::Impl::WorkLoop() {
 			}
 			catch(const bad_alloc&)
 			{
-				return;
+				return false;
 			}
 		}
 
 		if(inBuf.freecapa()==0)
-			return; // cannot happen unless being attacked
+			return false; // cannot happen unless being attacked
 
-		if(FD_ISSET(m_confd, &wfds) && !m_jobs2send.empty())
+		if((pfd.revents & POLLOUT) && !m_jobs2send.empty())
 		{
 			try
 			{
@@ -438,7 +692,7 @@ void conn::Impl::WorkLoop() {
 				case(job::R_DISCON):
 				{
 					ldbg("Disconnect advise received, stopping connection");
-					return;
+					return false;
 				}
 				case(job::R_DONE):
 				{
@@ -457,10 +711,11 @@ void conn::Impl::WorkLoop() {
 			}
 			catch(...)
 			{
-				return;
+				return false;
 			}
 		}
 	}
+	return false;
 }
 
 bool conn::Impl::SetupDownloader()
@@ -473,7 +728,13 @@ bool conn::Impl::SetupDownloader()
 
 	try
 	{
-		m_pDlClient = dlcon::CreateRegular(g_tcp_con_factory);
+		if (cfg::dlthreads > 0)
+		{
+			// agents are shared and already running
+			m_pDlClient = dlcon::GetShared(g_tcp_con_factory);
+			return true;
+		}
+		m_pDlClient = dlcon::CreateRegular(g_tcp_con_factory, max(cfg::clientdlstreams, 1));
 		if(!m_pDlClient)
 			return false;
 		auto pin = m_pDlClient;
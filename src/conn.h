@@ -25,7 +25,13 @@ class conn : public ISharedConnectionResources
 public:
 	conn(unique_fd&& fd, mstring sClient, std::shared_ptr<IFileItemRegistry>);
 	virtual ~conn();
-	void WorkLoop();
+	/**
+	 * Serve the client connection.
+	 * @param bReturnWhenIdle Stop processing when all responses are sent and no further request data is pending
+	 * @return true if returned because of idle state (see above) and the connection can be resumed later, false if the connection shall be terminated
+	 */
+	bool WorkLoop(bool bReturnWhenIdle = false);
+	int GetFD() const;
 
 	dlcon* SetupDownloader() override;
     void LogDataCounts(cmstring & sFile, mstring xff, off_t nNewIn,
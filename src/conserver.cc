@@ -12,6 +12,7 @@
 #include "evabase.h"
 #include "acregistry.h"
 #include "tpool.h"
+#include "dlcon.h"
 #include "portutils.h"
 
 #include <signal.h>
@@ -50,13 +51,107 @@ const struct timeval g_resumeTimeout { 2, 11 };
 
 SHARED_PTR<tpool> g_tpool;
 
-void SetupConAndGo(unique_fd&& man_fd, const char *szClientName, const char *portName)
+/**
+ * Extra accept loop with its own event base, serving one of the SO_REUSEPORT sockets
+ * of each TCP listener address.
+ */
+struct tAcceptor
+{
+	event_base *base = nullptr;
+	std::thread thr;
+	std::vector<event*> events;
+};
+std::vector<std::unique_ptr<tAcceptor>> g_acceptors;
+
+/**
+ * Idle client connection waiting in the event loop for the next request.
+ */
+struct tParkedConn
+{
+	unique_ptr<conn> c;
+	event *ev = nullptr;
+	~tParkedConn() { if (ev) event_free(ev); }
+};
+
+void cb_wake_parked(evutil_socket_t, short what, void* arg);
+
+// must run on the IO thread
+void ParkConnection(unique_ptr<conn> c)
+{
+	auto p = make_unique<tParkedConn>();
+	p->c = move(c);
+	p->ev = event_new(evabase::base, p->c->GetFD(), EV_READ, cb_wake_parked, p.get());
+	if (!p->ev)
+		return;
+	timeval tmout { cfg::nettimeout, 0 };
+	if (0 == event_add(p->ev, &tmout))
+		p.release();
+}
+
+void ParkConnectionAsync(unique_ptr<conn> c)
+{
+	evabase::Post([pc = c.release()](bool down)
+	{
+		unique_ptr<conn> c(pc);
+		if (!down)
+			ParkConnection(move(c));
+	});
+}
+
+// runs in a pool thread until the connection is finished or idle again
+void ServeConnection(unique_ptr<conn> c)
+{
+	try
+	{
+		if (!c->WorkLoop(cfg::parkidle))
+			return;
+	}
+	catch (...)
+	{
+		return;
+	}
+	ParkConnectionAsync(move(c));
+}
+
+void cb_wake_parked(evutil_socket_t, short what, void* arg)
+{
+	unique_ptr<tParkedConn> p((tParkedConn*) arg);
+	// on timeout, the connection is dropped now
+	if (evabase::in_shutdown || !(what & EV_READ))
+		return;
+	try
+	{
+		// cannot move things into a lambda, capture it later again
+		std::function<void()> act = [pc = p->c.get()]()
+		{
+			ServeConnection(unique_ptr<conn>(pc));
+		};
+		if (g_tpool->schedule(move(act)))
+			p->c.release();
+	}
+	catch (const std::bad_alloc&)
+	{
+		// ignored, connection is dropped
+	}
+}
+
+void SetupConAndGo(unique_fd&& man_fd, const char *szClientName, const char *portName, bool bOnIoThread)
 {
 	LOGSTARTFUNCs;
 	string sClient(szClientName ? szClientName : "");
 	USRDBG("Client name: " << sClient << ":" << portName);
 	try
 	{
+		if (cfg::parkidle)
+		{
+			// nothing to do until the client sends something
+			auto c = make_unique<conn>(move(man_fd), move(sClient), g_registry);
+			if (bOnIoThread)
+				ParkConnection(move(c));
+			else
+				ParkConnectionAsync(move(c));
+			return;
+		}
 		// cannot move things into a lambda, capture it later again
 		std::function<void()> act = [fd = man_fd.release(), sClient = move(sClient)]() mutable
 		{
@@ -88,14 +183,27 @@ void do_accept(evutil_socket_t server_fd, short, void* arg)
 	LOGSTARTFUNCxs(server_fd);
 	auto self((event*)arg);
 
+	auto evb = event_get_base(self);
+	bool bOnIoThread = evb == evabase::base;
+
 	if(evabase::in_shutdown)
 	{
+		// acceptor threads are cleaned up in Shutdown(), until then the pending connections
+		// must not keep waking this one up
+		if (!bOnIoThread)
+		{
+			event_del(self);
+			return;
+		}
 		close(server_fd);
 		event_free(self);
 		return;
 	}
 
-	evabase::CheckDnsChange();
+	if (bOnIoThread)
+		evabase::CheckDnsChange();
+	else
+		evabase::Post([](bool down) { if (!down) evabase::CheckDnsChange(); });
 
 	struct sockaddr_storage addr;
 	socklen_t addrlen = sizeof(addr);
@@ -119,7 +227,7 @@ void do_accept(evutil_socket_t server_fd, short, void* arg)
 		case ENOMEM:
 			// resource exhaustion, might recover when another connection handler has stopped, disconnect this one for now
 			event_del(self);
-			event_base_once(evabase::base, -1, EV_TIMEOUT, cb_resume, self, &g_resumeTimeout);
+			event_base_once(evb, -1, EV_TIMEOUT, cb_resume, self, &g_resumeTimeout);
 			return;
 		default:
 			return;
@@ -132,7 +240,7 @@ void do_accept(evutil_socket_t server_fd, short, void* arg)
 	if (addr.ss_family == AF_UNIX)
 	{
 		USRDBG("Detected incoming connection from the UNIX socket");
-		SetupConAndGo(move(man_fd), nullptr, "unix");
+		SetupConAndGo(move(man_fd), nullptr, "unix", bOnIoThread);
 	}
 	else
 	{
@@ -150,6 +258,8 @@ void do_accept(evutil_socket_t server_fd, short, void* arg)
 		{
 #ifdef HAVE_LIBWRAP
 				// libwrap is non-reentrant stuff, call it from here only
+				static std::mutex wrapMx;
+				lockguard g(wrapMx);
 				request_info req;
 				request_init(&req, RQ_DAEMON, "apt-cacher-ng", RQ_FILE, fd, 0);
 				fromhost(&req);
@@ -163,11 +273,12 @@ void do_accept(evutil_socket_t server_fd, short, void* arg)
 					"WARNING: attempted to use libwrap which was not enabled at build time");
 #endif
 		}
-		SetupConAndGo(move(man_fd), hbuf, pbuf);
+		SetupConAndGo(move(man_fd), hbuf, pbuf, bOnIoThread);
 	}
 }
 
-bool bind_and_listen(evutil_socket_t mSock, const addrinfo *pAddrInfo, uint16_t port)
+bool bind_and_listen(evutil_socket_t mSock, const addrinfo *pAddrInfo, uint16_t port,
+		tAcceptor *pAcceptor = nullptr)
 {
 	LOGSTARTFUNCs;
 	USRDBG("Binding " << acng_addrinfo::formatIpPort(pAddrInfo->ai_addr, pAddrInfo->ai_addrlen, pAddrInfo->ai_family));
@@ -191,13 +302,15 @@ bool bind_and_listen(evutil_socket_t mSock, const addrinfo *pAddrInfo, uint16_t
 		perror("Couldn't listen on socket");
 		return false;
 	}
-	auto ev = event_new(evabase::base, mSock, EV_READ|EV_PERSIST, do_accept, event_self_cbarg());
+	auto ev = event_new(pAcceptor ? pAcceptor->base : evabase::base, mSock, EV_READ|EV_PERSIST, do_accept, event_self_cbarg());
 	if(!ev)
 	{
 		cerr << "Socket creation error" << endl;
 		return false;
 	}
 	event_add(ev, nullptr);
+	if (pAcceptor)
+		pAcceptor->events.emplace_back(ev);
 	return true;
 };
 
@@ -229,33 +342,43 @@ unsigned setup_tcp_listeners(LPCSTR addi, uint16_t port)
 		// no fit or or seen before?
 		if(!dedup.emplace((const char*) p->ai_addr, p->ai_addrlen).second)
 			continue;
-		int nSockFd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-		if (nSockFd == -1)
+		// one socket for the main thread, or one for each acceptor
+		for (unsigned i = 0; i < std::max(size_t(1), g_acceptors.size()); ++i)
 		{
-			// STFU on lack of IPv6?
-			switch(errno)
+			auto pAcceptor = g_acceptors.empty() ? nullptr : g_acceptors[i].get();
+			int nSockFd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+			if (nSockFd == -1)
 			{
-				case EAFNOSUPPORT:
-				case EPFNOSUPPORT:
-				case ESOCKTNOSUPPORT:
-				case EPROTONOSUPPORT:
-				continue;
-				default:
-				perror("Error creating socket");
-				continue;
+				// STFU on lack of IPv6?
+				switch(errno)
+				{
+					case EAFNOSUPPORT:
+					case EPFNOSUPPORT:
+					case ESOCKTNOSUPPORT:
+					case EPROTONOSUPPORT:
+					continue;
+					default:
+					perror("Error creating socket");
+					continue;
+				}
 			}
-		}
-		// if we have a dual-stack IP implementation (like on Linux) then
-		// explicitly disable the shadow v4 listener. Otherwise it might be
-		// bound or maybe not, and then just sometimes because of configurable
-		// dual-behavior, or maybe because of real errors;
-		// we just cannot know for sure but we need to.
+			// if we have a dual-stack IP implementation (like on Linux) then
+			// explicitly disable the shadow v4 listener. Otherwise it might be
+			// bound or maybe not, and then just sometimes because of configurable
+			// dual-behavior, or maybe because of real errors;
+			// we just cannot know for sure but we need to.
 #if defined(IPV6_V6ONLY) && defined(SOL_IPV6)
-		if(p->ai_family==AF_INET6)
-			setsockopt(nSockFd, SOL_IPV6, IPV6_V6ONLY, &yes, sizeof(yes));
+			if(p->ai_family==AF_INET6)
+				setsockopt(nSockFd, SOL_IPV6, IPV6_V6ONLY, &yes, sizeof(yes));
 #endif
-		setsockopt(nSockFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
-		res += bind_and_listen(nSockFd, p, port);
+			setsockopt(nSockFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+#ifdef SO_REUSEPORT
+			// let the kernel distribute incoming connections
+			if (pAcceptor)
+				setsockopt(nSockFd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+#endif
+			res += bind_and_listen(nSockFd, p, port, pAcceptor);
+		}
 	}
 	return res;
 };
@@ -272,6 +395,25 @@ int ACNG_API Setup()
 
 	g_tpool = tpool::Create(300, 30);
 
+	if (cfg::acceptthreads > 0)
+	{
+#ifdef SO_REUSEPORT
+		for (int i = 0; i < cfg::acceptthreads; ++i)
+		{
+			auto acc = make_unique<tAcceptor>();
+			acc->base = event_base_new();
+			if (!acc->base)
+			{
+				cerr << "Error creating event base for accept threads" << endl;
+				exit(EXIT_FAILURE);
+			}
+			g_acceptors.emplace_back(move(acc));
+		}
+#else
+		cerr << "AcceptThreads: SO_REUSEPORT is not supported on this system, ignored" << endl;
+#endif
+	}
+
 	unsigned nCreated = 0;
 
 	if (cfg::udspath.empty())
@@ -345,6 +487,17 @@ int ACNG_API Setup()
 			DBGQLOG("Reporting shutdown (stop accepting) to FD " << el.fd);
 			el.callback(el.fd, EV_TIMEOUT, el.arg);
 		});
+		evabase::addTeardownAction(conserver::cb_wake_parked, [](t_event_desctor el){
+			el.callback(el.fd, EV_TIMEOUT, el.arg);
+		});
+	}
+
+	for (auto& acc: g_acceptors)
+	{
+		acc->thr = std::thread([evb = acc->base]()
+		{
+			event_base_loop(evb, EVLOOP_NO_EXIT_ON_EMPTY);
+		});
 	}
 
 	return nCreated;
@@ -352,6 +505,20 @@ int ACNG_API Setup()
 
 void Shutdown()
 {
+	for (auto& acc: g_acceptors)
+	{
+		event_base_loopbreak(acc->base);
+		if (acc->thr.joinable())
+			acc->thr.join();
+		for (auto ev: acc->events)
+		{
+			close(event_get_fd(ev));
+			event_free(ev);
+		}
+		event_base_free(acc->base);
+	}
+	g_acceptors.clear();
+	dlcon::StopShared();
 	g_tpool->stop();
 }
 
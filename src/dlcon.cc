@@ -10,6 +10,7 @@
 #include "acbuf.h"
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/time.h>
 #include <atomic>
 #include <algorithm>
@@ -26,6 +27,8 @@
 #include "fileio.h"
 #include "sockio.h"
 #include "evabase.h"
+#include "mirrorstats.h"
+#include "bwsched.h"
 
 #ifdef HAVE_LINUX_EVENTFD
 #include <sys/eventfd.h>
@@ -43,9 +46,23 @@ namespace acng
 
 static cmstring sGenericError("502 Bad Gateway");
 
-std::atomic_uint g_nDlCons(0);
 class CDlConn;
 
+/**
+ * Parse a Content-Range value like "bytes 21010-47021/47022", * instead of a number yields -1.
+ */
+static bool ParseContentRange(const char *p, off_t &startPos, off_t &endPos, off_t &total)
+{
+	const static std::regex re("bytes(\\s*|=)(\\d+)-(\\d+|\\*)/(\\d+|\\*)");
+	std::cmatch reRes;
+	if (!p || !std::regex_search(p, reRes, re) || reRes.size() != 5)
+		return false;
+	startPos = atoofft(reRes[2].first, -1);
+	endPos = atoofft(reRes[3].first, -1);
+	total = atoofft(reRes[4].first, -1);
+	return true;
+}
+
 struct tDlJob
 {
 	tFileItemPtr m_pStorage;
@@ -125,6 +142,24 @@ struct tDlJob
 	// flag to use ranges and also define start if >= 0
 	off_t m_nUsedRangeStartPos = -1;
 
+	// the peer announced to close the connection after this response
+	bool m_bPeerCloses = false;
+
+	// timing data for the mirror scoreboard; the response time is only meaningful if the
+	// request was not queued behind others in the pipeline
+	bool m_bTimedRequest = false;
+	mirrorstats::tStamp m_tRequested, m_tHeaderReceived;
+	uint64_t m_nBodyReceived = 0;
+
+	// segmented download: this is the main job which has split the file
+	bool m_bSegmented = false;
+	// or a helper job, fetching the remaining range of that segment
+	int m_nSegment = -1;
+	off_t m_nSegPos = 0, m_nSegEnd = 0;
+
+	// index file, requested ahead of bulk data (see PriorityDownloads)
+	bool m_bPriority = false;
+
 	inline tDlJob(CDlConn *p, const tFileItemPtr& pFi, tHttpUrl &&src, bool isPT, mstring extraHeaders) :
 					m_pStorage(pFi), m_parent(*p),
 					m_extraHeaders(move(extraHeaders)),
@@ -155,25 +190,40 @@ struct tDlJob
 		m_fiAttr = pFi->m_spattr;
 	}
 
+	/**
+	 * Helper job of a segmented download, fetches the specified part of the file which the
+	 * main job is working on. Bound to the particular backend.
+	 */
+	inline tDlJob(CDlConn *p, const tDlJob &mainJob, const tHttpUrl *pBackend, int nSegment,
+			off_t nStart, off_t nEnd) :
+					m_pStorage(mainJob.m_pStorage), m_parent(*p),
+					m_pRepoDesc(mainJob.m_pRepoDesc),
+					m_extraHeaders(mainJob.m_extraHeaders),
+					m_pCurBackend(pBackend),
+					m_fiAttr(mainJob.m_fiAttr),
+					m_nSegment(nSegment), m_nSegPos(nStart), m_nSegEnd(nEnd)
+	{
+		LOGSTARTFUNCx(nSegment, nStart, nEnd);
+		m_pStorage->DlRefCountAdd();
+		m_remoteUri.sPath = mainJob.m_remoteUri.sPath;
+	}
+
 	// Default move ctor is ok despite of pointers, we only need it in the beginning, list-splice operations should not move the object around
 	tDlJob(tDlJob &&other) = default;
 
-	~tDlJob()
-	{
-		LOGSTART("tDlJob::~tDlJob");
-		if (m_pStorage)
-		{
-			dbgline;
-            m_pStorage->DlRefCountDec({503, sErrorMsg.empty() ?
-                    "Download Expired" : move(sErrorMsg)});
-		}
-	}
+	~tDlJob();
+
+	// defined after CDlConn
+	void StartSegmentedDownload();
+	void ContinueSegmentedDownload();
+	bool IsOnSharedAgent() const;
 
 	void ResetStreamState()
 	{
 		m_nRest = 0;
 		m_DlState = STATE_GETHEADER;
 		m_nUsedRangeStartPos = -1;
+		m_bPeerCloses = false;
 	}
 
 	inline string RemoteUri(bool bUrlEncoded)
@@ -271,18 +321,35 @@ struct tDlJob
 				LOG(
 						"Checking [" << m_pCurBackend->sHost << "]:" << m_pCurBackend->GetPort());
 				const auto bliter = blacklist.find(m_pCurBackend->GetHostPortKey());
-				if (bliter == blacklist.end())
+				if (bliter == blacklist.end() && !mirrorstats::IsCoolingDown(*m_pCurBackend))
 					LOGRET(true);
 			}
 
-			// look in the constant list, either it's usable or it was blacklisted before
+			/*
+			 * Look in the constant list, either it's usable or it was blacklisted before.
+			 * Among the usable ones, prefer those not known as failing by other agents
+			 * and then the one with the lowest estimated cost. Mirrors without data are
+			 * considered as good as the best known one, so the config order decides then.
+			 */
+			const tHttpUrl *pBest = nullptr, *pCooling = nullptr;
+			uint64_t nBestCost = 0;
 			for (const auto &bend : m_pRepoDesc->m_backends)
 			{
 				const auto bliter = blacklist.find(bend.GetHostPortKey());
 				if (bliter == blacklist.end())
 				{
-					m_pCurBackend = &bend;
-					LOGRET(true);
+					if (mirrorstats::IsCoolingDown(bend))
+					{
+						if (!pCooling)
+							pCooling = &bend;
+						continue;
+					}
+					auto cost = mirrorstats::GetCost(bend);
+					if (!pBest || (cost && nBestCost && cost < nBestCost))
+						pBest = &bend;
+					if (cost && (!nBestCost || cost < nBestCost))
+						nBestCost = cost;
+					continue;
 				}
 
 				// uh, blacklisted, remember the last reason
@@ -292,6 +359,15 @@ struct tDlJob
 					LOG(sReasonMsg);
 				}
 			}
+			// all failing elsewhere? Try anyway, this agent did not see it failing yet
+			if (!pBest)
+				pBest = pCooling;
+			if (pBest)
+			{
+				m_pCurBackend = pBest;
+				sReasonMsg.clear();
+				LOGRET(true);
+			}
 			if (sReasonMsg.empty())
 				sReasonMsg = "Mirror blocked due to repeated errors";
 			LOGRET(false);
@@ -313,6 +389,8 @@ struct tDlJob
 
 #define CRLF "\r\n"
 
+		m_tRequested = mirrorstats::Now();
+
         if (m_fiAttr.bHeadOnly)
 		{
 			head << "HEAD ";
@@ -364,60 +442,71 @@ struct tDlJob
 					<< EncodeBase64Auth(pSourceHost.sUserPass) << CRLF;
 		}
 
-		m_nUsedRangeStartPos = -1;
-
-        lockguard g(*m_pStorage);
+		if (m_nSegment >= 0)
+		{
+			// the mirror may have a different date, the total size in the response is checked
+			m_nUsedRangeStartPos = m_nSegPos;
+			head << "Range: bytes=" << m_nSegPos << "-" << m_nSegEnd - 1 << CRLF;
+		}
+		else
+		{
+			m_nUsedRangeStartPos = -1;
 
-		m_nUsedRangeStartPos = m_pStorage->m_nSizeChecked >= 0 ?
-				m_pStorage->m_nSizeChecked : m_pStorage->m_nSizeCachedInitial;
+			lockuniq g(*m_pStorage);
+			// resume after all data received so far
+			m_pStorage->DlFlush(g);
 
-		if (AC_UNLIKELY(m_nUsedRangeStartPos < -1))
-			m_nUsedRangeStartPos = -1;
+			m_nUsedRangeStartPos = m_pStorage->m_nSizeChecked >= 0 ?
+					m_pStorage->m_nSizeChecked.load() : m_pStorage->m_nSizeCachedInitial;
 
-		/*
-		 * Validate those before using them, with extra caution for ranges with date check
-		 * on volatile files. Also make sure that Date checks are only used
-		 * in combination with range request, otherwise it doesn't make sense.
-		 */
-        if (m_fiAttr.bVolatile)
-		{
-			if (cfg::vrangeops <= 0)
-			{
+			if (AC_UNLIKELY(m_nUsedRangeStartPos < -1))
 				m_nUsedRangeStartPos = -1;
-			}
-            else if (m_nUsedRangeStartPos == m_pStorage->m_nContentLength
-					&& m_nUsedRangeStartPos > 1)
+
+			/*
+			 * Validate those before using them, with extra caution for ranges with date check
+			 * on volatile files. Also make sure that Date checks are only used
+			 * in combination with range request, otherwise it doesn't make sense.
+			 */
+			if (m_fiAttr.bVolatile)
 			{
-				m_nUsedRangeStartPos--; // the probe trick
-			}
+				if (cfg::vrangeops <= 0)
+				{
+					m_nUsedRangeStartPos = -1;
+				}
+				else if (m_nUsedRangeStartPos == m_pStorage->m_nContentLength
+						&& m_nUsedRangeStartPos > 1)
+				{
+					m_nUsedRangeStartPos--; // the probe trick
+				}
 
-            if (!m_pStorage->m_responseModDate.isSet()) // date unusable but needed for volatile files?
-				m_nUsedRangeStartPos = -1;
-		}
+				if (!m_pStorage->m_responseModDate.isSet()) // date unusable but needed for volatile files?
+					m_nUsedRangeStartPos = -1;
+			}
 
-		if (m_fiAttr.nRangeLimit >= 0)
-		{
-			if(m_nUsedRangeStartPos < 0)
+			if (m_fiAttr.nRangeLimit >= 0)
 			{
-				m_fiAttr.nRangeLimit = 0;
+				if(m_nUsedRangeStartPos < 0)
+				{
+					m_fiAttr.nRangeLimit = 0;
+				}
+				else if(AC_UNLIKELY(m_fiAttr.nRangeLimit < m_nUsedRangeStartPos))
+				{
+					// must be BS, fetch the whole remainder!
+					m_fiAttr.nRangeLimit = -1;
+				}
 			}
-			else if(AC_UNLIKELY(m_fiAttr.nRangeLimit < m_nUsedRangeStartPos))
+
+			if (m_nUsedRangeStartPos > 0)
 			{
-				// must be BS, fetch the whole remainder!
-				m_fiAttr.nRangeLimit = -1;
+				if (m_pStorage->m_responseModDate.isSet())
+					head << "If-Range: " << m_pStorage->m_responseModDate.view() << CRLF;
+				head << "Range: bytes=" << m_nUsedRangeStartPos << "-";
+				if (m_fiAttr.nRangeLimit > 0)
+					head << m_fiAttr.nRangeLimit;
+				head << CRLF;
 			}
 		}
 
-		if (m_nUsedRangeStartPos > 0)
-		{
-			if (m_pStorage->m_responseModDate.isSet())
-				head << "If-Range: " << m_pStorage->m_responseModDate.view() << CRLF;
-			head << "Range: bytes=" << m_nUsedRangeStartPos << "-";
-            if (m_fiAttr.nRangeLimit > 0)
-                head << m_fiAttr.nRangeLimit;
-			head << CRLF;
-		}
-
         if (m_pStorage->IsVolatile())
 			head << "Cache-Control: " /*no-store,no-cache,*/ "max-age=0" CRLF;
 
@@ -450,13 +539,40 @@ struct tDlJob
 			{
 				ldbg("To store: " <<nToStore);
 				lockuniq g(*m_pStorage);
-				if (!m_pStorage->DlAddData(string_view(inBuf.rptr(), nToStore), g))
+				if (m_nSegment >= 0)
 				{
-                    sErrorMsg = "Cannot store";
-					return HINT_RECONNECT_NOW | EFLAG_JOB_BROKEN;
+					if (!m_pStorage->DlSegmentWrite(m_nSegPos, string_view(inBuf.rptr(), nToStore)))
+					{
+						sErrorMsg = "Cannot store";
+						return HINT_RECONNECT_NOW | EFLAG_JOB_BROKEN;
+					}
+					m_nSegPos += nToStore;
+				}
+				else
+				{
+					if (m_bSegmented)
+					{
+						// arrived at data stored by a helper? Resume after it, the rest
+						// of this response is useless then
+						if (m_pStorage->DlSegmentsSkip())
+						{
+							ldbg("skipped to " << m_pStorage->m_nSizeChecked);
+							if (m_pStorage->m_nSizeChecked < m_pStorage->m_nContentLength)
+								return HINT_RECONNECT_NOW;
+							m_DlState = STATE_FINISHJOB;
+							return HINT_SWITCH;
+						}
+						nToStore = min(nToStore, m_pStorage->DlSegmentRoom(m_pStorage->m_nSizeChecked));
+					}
+					if (!m_pStorage->DlAddData(string_view(inBuf.rptr(), nToStore), g))
+					{
+						sErrorMsg = "Cannot store";
+						return HINT_RECONNECT_NOW | EFLAG_JOB_BROKEN;
+					}
 				}
 			}
 			m_nRest -= nToStore;
+			m_nBodyReceived += nToStore;
 			inBuf.drop(nToStore);
 		}
 
@@ -471,6 +587,47 @@ struct tDlJob
 		return HINT_SWITCH;
 	}
 
+	// data held back by the storage, see WriteBehindBuffer
+	bool HasBufferedData()
+	{
+		return m_pStorage && m_pStorage->DlHasBuffered();
+	}
+	void FlushBufferedData()
+	{
+		lockuniq g(*m_pStorage);
+		m_pStorage->DlFlush(g);
+	}
+
+#ifdef HAVE_LINUX_SPLICE
+	/**
+	 * Pass plain body data straight from the socket to the cache file, without copying through user space.
+	 * @return Like acbuf::sysread, or -ENOTSUP when not applicable in the current state
+	 */
+	ssize_t SpliceData(int fd, const int* pipefds, size_t nMaxTake)
+	{
+		LOGSTARTFUNC;
+		// chunked transfers and pass-through data need to be parsed or queued in memory
+		if (m_DlState != STATE_PROCESS_DATA || m_nRest <= 0 || !m_bAllowStoreData || !m_pStorage)
+			return -ENOTSUP;
+		// segmented downloads write at segment boundaries
+		if (m_bSegmented || m_nSegment >= 0)
+			return -ENOTSUP;
+		lockuniq g(*m_pStorage);
+		auto r = m_pStorage->DlSpliceData(fd, pipefds, min(off_t(nMaxTake), m_nRest), g);
+		if (r > 0)
+		{
+			m_nRest -= r;
+			m_nBodyReceived += r;
+			if (!m_nRest)
+				m_DlState = STATE_FINISHJOB;
+		}
+		else if (r == -EIO)
+			sErrorMsg = "Cannot store";
+		ldbg("Rest: " << m_nRest);
+		return r;
+	}
+#endif
+
 	/*!
 	 *
 	 * Process new incoming data and write it down to disk or other receivers.
@@ -535,6 +692,15 @@ struct tDlJob
 					ldbg("Peer wants to close connection after request");
 					ret |= HINT_RECONNECT_SOON;
 				}
+				// HTTP/1.0 peers close unless keep-alive was explicitly confirmed; that matters
+				// for shared agents which would otherwise queue requests of other clients there
+				else if (IsOnSharedAgent() && h.proto == header::HTTP_10
+						&& !(pCon && 0 == strcasecmp(pCon, "keep-alive")))
+				{
+					ldbg("HTTP/1.0 peer, expecting connection close after request");
+					ret |= HINT_RECONNECT_SOON;
+				}
+				m_bPeerCloses = ret & HINT_RECONNECT_SOON;
 
 				// processing hint 102, or something like 103 which we can ignore
 				if (h.getStatusCode() < 200)
@@ -543,6 +709,28 @@ struct tDlJob
 					return ret | HINT_MORE;
 				}
 
+				// a segment helper can only use exactly the requested part of the same file
+				if (m_nSegment >= 0)
+				{
+					off_t startPos(-1), endPos(-1), total(-1);
+					if (h.getStatusCode() != 206 || h.h[header::TRANSFER_ENCODING]
+							|| !ParseContentRange(h.h[header::CONTENT_RANGE], startPos, endPos, total)
+							|| startPos != m_nSegPos || endPos != m_nSegEnd - 1
+							|| total != m_pStorage->m_nContentLength)
+					{
+						sErrorMsg = "Segment not available";
+						return ret | HINT_RECONNECT_NOW | EFLAG_JOB_BROKEN;
+					}
+					if (m_bTimedRequest)
+						mirrorstats::ReportResponse(GetPeerHost(), m_tRequested);
+					inBuf.drop(size_t(hDataLen));
+					m_tHeaderReceived = mirrorstats::Now();
+					m_nBodyReceived = 0;
+					m_nRest = m_nSegEnd - m_nSegPos;
+					m_DlState = STATE_PROCESS_DATA;
+					continue;
+				}
+
 				if (cfg::redirmax) // internal redirection might be disabled
 				{
 					if (h.getStatus().isRedirect())
@@ -630,10 +818,15 @@ struct tDlJob
 					}
 				}
 
+				if (m_bTimedRequest)
+					mirrorstats::ReportResponse(GetPeerHost(), m_tRequested);
+
 				// ok, can pass the data to the file handler
 				auto storeResult = CheckAndSaveHeader(move(h),
 						string_view(inBuf.rptr(), hDataLen), contentLength);
 				inBuf.drop(size_t(hDataLen));
+				m_tHeaderReceived = mirrorstats::Now();
+				m_nBodyReceived = 0;
 
 				if (m_pStorage && m_pStorage->m_spattr.bHeadOnly)
 					m_nRest = 0;
@@ -649,6 +842,9 @@ struct tDlJob
 					return ret | HINT_RECONNECT_NOW | EFLAG_JOB_BROKEN
 							| EFLAG_STORE_COLLISION;
 				}
+
+				if (m_DlState == STATE_PROCESS_DATA && !m_bSegmented)
+					StartSegmentedDownload();
 			}
 			else if (m_DlState == STATE_PROCESS_CHUNKDATA
 					|| m_DlState == STATE_PROCESS_DATA)
@@ -662,10 +858,18 @@ struct tDlJob
 			else if (m_DlState == STATE_FINISHJOB)
 			{
 				ldbg("STATE_FINISHJOB");
-				lockguard g(*m_pStorage);
-				m_pStorage->DlFinish(false);
+				mirrorstats::ReportDone(GetPeerHost(), m_nBodyReceived, m_tHeaderReceived);
 				m_DlState = STATE_GETHEADER;
-				return HINT_DONE;
+				if (m_nSegment >= 0)
+				{
+					ContinueSegmentedDownload();
+					return HINT_DONE;
+				}
+				lockuniq g(*m_pStorage);
+				m_pStorage->DlFlush(g);
+				m_pStorage->DlFinish(false);
+				// not read completely if the rest was stored by segment helpers
+				return HINT_DONE | (m_nRest ? HINT_RECONNECT_NOW : 0);
 			}
 			else if (m_DlState == STATE_GETCHUNKHEAD)
 			{
@@ -797,21 +1001,9 @@ struct tDlJob
 			if(!p)
                 return withError("Missing Content-Range in Partial Response");
 
-			const static std::regex re("bytes(\\s*|=)(\\d+)-(\\d+|\\*)/(\\d+|\\*)");
-
-			std::cmatch reRes;
-			if (!std::regex_search(p, reRes, re))
-			{
+			off_t startPos(-1), endPos(-1);
+			if (!ParseContentRange(p, startPos, endPos, contLen))
                 return withError("Bad range");
-			}
-			auto tcount = reRes.size();
-			if (tcount != 5)
-			{
-                return withError("Bad range format");
-			}
-			// * would mean -1
-            contLen = atoofft(reRes[4].first, -1);
-			auto startPos = atoofft(reRes[2].first, -1);
 
 			// identify the special probe request which reports what we already knew
             if (m_pStorage->IsVolatile() &&
@@ -906,6 +1098,7 @@ class CDlConn : public dlcon
 	typedef std::list<tDlJob> tDljQueue;
 	friend struct ::acng::tDlJob;
 	friend class ::acng::dlcon;
+	friend class CDlManager;
 
 	tDljQueue m_new_jobs;
 	const IDlConFactory &m_conFactory;
@@ -922,7 +1115,13 @@ class CDlConn : public dlcon
 #endif
 	// cheaper way to trigger wake flag checks and also notify about termination request, without locking mutex all the time
 	atomic_int m_ctrl_hint = ATOMIC_VAR_INIT(0);
+	// number of jobs which were added but not finished yet, for load estimation
+	std::atomic<unsigned> m_nJobsPending = ATOMIC_VAR_INIT(0);
+	// the part of them which are not index files
+	std::atomic<unsigned> m_nBulkPending = ATOMIC_VAR_INIT(0);
 	mutex m_handover_mutex;
+	// set when a helper agent has quit, protected by m_handover_mutex
+	bool m_bClosed = false;
 
 	/// blacklist for permanently failing hosts, with error message
 	tStrMap m_blacklist;
@@ -948,11 +1147,46 @@ class CDlConn : public dlcon
 	// if access proxies shall no longer be used.
 	bool m_bProxyTot = false;
 
+	// helper of segmented downloads, the work loop returns when there is nothing left to do
+	bool m_bExitWhenIdle = false;
+	// agent of the shared download manager, serving requests of many clients over its
+	// lifetime; it is more careful with peers which might not keep the connection open
+	bool m_bShared = false;
+	std::atomic_bool m_bFinished = ATOMIC_VAR_INIT(false);
+	bool AddSegmentJob(const tDlJob &mainJob, const tHttpUrl *pBackend, int nSegment,
+			off_t nStart, off_t nEnd);
+	// @return false if the segment was not handed over and needs to be released
+	static bool StartSegmentHelper(const tDlJob &mainJob, const tHttpUrl *pBackend,
+			int nSegment, off_t nStart, off_t nEnd);
+	static bool RunHelper(const std::shared_ptr<CDlConn> &dler);
+
+	// helper agent with its own connection, fetches index files while this one is busy
+	// with package data; only for private agents, the shared manager picks a free agent instead
+	std::shared_ptr<CDlConn> m_pLane;
+	mutex m_laneMx;
+	template<typename... Args>
+	bool PushJob(bool bPriority, Args&&... args);
+	template<typename... Args>
+	bool PushToLane(Args&&... args);
+
 	// this is a binary factor, meaning how many reads from buffer are OK when
-	// speed limiting is enabled
-	unsigned m_nSpeedLimiterRoundUp = (unsigned(1) << 16) - 1;
-	unsigned m_nSpeedLimitMaxPerTake = MAX_VAL(unsigned);
-	unsigned m_nLastDlCount = 0;
+#ifdef HAVE_LINUX_SPLICE
+	// transfer pipe for socket-to-file splicing, created on demand, followed by a second pipe
+	// receiving a copy of the data for the digest (see fileitem::DlSpliceData)
+	int m_splicePipe[4] = { -1, -1, -1, -1 };
+	size_t m_nSplicePipeSize = 0;
+	bool PrepareSplicePipe();
+	void CloseSplicePipe()
+	{
+		for (auto& fd : m_splicePipe)
+			checkforceclose(fd);
+	}
+#endif
+	// bandwidth limits of the current download, see bwsched
+	bwsched::tFlowPtr m_pBwFlow;
+	const tRepoData *m_pBwRepo = nullptr;
+	mstring m_sBwHostKey;
+	bwsched::tFlow* GetBwFlow(tDlJob& job);
 
 	void wake();
 	void drain_event_stream();
@@ -1017,19 +1251,218 @@ inline void CDlConn::awaken_check()
 #endif
 
 
-bool CDlConn::AddJob(const std::shared_ptr<fileitem> &fi, tHttpUrl src, bool isPT, mstring extraHeaders)
+tDlJob::~tDlJob()
+{
+	LOGSTART("tDlJob::~tDlJob");
+	if (m_pStorage)
+	{
+		dbgline;
+		if (m_nSegment >= 0)
+		{
+			lockguard g(*m_pStorage);
+			m_pStorage->DlSegmentRelease(m_nSegment, false);
+		}
+		else if (m_bSegmented)
+		{
+			// the helpers might keep the item referenced for a while, tell the users now
+			lockguard g(*m_pStorage);
+			if (m_pStorage->m_status != fileitem::FIST_COMPLETE)
+				m_pStorage->DlSegmentsAbandon();
+			if (m_pStorage->m_status < fileitem::FIST_COMPLETE)
+			{
+				m_pStorage->DlSetError({503, sErrorMsg.empty() ? "Download Expired" : sErrorMsg},
+						m_pStorage->m_eDestroy);
+			}
+		}
+		m_pStorage->DlRefCountDec({503, sErrorMsg.empty() ?
+				"Download Expired" : move(sErrorMsg)});
+		m_parent.m_nJobsPending--;
+		if (!m_bPriority)
+			m_parent.m_nBulkPending--;
+	}
+}
+
+bool tDlJob::IsOnSharedAgent() const
+{
+	return m_parent.m_bShared;
+}
+
+void tDlJob::StartSegmentedDownload()
+{
+	LOGSTARTFUNC;
+	if (cfg::segdlminsize <= 0 || cfg::segdlstreams <= 0 || !m_bAllowStoreData
+			|| !m_bBackendMode || !m_pCurBackend || !m_pRepoDesc
+			|| m_pRepoDesc->m_backends.size() < 2 || m_bIsPassThroughRequest
+			|| m_fiAttr.bHeadOnly || m_fiAttr.nRangeLimit >= 0
+			|| rex::GetFiletype(m_pStorage->m_sPathRel) == rex::FILE_VOLATILE)
+	{
+		return;
+	}
+	// items not verified yet are treated as volatile, the main job must be able to resume then
+	if (m_fiAttr.bVolatile && (cfg::vrangeops <= 0 || !m_pStorage->m_responseModDate.isSet()))
+		return;
+	// other mirrors which are not known as failing, the fastest first
+	vector<pair<uint64_t, const tHttpUrl*>> helpers;
+	auto sOwnKey = m_pCurBackend->GetHostPortKey();
+	for (const auto &bend : m_pRepoDesc->m_backends)
+	{
+		auto sKey = bend.GetHostPortKey();
+		if (sKey == sOwnKey || m_parent.m_blacklist.count(sKey) || mirrorstats::IsCoolingDown(bend))
+			continue;
+		helpers.emplace_back(mirrorstats::GetCost(bend), &bend);
+	}
+	stable_sort(helpers.begin(), helpers.end(),
+			[](const auto &a, const auto &b) { return a.first < b.first; });
+	if (helpers.size() > unsigned(cfg::segdlstreams))
+		helpers.resize(cfg::segdlstreams);
+	if (helpers.empty())
+		return;
+
+	struct tClaim { const tHttpUrl *pBackend; int idx; off_t nStart, nEnd; };
+	vector<tClaim> claims;
+	{
+		lockuniq g(*m_pStorage);
+		// segment positions are derived from the stored size
+		if (!m_pStorage->DlFlush(g))
+			return;
+		auto len = m_pStorage->m_nContentLength;
+		if (len < off_t(cfg::segdlminsize) * 1048576)
+			return;
+		// a few segments for each participant, to compensate different speeds
+		auto nSegSize = max(off_t(1048576), len / off_t(helpers.size() + 1) / 4);
+		if (!m_pStorage->DlSegmentsSetup(nSegSize))
+			return;
+		m_bSegmented = true;
+		for (const auto &h : helpers)
+		{
+			off_t nStart, nEnd;
+			auto idx = m_pStorage->DlSegmentClaim(nStart, nEnd);
+			if (idx < 0)
+				break;
+			claims.push_back({h.second, idx, nStart, nEnd});
+		}
+	}
+	USRDBG("Segmented download of " << m_pStorage->m_sPathRel << " with " << claims.size()
+			<< " helper(s)");
+	for (const auto &c : claims)
+	{
+		if (CDlConn::StartSegmentHelper(*this, c.pBackend, c.idx, c.nStart, c.nEnd))
+			continue;
+		// no capacity for it, the main download will get there
+		lockguard g(*m_pStorage);
+		m_pStorage->DlSegmentRelease(c.idx, false);
+	}
+}
+
+void tDlJob::ContinueSegmentedDownload()
+{
+	LOGSTARTFUNC;
+	off_t nStart, nEnd;
+	int idx;
+	{
+		lockguard g(*m_pStorage);
+		m_pStorage->DlSegmentRelease(m_nSegment, true);
+		m_nSegment = -1;
+		idx = m_pStorage->DlSegmentClaim(nStart, nEnd);
+	}
+	// stay with this mirror while there is work
+	if (idx >= 0)
+		m_parent.AddSegmentJob(*this, m_pCurBackend, idx, nStart, nEnd);
+}
+
+static std::mutex g_helpersMx;
+static std::list<std::pair<std::shared_ptr<CDlConn>, std::thread>> g_helpers;
+
+/**
+ * Add a job to the input queue, unless the agent has quit already.
+ * The arguments are only consumed on success.
+ */
+template<typename... Args>
+bool CDlConn::PushJob(bool bPriority, Args&&... args)
 {
-	if (m_ctrl_hint < 0 || evabase::in_shutdown)
-		return false;
 	{
 		lockguard g(m_handover_mutex);
-		m_new_jobs.emplace_back(this, fi, move(src), isPT, move(extraHeaders));
+		if (m_bClosed)
+			return false;
+		m_new_jobs.emplace_back(this, std::forward<Args>(args)...);
+		m_new_jobs.back().m_bPriority = bPriority;
+		m_nJobsPending++;
+		if (!bPriority)
+			m_nBulkPending++;
 	}
 	m_ctrl_hint++;
 	wake();
 	return true;
 }
 
+template<typename... Args>
+bool CDlConn::PushToLane(Args&&... args)
+{
+	// shared agents are limited by DlThreads, see CDlManager::Select
+	if (m_bExitWhenIdle || m_bShared || !m_nBulkPending)
+		return false;
+	lockguard g(m_laneMx);
+	// the old lane might have just run out of work
+	if (m_pLane && m_pLane->PushJob(true, std::forward<Args>(args)...))
+		return true;
+	m_pLane.reset();
+	auto dler = make_shared<CDlConn>(m_conFactory);
+	dler->m_bExitWhenIdle = true;
+	dler->PushJob(true, std::forward<Args>(args)...);
+	if (RunHelper(dler))
+		m_pLane = dler;
+	// otherwise shutting down, the job is released with the agent
+	return true;
+}
+
+static bool IsIndexFile(const tFileItemPtr &fi)
+{
+	return cfg::priodl > 0 && fi && rex::GetFiletype(fi->GetPathRel()) == rex::FILE_VOLATILE;
+}
+
+bool CDlConn::AddSegmentJob(const tDlJob &mainJob, const tHttpUrl *pBackend, int nSegment,
+		off_t nStart, off_t nEnd)
+{
+	return PushJob(false, mainJob, pBackend, nSegment, nStart, nEnd);
+}
+
+bool CDlConn::RunHelper(const std::shared_ptr<CDlConn> &dler)
+{
+	lockguard g(g_helpersMx);
+	for (auto it = g_helpers.begin(); it != g_helpers.end();)
+	{
+		if (!it->first->m_bFinished)
+		{
+			++it;
+			continue;
+		}
+		it->second.join();
+		it = g_helpers.erase(it);
+	}
+	if (evabase::in_shutdown)
+		return false;
+	try
+	{
+		std::thread thr([dler]() { dler->WorkLoop(); dler->m_bFinished = true; });
+		g_helpers.emplace_back(dler, move(thr));
+		return true;
+	}
+	catch (...)
+	{
+	}
+	return false;
+}
+
+bool CDlConn::AddJob(const std::shared_ptr<fileitem> &fi, tHttpUrl src, bool isPT, mstring extraHeaders)
+{
+	if (m_ctrl_hint < 0 || evabase::in_shutdown)
+		return false;
+	auto bPriority = IsIndexFile(fi);
+	if (bPriority && PushToLane(fi, move(src), isPT, move(extraHeaders)))
+		return true;
+	return PushJob(bPriority, fi, move(src), isPT, move(extraHeaders));
+}
+
 bool CDlConn::AddJob(const std::shared_ptr<fileitem> &fi, tRepoResolvResult repoSrc, bool isPT, mstring extraHeaders)
 {
 	if (m_ctrl_hint < 0 || evabase::in_shutdown)
@@ -1038,13 +1471,10 @@ bool CDlConn::AddJob(const std::shared_ptr<fileitem> &fi, tRepoResolvResult repo
 		return false;
 	if (repoSrc.sRestPath.empty())
 		return false;
-	{
-		lockguard g(m_handover_mutex);
-		m_new_jobs.emplace_back(this, fi, move(repoSrc), isPT, move(extraHeaders));
-	}
-	m_ctrl_hint++;
-	wake();
-	return true;
+	auto bPriority = IsIndexFile(fi);
+	if (bPriority && PushToLane(fi, move(repoSrc), isPT, move(extraHeaders)))
+		return true;
+	return PushJob(bPriority, fi, move(repoSrc), isPT, move(extraHeaders));
 }
 
 CDlConn::CDlConn(const IDlConFactory &pConFactory) :
@@ -1067,7 +1497,6 @@ CDlConn::CDlConn(const IDlConFactory &pConFactory) :
 		m_ctrl_hint = -1;
 	}
 #endif
-	g_nDlCons++;
 }
 
 CDlConn::~CDlConn()
@@ -1079,9 +1508,36 @@ CDlConn::~CDlConn()
 	checkforceclose(m_wakepipe[0]);
 	checkforceclose(m_wakepipe[1]);
 #endif
-	g_nDlCons--;
+#ifdef HAVE_LINUX_SPLICE
+	CloseSplicePipe();
+#endif
 }
 
+#ifdef HAVE_LINUX_SPLICE
+bool CDlConn::PrepareSplicePipe()
+{
+	if (m_splicePipe[0] != -1)
+		return true;
+	if (pipe2(m_splicePipe, O_NONBLOCK | O_CLOEXEC))
+		return false;
+	if (pipe2(m_splicePipe + 2, O_NONBLOCK | O_CLOEXEC))
+	{
+		CloseSplicePipe();
+		return false;
+	}
+	// let it carry one read buffer worth of data, as in the classic path
+	fcntl(m_splicePipe[1], F_SETPIPE_SZ, int(cfg::dlbufsize));
+	auto sz = fcntl(m_splicePipe[1], F_GETPIPE_SZ);
+	m_nSplicePipeSize = sz > 0 ? sz : 4096;
+	// the copy must never be shorter
+	fcntl(m_splicePipe[3], F_SETPIPE_SZ, int(m_nSplicePipeSize));
+	auto szCopy = fcntl(m_splicePipe[3], F_GETPIPE_SZ);
+	if (szCopy > 0 && size_t(szCopy) < m_nSplicePipeSize)
+		m_nSplicePipeSize = szCopy;
+	return true;
+}
+#endif
+
 void CDlConn::SignalStop()
 {
 	LOGSTART("CDlConn::SignalStop");
@@ -1090,6 +1546,33 @@ void CDlConn::SignalStop()
 	wake();
 }
 
+bwsched::tFlow* CDlConn::GetBwFlow(tDlJob& job)
+{
+	auto& host = job.GetPeerHost();
+	// also cached when unlimited (nullptr)
+	auto key = host.GetHostPortKey();
+	if (m_pBwRepo != job.m_pRepoDesc || m_sBwHostKey != key)
+	{
+		m_pBwRepo = job.m_pRepoDesc;
+		m_sBwHostKey = move(key);
+		m_pBwFlow = bwsched::GetDownloadFlow(host, m_pBwRepo);
+	}
+	return m_pBwFlow.get();
+}
+
+#ifdef HAVE_SSL
+static int SslRead(BIO* bio, acbuf& buf, unsigned nMaxTake)
+{
+	int r = BIO_read(bio, buf.wptr(), std::min(nMaxTake, buf.freecapa()));
+	if (r > 0)
+		buf.got(r);
+	else
+		// <=0 doesn't mean an error, only a double check can tell
+		r = BIO_should_read(bio) ? 1 : -errno;
+	return r;
+}
+#endif
+
 inline unsigned CDlConn::ExchangeData(mstring &sErrorMsg,
 									  tDlStreamHandle &con, tDljQueue &inpipe)
 {
@@ -1107,6 +1590,11 @@ inline unsigned CDlConn::ExchangeData(mstring &sErrorMsg,
 
 	// no socket operation needed in this case but just process old buffer contents
 	bool bReEntered = !m_inBuf.empty();
+	// the body was spliced away, only the job state needs to be processed
+	bool bSpliceFinished = false;
+	bwsched::tFlow *flow = nullptr;
+	unsigned nTake = 0;
+	bool bFlushSoon = false;
 
 	loop_again:
 
@@ -1144,8 +1632,10 @@ inline unsigned CDlConn::ExchangeData(mstring &sErrorMsg,
 			goto proc_data;
 		}
 
+		// when the peer stalls, readers shall not wait for data held in the write-behind buffer
+		bFlushSoon = !inpipe.empty() && inpipe.front().HasBufferedData();
 		r = select(nMaxFd + 1, &rfds, &wfds, nullptr,
-				CTimeVal().ForNetTimeout());
+				bFlushSoon ? CTimeVal().For(1) : CTimeVal().ForNetTimeout());
 		ldbg("returned: " << r << ", errno: " << tErrnoFmter());
 		if (m_ctrl_hint < 0)
 			return HINT_RECONNECT_NOW;
@@ -1163,6 +1653,11 @@ inline unsigned CDlConn::ExchangeData(mstring &sErrorMsg,
 		}
 		else if (r == 0) // looks like a timeout
 		{
+			if (bFlushSoon)
+			{
+				inpipe.front().FlushBufferedData();
+				continue;
+			}
 			sErrorMsg = "Connection timeout";
 			LOG(sErrorMsg);
 
@@ -1227,56 +1722,66 @@ inline unsigned CDlConn::ExchangeData(mstring &sErrorMsg,
 #endif
 				))
 		{
-			if (cfg::maxdlspeed != cfg::RESERVED_DEFVAL)
+			// the data quota of this read, blocks until the bandwidth limits allow it
+			flow = inpipe.empty() ? nullptr : GetBwFlow(inpipe.front());
+			nTake = MAX_VAL(unsigned);
+			if (flow)
 			{
-				auto nCntNew = g_nDlCons.load();
-				if (m_nLastDlCount != nCntNew)
-				{
-					m_nLastDlCount = nCntNew;
-
-					// well, split the bandwidth
-					auto nSpeedNowKib = uint(cfg::maxdlspeed) / nCntNew;
-					auto nTakesPerSec = nSpeedNowKib / 32;
-					if (!nTakesPerSec)
-						nTakesPerSec = 1;
-					m_nSpeedLimitMaxPerTake = nSpeedNowKib * 1024
-							/ nTakesPerSec;
-					auto nIntervalUS = 1000000 / nTakesPerSec;
-					auto nIntervalUS_copy = nIntervalUS;
-					// creating a bitmask
-					for (m_nSpeedLimiterRoundUp = 1, nIntervalUS /= 2;
-							nIntervalUS; nIntervalUS >>= 1)
-						m_nSpeedLimiterRoundUp = (m_nSpeedLimiterRoundUp << 1)
-								| 1;
-					m_nSpeedLimitMaxPerTake = uint(
-							double(m_nSpeedLimitMaxPerTake)
-									* double(m_nSpeedLimiterRoundUp)
-									/ double(nIntervalUS_copy));
-				}
-				// waiting for the next time slice to get data from buffer
-				timeval tv;
-				if (0 == gettimeofday(&tv, nullptr))
-				{
-					auto usNext = tv.tv_usec | m_nSpeedLimiterRoundUp;
-					usleep(usNext - tv.tv_usec);
-				}
+				nTake = flow->Acquire(max(size_t(m_inBuf.freecapa()),
+#ifdef HAVE_LINUX_SPLICE
+						m_nSplicePipeSize
+#else
+						size_t(0)
+#endif
+						));
 			}
 #ifdef HAVE_SSL
-			if (con->GetBIO())
-			{
-				r = BIO_read(con->GetBIO(), m_inBuf.wptr(),
-						std::min(m_nSpeedLimitMaxPerTake, m_inBuf.freecapa()));
-				if (r > 0)
-					m_inBuf.got(r);
-				else
-					// <=0 doesn't mean an error, only a double check can tell
-					r = BIO_should_read(con->GetBIO()) ? 1 : -errno;
-			}
+			// with kTLS, the kernel delivers plain data, same as without TLS
+			if (con->GetBIO() && !con->HasKtlsRecv())
+				r = SslRead(con->GetBIO(), m_inBuf, nTake);
 			else
 #endif
 			{
-				r = m_inBuf.sysread(fd, m_nSpeedLimitMaxPerTake);
+#ifdef HAVE_LINUX_SPLICE
+				// body data can move from the socket to the cache file directly
+				if (m_inBuf.empty() && !inpipe.empty() && PrepareSplicePipe()
+						&& -ENOTSUP != (r = inpipe.front().SpliceData(fd, m_splicePipe,
+								min(size_t(nTake), m_nSplicePipeSize))))
+				{
+					if (r > 0)
+					{
+						if (flow)
+							flow->Refund(nTake - r);
+						if (inpipe.front().m_nRest > 0)
+							goto loop_again;
+						// complete, the job still needs to be finished
+						bSpliceFinished = true;
+						goto proc_data;
+					}
+					if (r < 0 && r != -EAGAIN)
+					{
+						// whatever is still in transit is garbage now
+						CloseSplicePipe();
+						if (inpipe.front().HasBrokenStorage())
+						{
+							setIfNotEmpty(sErrorMsg, inpipe.front().sErrorMsg);
+							return HINT_RECONNECT_NOW | EFLAG_JOB_BROKEN;
+						}
+						errno = -r;
+					}
+				}
+				else
+#endif
+				r = m_inBuf.sysread(fd, nTake);
+#ifdef HAVE_SSL
+				// non-data TLS record (alert, post-handshake message), that's for OpenSSL to handle;
+				// read() reports it as EIO, splice() as EINVAL
+				if ((r == -EIO || r == -EINVAL) && con->HasKtlsRecv())
+					r = SslRead(con->GetBIO(), m_inBuf, nTake);
+#endif
 			}
+			if (flow)
+				flow->Refund(nTake - max(r, 0));
 
 #ifdef DISCO_FAILURE
 #warning DISCO_FAILURE active!
@@ -1321,15 +1826,19 @@ inline unsigned CDlConn::ExchangeData(mstring &sErrorMsg,
 				return EFLAG_LOST_CON;
 			}
 
-			while (!m_inBuf.empty())
+			while (!m_inBuf.empty() || bSpliceFinished)
 			{
-
+				bSpliceFinished = false;
 				//ldbg("Processing job for " << inpipe.front().RemoteUri(false));
 				dbgline;
 				unsigned res = inpipe.front().ProcessIncomming(m_inBuf, false);
 				//ldbg("... incoming data processing result: " << res << ", emsg: " << inpipe.front().sErrorMsg);
 				LOG("res = " << res);
 
+				// don't stuff the pipeline into a peer which is going to close the connection
+				if (m_bShared && inpipe.front().m_bPeerCloses && !m_nTempPipelineDisable)
+					m_nTempPipelineDisable = 30;
+
 				if (res & EFLAG_MIRROR_BROKEN)
 				{
 					ldbg("###### BROKEN MIRROR ####### on " << con.get());
@@ -1343,9 +1852,22 @@ inline unsigned CDlConn::ExchangeData(mstring &sErrorMsg,
 					// just in case that server damaged the last response body
 					con->KnowLastFile(WEAK_PTR<fileitem>(inpipe.front().m_pStorage));
 
+					auto bPeerCloses = inpipe.front().m_bPeerCloses;
+					if (inpipe.size() > 1)
+					{
+						auto &host = inpipe.front().GetPeerHost();
+						// the requests behind it are lost, so pipelining was harmful here
+						if (bPeerCloses)
+							mirrorstats::ReportPipelineFailure(host);
+						else
+							mirrorstats::ReportPipelineOk(host, inpipe.front().m_nBodyReceived);
+					}
 					inpipe.pop_front();
 					if (HINT_RECONNECT_NOW & res)
 						return HINT_RECONNECT_NOW; // with cleaned flags
+					// pending requests are lost then, resend them on a new connection
+					if (bPeerCloses && m_bShared)
+						return HINT_RECONNECT_NOW;
 
 					LOG(
 							"job finished. Has more? " << inpipe.size() << ", remaining data? " << m_inBuf.size());
@@ -1375,6 +1897,7 @@ inline unsigned CDlConn::ExchangeData(mstring &sErrorMsg,
 						{
 							// not internal redirection or some failure doing it
 							m_nTempPipelineDisable = 30;
+							mirrorstats::ReportPipelineFailure(inpipe.front().GetPeerHost());
 							return (HINT_TGTCHANGE | HINT_RECONNECT_NOW);
 						}
 					}
@@ -1430,6 +1953,7 @@ void CDlConn::WorkLoop()
 	auto BlacklistMirror = [&](tDlJob &job)
 	{
 		LOGSTARTFUNCx(job.GetPeerHost().ToURI(false));
+		mirrorstats::ReportError(job.GetPeerHost(), sErrorMsg);
 		m_blacklist[job.GetPeerHost().GetHostPortKey()] = sErrorMsg;
 	};
 
@@ -1464,16 +1988,49 @@ void CDlConn::WorkLoop()
 				return;
 			}
 		}
+		if (m_bShared && next_jobs.empty() && active_jobs.empty())
+		{
+			// out of work, past failures should not affect unrelated future jobs
+			m_blacklist.clear();
+			nLostConTolerance = MAX_RETRY;
+		}
 		int newCtrlMark = m_ctrl_hint;
 		if (newCtrlMark != lastCtrlMark)
 		{
 			lastCtrlMark = newCtrlMark;
 			lockguard g(m_handover_mutex);
-			next_jobs.splice(next_jobs.begin(), m_new_jobs);
+			if (cfg::priodl <= 0)
+				next_jobs.splice(next_jobs.begin(), m_new_jobs);
+			else
+			{
+				// index files go before package files which are not requested yet, the
+				// rest keeps the order of arrival
+				auto itBulk = find_if(next_jobs.begin(), next_jobs.end(),
+						[](const tDlJob &j) { return !j.m_bPriority; });
+				while (!m_new_jobs.empty())
+				{
+					auto it = m_new_jobs.begin();
+					next_jobs.splice(it->m_bPriority ? itBulk : next_jobs.end(), m_new_jobs, it);
+				}
+			}
 		}
 		dbgline;
 		if (next_jobs.empty() && active_jobs.empty())
+		{
+			if (m_bExitWhenIdle)
+			{
+				lockguard g(m_handover_mutex);
+				if (m_new_jobs.empty())
+				{
+					m_bClosed = true;
+					if (con)
+						m_conFactory.RecycleIdleConnection(con);
+					return;
+				}
+				continue;
+			}
 			goto go_select;
+		}
 		// parent will notify RSN
 		dbgline;
 		if (!con)
@@ -1516,13 +2073,17 @@ void CDlConn::WorkLoop()
 				for(auto& j: next_jobs)
 					j.ResetStreamState();
 
-				return m_conFactory.CreateConnected(tgt.sHost,
+				auto tStart = mirrorstats::Now();
+				auto ret = m_conFactory.CreateConnected(tgt.sHost,
 						tgt.GetPort(),
 						sErrorMsg,
 						&bUsed,
 						next_jobs.front().GetConnStateTracker(),
 						IFSSLORFALSE(tgt.bSSL),
 						timeout, fresh);
+				if (ret && !bUsed)
+					mirrorstats::ReportConnect(tgt, tStart);
+				return ret;
 			};
 
 			auto &cjob = next_jobs.front();
@@ -1584,6 +2145,10 @@ void CDlConn::WorkLoop()
 					con.reset();
 					continue;
 				}
+				// a fresh peer has yet to show that it keeps the connection open, otherwise
+				// the requests queued behind the first one would be lost or even cause a reset
+				if (m_bShared && !bUsed && !m_nTempPipelineDisable)
+					m_nTempPipelineDisable = 1;
 			}
 			else
 			{
@@ -1606,6 +2171,11 @@ void CDlConn::WorkLoop()
 			}
 
 			auto &tgt = frontJob.GetPeerHost();
+			if (!active_jobs.empty()
+					&& active_jobs.size() >= mirrorstats::GetPipelineDepth(tgt))
+			{
+				break;
+			}
 			// good case, direct or tunneled connection
 			bool match = (tgt.sHost == con->GetHostname()
 						  && (tgt.GetPort() == con->GetPort()
@@ -1640,6 +2210,7 @@ void CDlConn::WorkLoop()
 			}
 
 			frontJob.AppendRequest(m_sendBuf, proxy);
+			frontJob.m_bTimedRequest = active_jobs.empty();
 			LOG("request headers added to buffer");
 			auto itSecond = next_jobs.begin();
 			active_jobs.splice(active_jobs.end(), next_jobs, next_jobs.begin(),
@@ -1734,8 +2305,11 @@ void CDlConn::WorkLoop()
 		if ((EFLAG_LOST_CON & loopRes) && !active_jobs.empty())
 		{
 			dbgline;
+			// dropped with more requests in flight, maybe because of those
+			if (active_jobs.size() > 1 && !bExpectRemoteClosing)
+				mirrorstats::ReportPipelineFailure(active_jobs.front().GetPeerHost());
 			// disconnected by OS... give it a chance, or maybe not...
-			if (! bExpectRemoteClosing)
+			if (! bExpectRemoteClosing && ! (m_bShared && active_jobs.front().m_bPeerCloses))
 			{
 				dbgline;
 				if (--nLostConTolerance <= 0)
@@ -1774,7 +2348,12 @@ void CDlConn::WorkLoop()
 		// resolving the "fatal error" situation, push the pipelined job back to new, etc.
 
 		if ((EFLAG_MIRROR_BROKEN & loopRes) && !active_jobs.empty())
+		{
+			// garbage in the response stream, could be a mixup of the pipelined responses
+			if (active_jobs.size() > 1)
+				mirrorstats::ReportPipelineFailure(active_jobs.front().GetPeerHost());
 			BlacklistMirror(active_jobs.front());
+		}
 
 		if ((EFLAG_JOB_BROKEN & loopRes) && !active_jobs.empty())
 		{
@@ -1811,9 +2390,249 @@ void CDlConn::WorkLoop()
 	}
 }
 
-std::shared_ptr<dlcon> dlcon::CreateRegular(const IDlConFactory &pConFactory)
+/**
+ * Front end which distributes the jobs of all clients onto a limited set of download agents.
+ * Jobs for the same target are preferably assigned to the same agent, so they share its
+ * upstream connection. Pass-through jobs get an agent for themselves if possible since their
+ * data flow depends on the reading client.
+ *
+ * A private instance does the same for the requests of one client connection, and is
+ * controlled by it like a regular download agent.
+ */
+class CDlManager : public dlcon, public base_with_condition
+{
+	struct tAgent
+	{
+		std::shared_ptr<CDlConn> dler;
+		std::thread thr;
+		// target of the most recently added job
+		mstring sKey;
+		unsigned nPtJobs = 0;
+		unsigned load() { return dler->m_nJobsPending; }
+	};
+	const IDlConFactory &m_conFactory;
+	const int m_nMaxAgents;
+	const bool m_bPrivate;
+	std::list<tAgent> m_agents;
+	bool m_bStopped = false;
+
+	// an agent which has nothing to do, started if the limit permits
+	tAgent* SelectIdle(cmstring& sKey)
+	{
+		tAgent *best = nullptr;
+		// the last one working on that target might still hold the connection
+		for (auto& a : m_agents)
+		{
+			if (a.load() == 0 && (!best || a.sKey == sKey))
+				best = &a;
+		}
+		if (best || int(m_agents.size()) >= m_nMaxAgents)
+			return best;
+		auto dler = make_shared<CDlConn>(m_conFactory);
+		dler->m_bShared = !m_bPrivate;
+		m_agents.emplace_back();
+		auto& a = m_agents.back();
+		a.dler = dler;
+		try
+		{
+			a.thr = std::thread([dler]() { dler->WorkLoop(); });
+		}
+		catch (...)
+		{
+			m_agents.pop_back();
+			return nullptr;
+		}
+		return &a;
+	}
+
+	tAgent* Select(cmstring& sKey, bool isPT, bool bPriority)
+	{
+		auto best = SelectIdle(sKey);
+		if (best || int(m_agents.size()) < m_nMaxAgents)
+			return best;
+		// index files should not wait behind package data, prefer agents without such
+		if (bPriority)
+		{
+			for (auto& a : m_agents)
+			{
+				if (a.dler->m_nBulkPending == 0 && a.nPtJobs == 0
+						&& (!best || a.load() < best->load()))
+				{
+					best = &a;
+				}
+			}
+			if (best)
+				return best;
+		}
+		// all busy, join an agent working on that target unless its pipeline is full already
+		if (!isPT)
+		{
+			for (auto& a : m_agents)
+			{
+				if (a.sKey == sKey && a.nPtJobs == 0
+						&& int(a.load()) < cfg::pipelinelen
+						&& (!best || a.load() < best->load()))
+				{
+					best = &a;
+				}
+			}
+			if (best)
+				return best;
+		}
+		// otherwise take the least loaded one
+		for (auto& a : m_agents)
+		{
+			if (!best || a.load() < best->load())
+				best = &a;
+		}
+		return best;
+	}
+
+	template<typename TSrc>
+	bool Dispatch(cmstring& sKey, const std::shared_ptr<fileitem> &fi, TSrc src, bool isPT, mstring extraHeaders)
+	{
+		setLockGuard;
+		if (m_bStopped)
+			return false;
+		auto agent = Select(sKey, isPT, IsIndexFile(fi));
+		if (!agent)
+			return false;
+		if (agent->load() == 0)
+			agent->nPtJobs = 0;
+		agent->sKey = sKey;
+		agent->nPtJobs += isPT;
+		return agent->dler->AddJob(fi, move(src), isPT, move(extraHeaders));
+	}
+
+public:
+	CDlManager(const IDlConFactory &pConFactory, int nMaxAgents, bool bPrivate) :
+		m_conFactory(pConFactory), m_nMaxAgents(nMaxAgents), m_bPrivate(bPrivate)
+	{
+	}
+
+	// the agents are running on their own, users of the shared instance don't control them
+	void WorkLoop() override
+	{
+		if (!m_bPrivate)
+			return;
+		{
+			lockuniq g(this);
+			while (!m_bStopped)
+				wait(g);
+		}
+		Stop();
+	}
+	void SignalStop() override
+	{
+		if (!m_bPrivate)
+			return;
+		setLockGuard;
+		m_bStopped = true;
+		notifyAll();
+	}
+
+	bool AddJob(const std::shared_ptr<fileitem> &fi, tHttpUrl src, bool isPT, mstring extraHeaders) override
+	{
+		auto sKey = src.GetHostPortKey();
+		return Dispatch(sKey, fi, move(src), isPT, move(extraHeaders));
+	}
+	bool AddJob(const std::shared_ptr<fileitem> &fi, tRepoResolvResult repoSrc, bool isPT, mstring extraHeaders) override
+	{
+		auto sKey = repoSrc.psRepoName ? *repoSrc.psRepoName : mstring();
+		return Dispatch(sKey, fi, move(repoSrc), isPT, move(extraHeaders));
+	}
+
+	/**
+	 * Run a segment of a download which is split among mirrors. That's extra work which only
+	 * goes to an agent with nothing else to do, the main download fetches the segment otherwise.
+	 */
+	bool DispatchSegment(const tDlJob &mainJob, const tHttpUrl *pBackend, int nSegment,
+			off_t nStart, off_t nEnd)
+	{
+		auto sKey = pBackend->GetHostPortKey();
+		setLockGuard;
+		if (m_bStopped)
+			return false;
+		auto agent = SelectIdle(sKey);
+		if (!agent)
+			return false;
+		agent->nPtJobs = 0;
+		agent->sKey = sKey;
+		return agent->dler->AddSegmentJob(mainJob, pBackend, nSegment, nStart, nEnd);
+	}
+
+	void Stop()
+	{
+		lockuniq g(this);
+		m_bStopped = true;
+		auto agents = move(m_agents);
+		g.unLock();
+		for (auto& a : agents)
+			a.dler->SignalStop();
+		for (auto& a : agents)
+		{
+			if (a.thr.joinable())
+				a.thr.join();
+		}
+	}
+};
+
+std::shared_ptr<dlcon> dlcon::CreateRegular(const IDlConFactory &pConFactory, unsigned nStreams)
 {
+	if (nStreams > 1)
+		return make_shared<CDlManager>(pConFactory, nStreams, true);
 	return make_shared<CDlConn>(pConFactory);
 }
 
+static std::shared_ptr<CDlManager> g_dlManager;
+static std::mutex g_dlManagerMx;
+
+std::shared_ptr<dlcon> dlcon::GetShared(const IDlConFactory &pConFactory)
+{
+	std::lock_guard<std::mutex> g(g_dlManagerMx);
+	if (!g_dlManager)
+		g_dlManager = make_shared<CDlManager>(pConFactory, cfg::dlthreads, false);
+	return g_dlManager;
+}
+
+bool CDlConn::StartSegmentHelper(const tDlJob &mainJob, const tHttpUrl *pBackend, int nSegment,
+		off_t nStart, off_t nEnd)
+{
+	LOGSTARTFUNCs;
+	// agents of the shared manager are limited by DlThreads, don't spawn extra ones
+	if (mainJob.m_parent.m_bShared)
+	{
+		std::shared_ptr<CDlManager> mgr;
+		{
+			std::lock_guard<std::mutex> g(g_dlManagerMx);
+			mgr = g_dlManager;
+		}
+		return mgr && mgr->DispatchSegment(mainJob, pBackend, nSegment, nStart, nEnd);
+	}
+	auto dler = make_shared<CDlConn>(mainJob.m_parent.m_conFactory);
+	dler->m_bExitWhenIdle = true;
+	// the segment is released by the job if the agent is not started
+	dler->AddSegmentJob(mainJob, pBackend, nSegment, nStart, nEnd);
+	RunHelper(dler);
+	return true;
+}
+
+void dlcon::StopShared()
+{
+	{
+		std::lock_guard<std::mutex> g(g_dlManagerMx);
+		if (g_dlManager)
+			g_dlManager->Stop();
+	}
+	decltype(g_helpers) helpers;
+	{
+		lockguard g(g_helpersMx);
+		helpers.swap(g_helpers);
+	}
+	for (auto& h : helpers)
+		h.first->SignalStop();
+	for (auto& h : helpers)
+		h.second.join();
+}
+
 }
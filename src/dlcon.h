@@ -32,7 +32,19 @@ struct tDlJob;
 class ACNG_API dlcon
 {
 public:
-	static SHARED_PTR<dlcon> CreateRegular(const IDlConFactory &pConFactory);
+	/**
+	 * Get a download agent for one user.
+	 * @param nStreams If more than one, the jobs are distributed over up to that many
+	 * agents with their own upstream connections
+	 */
+	static SHARED_PTR<dlcon> CreateRegular(const IDlConFactory &pConFactory, unsigned nStreams = 1);
+	/**
+	 * Get the process-wide download manager which distributes jobs onto a limited set of
+	 * download agents (see DlThreads setting). WorkLoop and SignalStop have no effect there.
+	 */
+	static SHARED_PTR<dlcon> GetShared(const IDlConFactory &pConFactory);
+	//! Stop the agents of the shared download manager, for the final shutdown
+	static void StopShared();
 	virtual ~dlcon() =default;
 	virtual void WorkLoop() =0;
 	virtual void SignalStop() =0;
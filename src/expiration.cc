@@ -4,6 +4,9 @@
 #include "filereader.h"
 #include "fileio.h"
 #include "acregistry.h"
+#include "metadb.h"
+#include "blobstore.h"
+#include "fasttier.h"
 
 #include <fstream>
 #include <map>
@@ -127,11 +130,19 @@ void expiration::HandlePkgEntry(const tRemoteFileInfo &entry)
 			else if(entry.fpr.size>=0)
 			{
 //				LOG("Doing basic header checks");
-				header h;
 				auto sHeadAbs(sPathAbs+".head");
-				if (0<h.LoadFromFile(sHeadAbs))
+				metadb::tRecord rec;
+				header h;
+				bool bHaveHead = metadb::Get(sPathRel, rec);
+				if (bHaveHead)
+					lenFromHeader = rec.contLen < 0 ? -2 : rec.contLen;
+				else if (0<h.LoadFromFile(sHeadAbs))
 				{
+					bHaveHead = true;
 					lenFromHeader=atoofft(h.h[header::CONTENT_LENGTH], -2);
+				}
+				if (bHaveHead)
+				{
 					if(lenFromHeader<0)
 					{
 						// better drop it, properly downloaded ones DO have the length
@@ -141,7 +152,7 @@ void expiration::HandlePkgEntry(const tRemoteFileInfo &entry)
 					}
 					if (lenFromHeader < lenFromStat)
 					{
-						ignore_value(::unlink(sHeadAbs.c_str()));
+						RemoveHeadFromStorage(sHeadAbs);
 
 						SendFmt << ECLASS "header file of " << sPathRel
 						<< " reported too small file size (" << lenFromHeader <<
@@ -188,6 +199,18 @@ void expiration::HandlePkgEntry(const tRemoteFileInfo &entry)
 
 			if (entry.sFileName != "Release" && entry.sFileName != "InRelease" )
 			{
+				// digest computed while downloading, good as long as the file was not changed since
+				if (entry.fpr.csType == CSTYPE_SHA256 && descHave.fpr.csType != CSTYPE_SHA256)
+				{
+					mstring sDigest;
+					off_t lenStored = -1;
+					if (ParseHeadFromStorage(sPathAbs + ".head", &lenStored, nullptr, nullptr, &sDigest)
+							&& lenStored == lenFromStat && !sDigest.empty()
+							&& descHave.fpr.SetCs(sDigest, CSTYPE_SHA256))
+					{
+						descHave.fpr.size = lenStored;
+					}
+				}
 				if(entry.fpr.csType != descHave.fpr.csType &&
 						!descHave.fpr.ScanFile(sPathAbs, entry.fpr.csType))
 				{
@@ -444,8 +467,9 @@ inline void expiration::RemoveAndStoreStatus(bool bPurgeNow)
 				SendFmt << "Removing " << sPathRel;
 				if(::unlink(sPathAbs.c_str()) && errno != ENOENT)
 					SendChunk(tErrnoFmter("<span class=\"ERROR\"> [ERROR] ")+"</span>");
+				fasttier::Drop(sPathRel);
 				SendFmt << sBRLF << "Removing " << sPathRel << ".head";
-				if(::unlink((sPathAbs + ".head").c_str()) && errno != ENOENT)
+				if(RemoveHeadFromStorage(sPathAbs + ".head") && errno != ENOENT)
 					SendChunk(tErrnoFmter("<span class=\"ERROR\"> [ERROR] ")+"</span>");
 				SendChunk(sBRLF);
 				::rmdir(SZABSPATH(dir_props.first));
@@ -473,6 +497,28 @@ inline void expiration::RemoveAndStoreStatus(bool bPurgeNow)
 	}
     if(nCount)
     	TellCount(nCount, tagSpace);
+
+#ifdef ENABLED
+	// like orphaned .head files, MetaDb records of missing files expire after a while
+	tStrVec orphans;
+	metadb::ForEach([&](cmstring& sPathRel, const metadb::tRecord& rec)
+	{
+		if (bPurgeNow || TIMEEXPIRED(rec.atime))
+			orphans.emplace_back(sPathRel);
+	});
+	// not checked in the callback, the store is locked there
+	orphans.erase(remove_if(orphans.begin(), orphans.end(),
+			[](cmstring& sPathRel) { return bool(Cstat(SABSPATH(sPathRel))); }), orphans.end());
+	for (const auto& sPathRel : orphans)
+		metadb::Drop(sPathRel);
+	if (m_bVerbose && !orphans.empty())
+		SendFmt << "Dropped metadata of " << orphans.size() << " missing files" << sBRLF;
+
+	// the contents of removed files might be kept alive by DedupStorage
+	auto nBlobs = blobstore::Sweep();
+	if (m_bVerbose && nBlobs)
+		SendFmt << "Released " << nBlobs << " unused deduplicated contents" << sBRLF;
+#endif
 }
 
 
@@ -727,7 +773,7 @@ void expiration::HandleDamagedFiles()
 				{
 					// still little risk but not of crashing
 					unlink(SZABSPATH(s));
-					unlink(SZABSPATH(s+".head"));
+					RemoveHeadFromStorage(SABSPATH(s+".head"));
 				}
 			}
 			else if(this->m_parms.type == workExTruncDamaged)
@@ -0,0 +1,450 @@
+#include "fasttier.h"
+#include "debug.h"
+#include "meta.h"
+#include "acfg.h"
+#include "fileio.h"
+#include "dirwalk.h"
+#include "lockable.h"
+
+#include <atomic>
+#include <deque>
+#include <list>
+#include <thread>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// files which were not copied yet are forgotten when there are more of them
+#define FT_MAX_CANDIDATES 100000
+// suffix of copies in progress
+#define FT_TEMP_SFX ".acngtmp"
+// copy in pieces of this size, to notice a shutdown request
+#define FT_COPY_STEP (8 << 20)
+// number of least recently used copies considered for removal
+#define FT_EVICT_WINDOW 8
+
+using namespace std;
+
+namespace acng
+{
+namespace fasttier
+{
+
+static mstring FastPath(cmstring& sPathRel)
+{
+	return cfg::fastcachedir + sPathSep + sPathRel;
+}
+
+static off_t Budget()
+{
+	return off_t(cfg::fastcachesize) << 20;
+}
+
+static bool IsCopyOf(const struct stat& stCopy, const struct stat& stOrig)
+{
+	return stCopy.st_size == stOrig.st_size
+			&& stCopy.st_mtim.tv_sec == stOrig.st_mtim.tv_sec
+			&& stCopy.st_mtim.tv_nsec == stOrig.st_mtim.tv_nsec;
+}
+
+/**
+ * Accounting of the sent data and LRU order of the copies, limited by the sum of their sizes.
+ */
+class tFastTier : public base_with_mutex
+{
+	struct tEntry
+	{
+		// bytes sent from the original while not copied
+		off_t slowBytes = 0;
+		// bytes sent from the copy since it was made
+		off_t fastBytes = 0;
+		// size of the copy, -1 if not copied
+		off_t size = -1;
+		// identity of the copy
+		dev_t dev = 0;
+		ino_t ino = 0;
+		bool queued = false;
+		std::list<mstring>::iterator lruPos;
+	};
+	std::unordered_map<mstring, tEntry> m_entries;
+	// copied files, most recently used first
+	std::list<mstring> m_lru;
+	std::deque<mstring> m_queue;
+	// including the space reserved for the copy in progress
+	off_t m_nUsed = 0;
+	std::thread m_worker;
+	bool m_bWorking = false, m_bInventoryDone = false;
+	std::atomic_bool m_bStopping {false};
+
+	void Remove(decltype(m_entries)::iterator it)
+	{
+		unlink(FastPath(it->first).c_str());
+		m_nUsed -= it->second.size;
+		m_lru.erase(it->second.lruPos);
+		m_entries.erase(it);
+		nDemoted++;
+	}
+
+	// among the least recently used copies, drop the one which served the least data per byte
+	void Evict()
+	{
+		auto victim = m_entries.end();
+		double nMinWeight = 0;
+		int n = 0;
+		for (auto rit = m_lru.rbegin(); rit != m_lru.rend() && n < FT_EVICT_WINDOW; ++rit, ++n)
+		{
+			auto it = m_entries.find(*rit);
+			auto nWeight = double(it->second.fastBytes) / it->second.size;
+			if (victim == m_entries.end() || nWeight < nMinWeight)
+			{
+				victim = it;
+				nMinWeight = nWeight;
+			}
+		}
+		Remove(victim);
+	}
+
+	// start counting for a file which might become a candidate
+	void Note(cmstring& sPathRel, off_t size, decltype(m_entries)::iterator it)
+	{
+		if (size <= 0 || it != m_entries.end())
+			return;
+		// rough aging, the counts of the rarely used files get lost
+		if (m_entries.size() >= FT_MAX_CANDIDATES + m_lru.size())
+		{
+			for (auto jt = m_entries.begin(); jt != m_entries.end();)
+			{
+				if (jt->second.size < 0 && !jt->second.queued)
+					jt = m_entries.erase(jt);
+				else
+					++jt;
+			}
+		}
+		m_entries.emplace(sPathRel, tEntry());
+	}
+
+	// start the worker thread if needed, must be locked
+	void Kick()
+	{
+		if (m_bWorking || m_bStopping)
+			return;
+		// the previous run is finished, for sure
+		if (m_worker.joinable())
+			m_worker.join();
+		m_bWorking = true;
+		try
+		{
+			m_worker = std::thread([this]() { Work(); });
+		}
+		catch (...)
+		{
+			m_bWorking = false;
+		}
+	}
+
+	void Work()
+	{
+		if (!m_bInventoryDone)
+		{
+			Inventory();
+			m_bInventoryDone = true;
+		}
+		while (true)
+		{
+			mstring sPathRel;
+			{
+				setLockGuard;
+				if (m_queue.empty() || m_bStopping)
+				{
+					m_bWorking = false;
+					return;
+				}
+				sPathRel = move(m_queue.front());
+				m_queue.pop_front();
+			}
+			Copy(sPathRel);
+		}
+	}
+
+	// learn about the copies from the previous runs, dropping the outdated ones
+	void Inventory()
+	{
+		auto prefixLen = cfg::fastcachedir.size() + 1;
+		IFileHandler::FindFiles(cfg::fastcachedir, [&](cmstring& sPath, const struct stat& stCopy)
+		{
+			if (m_bStopping)
+				return false;
+			auto sPathRel(sPath.substr(prefixLen));
+			Cstat stOrig(SABSPATH(sPathRel));
+			if (endsWithSzAr(sPath, FT_TEMP_SFX) || !stOrig || !IsCopyOf(stCopy, stOrig))
+			{
+				unlink(sPath.c_str());
+				return true;
+			}
+			setLockGuard;
+			auto& e = m_entries[sPathRel];
+			if (e.size >= 0)
+				return true;
+			e.size = stCopy.st_size;
+			e.dev = stCopy.st_dev;
+			e.ino = stCopy.st_ino;
+			m_lru.emplace_back(sPathRel);
+			e.lruPos = prev(m_lru.end());
+			m_nUsed += e.size;
+			return true;
+		}, true, false);
+		// the limit might have been lowered
+		setLockGuard;
+		while (m_nUsed > Budget() && !m_lru.empty())
+			Evict();
+	}
+
+	// make space for a new copy and reserve it
+	bool Reserve(cmstring& sPathRel, off_t size)
+	{
+		setLockGuard;
+		auto it = m_entries.find(sPathRel);
+		// found by the inventory meanwhile?
+		if (it == m_entries.end() || it->second.size >= 0 || size > Budget())
+			return false;
+		while (m_nUsed + size > Budget() && !m_lru.empty())
+			Evict();
+		m_nUsed += size;
+		return true;
+	}
+
+	bool CopyData(int src, int tgt, off_t size)
+	{
+		for (off_t pos = 0; pos < size;)
+		{
+			if (m_bStopping)
+				return false;
+			auto n = sendfile(tgt, src, &pos, min(size - pos, off_t(FT_COPY_STEP)));
+			if (n <= 0)
+			{
+				if (n < 0 && errno == EINTR)
+					continue;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void Copy(cmstring& sPathRel)
+	{
+		LOGSTARTFUNCx(sPathRel);
+		auto sOrig(SABSPATH(sPathRel)), sFast(FastPath(sPathRel)), sTemp(sFast + FT_TEMP_SFX);
+		off_t reserved = -1, size = -1;
+		struct stat stCopy;
+		{
+			unique_fd src(open(sOrig.c_str(), O_RDONLY | O_BINARY));
+			struct stat stOrig;
+			if (src.valid() && 0 == fstat(src.get(), &stOrig) && stOrig.st_size > 0
+					&& Reserve(sPathRel, stOrig.st_size))
+			{
+				reserved = stOrig.st_size;
+				mkbasedir(sFast);
+				unique_fd tgt(open(sTemp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, cfg::fileperms));
+				if (tgt.valid() && CopyData(src.get(), tgt.get(), stOrig.st_size))
+				{
+					struct timespec times[2] = { stOrig.st_atim, stOrig.st_mtim };
+					// not replaced while copying?
+					Cstat stNow(sOrig);
+					if (0 == futimens(tgt.get(), times) && stNow && IsCopyOf(stNow, stOrig)
+							&& 0 == fstat(tgt.get(), &stCopy)
+							&& 0 == rename(sTemp.c_str(), sFast.c_str()))
+					{
+						size = stOrig.st_size;
+					}
+				}
+			}
+		}
+		if (size < 0)
+			unlink(sTemp.c_str());
+
+		setLockGuard;
+		// queued entries are not removed
+		auto& e = m_entries[sPathRel];
+		e.queued = false;
+		if (size < 0)
+		{
+			if (reserved > 0)
+				m_nUsed -= reserved;
+			return;
+		}
+		e.slowBytes = e.fastBytes = 0;
+		e.size = size;
+		e.dev = stCopy.st_dev;
+		e.ino = stCopy.st_ino;
+		m_lru.emplace_front(sPathRel);
+		e.lruPos = m_lru.begin();
+		nPromoted++;
+	}
+
+public:
+	std::atomic<uint64_t> nFastHits {0}, nFastBytes {0}, nSlowHits {0}, nSlowBytes {0},
+			nPromoted {0}, nDemoted {0};
+
+	~tFastTier()
+	{
+		// not stopped on some exit paths, the process is gone anyway
+		if (m_worker.joinable())
+			m_worker.detach();
+	}
+
+	int Open(cmstring& sPathRel, off_t size)
+	{
+		bool bCopied = false;
+		{
+			setLockGuard;
+			auto it = m_entries.find(sPathRel);
+			if (it != m_entries.end() && it->second.size >= 0)
+			{
+				bCopied = true;
+				m_lru.splice(m_lru.begin(), m_lru, it->second.lruPos);
+			}
+			else
+				Note(sPathRel, size, it);
+		}
+		if (bCopied)
+		{
+			unique_fd fd(open(FastPath(sPathRel).c_str(), O_RDONLY | O_BINARY));
+			struct stat stCopy;
+			Cstat stOrig(SABSPATH(sPathRel));
+			if (fd.valid() && 0 == fstat(fd.get(), &stCopy) && stOrig && IsCopyOf(stCopy, stOrig))
+			{
+				nFastHits++;
+				return fd.release();
+			}
+			Drop(sPathRel);
+		}
+		nSlowHits++;
+		return -1;
+	}
+
+	void CountSent(cmstring& sPathRel, int fd, off_t nBytes)
+	{
+		struct stat st;
+		if (nBytes <= 0 || fstat(fd, &st))
+			return;
+		setLockGuard;
+		// not opened as a completely cached file, or forgotten already
+		auto it = m_entries.find(sPathRel);
+		if (it == m_entries.end())
+			return;
+		auto& e = it->second;
+		bool bFast = e.size >= 0 && e.dev == st.st_dev && e.ino == st.st_ino;
+		(bFast ? nFastBytes : nSlowBytes) += nBytes;
+		if (bFast)
+		{
+			e.fastBytes += nBytes;
+			return;
+		}
+		if (e.size >= 0 || e.queued || st.st_size <= 0 || st.st_size > Budget())
+			return;
+		// partial downloads count accordingly
+		e.slowBytes += nBytes;
+		if (e.slowBytes < off_t(max(1, cfg::fastcachehits)) * st.st_size)
+			return;
+		e.queued = true;
+		m_queue.emplace_back(sPathRel);
+		Kick();
+	}
+
+	void Drop(cmstring& sPathRel)
+	{
+		setLockGuard;
+		auto it = m_entries.find(sPathRel);
+		if (it != m_entries.end() && it->second.size >= 0)
+			Remove(it);
+	}
+
+	void Start()
+	{
+		setLockGuard;
+		Kick();
+	}
+
+	void Stop()
+	{
+		std::thread thr;
+		{
+			setLockGuard;
+			m_bStopping = true;
+			thr.swap(m_worker);
+		}
+		if (thr.joinable())
+			thr.join();
+	}
+
+	mstring GetReport()
+	{
+		off_t used;
+		size_t nFiles, nQueued;
+		{
+			setLockGuard;
+			used = m_nUsed;
+			nFiles = m_lru.size();
+			nQueued = m_queue.size();
+		}
+		uint64_t nFast = nFastHits, nAll = nFast + nSlowHits;
+		uint64_t nFastB = nFastBytes, nAllB = nFastB + nSlowBytes;
+		char buf[500];
+		snprintf(buf, sizeof(buf), "Fast cache storage: %s of %s used by %lu files, %lu waiting to be copied. "
+				"Served from there: %lu of %lu cached file requests (%.0f%%), %s of %s (%.0f%%). "
+				"Files copied: %lu, removed: %lu.",
+				offttosH(used).c_str(), offttosH(Budget()).c_str(),
+				(unsigned long) nFiles, (unsigned long) nQueued,
+				(unsigned long) nFast, (unsigned long) nAll, nAll ? nFast * 100.0 / nAll : 0.0,
+				offttosH(nFastB).c_str(), offttosH(nAllB).c_str(), nAllB ? nFastB * 100.0 / nAllB : 0.0,
+				(unsigned long) nPromoted, (unsigned long) nDemoted);
+		return buf;
+	}
+} g_fastTier;
+
+bool IsActive()
+{
+	return !cfg::fastcachedir.empty() && cfg::fastcachesize > 0;
+}
+
+int Open(cmstring& sPathRel, off_t size)
+{
+	return IsActive() ? g_fastTier.Open(sPathRel, size) : -1;
+}
+
+void CountSent(cmstring& sPathRel, int fd, off_t nBytes)
+{
+	if (IsActive())
+		g_fastTier.CountSent(sPathRel, fd, nBytes);
+}
+
+void Drop(cmstring& sPathRel)
+{
+	if (IsActive())
+		g_fastTier.Drop(sPathRel);
+}
+
+void Start()
+{
+	if (IsActive())
+		g_fastTier.Start();
+}
+
+void Stop()
+{
+	if (IsActive())
+		g_fastTier.Stop();
+}
+
+mstring GetReport()
+{
+	if (!IsActive())
+		return "Fast cache storage is not configured (see FastCacheDir option).";
+	return g_fastTier.GetReport();
+}
+
+}
+}
@@ -0,0 +1,52 @@
+#ifndef FASTTIER_H
+#define FASTTIER_H
+
+#include "actypes.h"
+
+namespace acng
+{
+
+/**
+ * Copies of frequently requested cache files on a faster storage (FastCacheDir option).
+ *
+ * The files in the cache directory stay authoritative. A copy is valid only while its size
+ * and modification time are equal to those of the original. Files are copied after enough
+ * of their data was sent (a multiple of their size), and copies are removed when the size
+ * limit is exceeded, choosing among the least recently used ones that which served the
+ * least data in relation to its size. Copying and the initial inventory of the fast storage
+ * are done by a background thread.
+ */
+namespace fasttier
+{
+
+//! Fast storage is configured
+bool IsActive();
+
+/**
+ * Open the fast copy of a completely cached file, and count the access.
+ * @param size Size of the original file
+ * @return File descriptor, or -1 if the original file needs to be used
+ */
+int Open(cmstring& sPathRel, off_t size);
+
+/**
+ * Account data which was sent to a client.
+ * @param fd The descriptor it was read from, either the copy or the original file
+ */
+void CountSent(cmstring& sPathRel, int fd, off_t nBytes);
+
+//! Remove the copy of a cache file (relative path) which is going to be modified
+void Drop(cmstring& sPathRel);
+
+//! Start the inventory of existing copies, to be called after forking
+void ACNG_API Start();
+//! Finish pending background work
+void ACNG_API Stop();
+
+//! HTML fragment with usage information for the report page
+mstring GetReport();
+
+}
+}
+
+#endif // FASTTIER_H
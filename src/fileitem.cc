@@ -6,10 +6,18 @@
 #include "acfg.h"
 #include "acbuf.h"
 #include "fileio.h"
+#include "ramcache.h"
+#include "metadb.h"
+#include "blobstore.h"
+#include "fasttier.h"
+#include "uring.h"
 
 #include <algorithm>
+#include <list>
+#include <unordered_map>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
@@ -17,6 +25,10 @@
 using namespace std;
 
 #define ASSERT_HAVE_LOCK ASSERT(m_obj_mutex.try_lock() == false);
+// write-behind flushes end at multiples of this
+#define WB_ALIGN 4096
+// upper limit for one step of progressive preallocation
+#define PREALLOC_STEP_MAX (64 << 20)
 
 namespace acng
 {
@@ -36,6 +48,52 @@ void fileitem::DlRefCountAdd()
 	m_nDlRefsCount++;
 }
 
+void fileitem::notifyAll()
+{
+	base_with_condition::notifyAll();
+	NotifySubscribers(true);
+}
+
+void fileitem::NotifySubscribers(bool force)
+{
+	if (m_subscribers.empty())
+		return;
+	auto it = m_subscribers.begin();
+	while (it != m_subscribers.end())
+	{
+		if (!force && m_nSizeChecked <= it->watermark)
+		{
+			++it;
+			continue;
+		}
+		uint64_t one = 1;
+		while (write(it->fd, &one, sizeof(one)) == -1 && errno == EINTR)
+			;
+		it = m_subscribers.erase(it);
+	}
+}
+
+bool fileitem::Subscribe(int evfd, off_t nWatermark, FiStatus seenStatus)
+{
+	setLockGuard;
+	if (m_status != seenStatus || m_nSizeChecked > nWatermark)
+		return false;
+	for (auto& el : m_subscribers)
+	{
+		if (el.fd == evfd)
+			return el.watermark = nWatermark, true;
+	}
+	m_subscribers.push_back({evfd, nWatermark});
+	return true;
+}
+
+void fileitem::Unsubscribe(int evfd)
+{
+	setLockGuard;
+	m_subscribers.erase(std::remove_if(m_subscribers.begin(), m_subscribers.end(),
+			[evfd](const tSubscriber& el) { return el.fd == evfd; }), m_subscribers.end());
+}
+
 void fileitem::DlRefCountDec(const tRemoteStatus& reason)
 {
 	setLockGuard;
@@ -95,6 +153,93 @@ void fileitem::ResetCacheState()
 }
 */
 
+/**
+ * Bounded LRU cache of the relevant .head contents of completely cached files, keyed by
+ * relative path. An entry is only valid as long as the data file has the same identity,
+ * size and modification time as when the entry was stored.
+ */
+class tHeadCache : public base_with_mutex
+{
+	struct tEntry
+	{
+		dev_t dev;
+		ino_t ino;
+		off_t size;
+		timespec mtime;
+		off_t contLen;
+		tHttpDate modDate;
+		mstring origin;
+		std::list<mstring>::iterator lruPos;
+
+		bool matches(const struct stat& st) const
+		{
+			return dev == st.st_dev && ino == st.st_ino && size == st.st_size
+					&& mtime.tv_sec == st.st_mtim.tv_sec && mtime.tv_nsec == st.st_mtim.tv_nsec;
+		}
+	};
+	std::unordered_map<mstring, tEntry> m_entries;
+	// most recently used first
+	std::list<mstring> m_lru;
+
+public:
+	bool Get(cmstring& sPathRel, const struct stat& st, off_t *contLen, tHttpDate *modDate, mstring *origin)
+	{
+		setLockGuard;
+		auto it = m_entries.find(sPathRel);
+		if (it == m_entries.end())
+			return false;
+		auto& e = it->second;
+		if (!e.matches(st))
+		{
+			m_lru.erase(e.lruPos);
+			m_entries.erase(it);
+			return false;
+		}
+		m_lru.splice(m_lru.begin(), m_lru, e.lruPos);
+		*contLen = e.contLen;
+		*modDate = e.modDate;
+		*origin = e.origin;
+		return true;
+	}
+	void Put(cmstring& sPathRel, const struct stat& st, off_t contLen, const tHttpDate &modDate, cmstring &origin)
+	{
+		if (cfg::metacachesize <= 0)
+			return;
+		setLockGuard;
+		auto it = m_entries.find(sPathRel);
+		if (it == m_entries.end())
+		{
+			while (!m_lru.empty() && m_entries.size() >= size_t(cfg::metacachesize))
+			{
+				m_entries.erase(m_lru.back());
+				m_lru.pop_back();
+			}
+			m_lru.emplace_front(sPathRel);
+			it = m_entries.emplace(sPathRel, tEntry()).first;
+			it->second.lruPos = m_lru.begin();
+		}
+		else
+			m_lru.splice(m_lru.begin(), m_lru, it->second.lruPos);
+		auto& e = it->second;
+		e.dev = st.st_dev;
+		e.ino = st.st_ino;
+		e.size = st.st_size;
+		e.mtime = st.st_mtim;
+		e.contLen = contLen;
+		e.modDate = modDate;
+		e.origin = origin;
+	}
+	void Drop(cmstring& sPathRel)
+	{
+		setLockGuard;
+		auto it = m_entries.find(sPathRel);
+		if (it == m_entries.end())
+			return;
+		m_lru.erase(it->second.lruPos);
+		m_entries.erase(it);
+	}
+} g_headCache;
+
 fileitem::FiStatus fileitem_with_storage::Setup()
 {
 	LOGSTARTFUNC;
@@ -114,12 +259,36 @@ fileitem::FiStatus fileitem_with_storage::Setup()
 	m_status = FIST_INITED;
 
 	cmstring sPathAbs(CACHE_BASE + m_sPathRel);
-	m_nSizeCachedInitial = GetFileSize(sPathAbs, -1);
+	Cstat stbuf(sPathAbs);
+
+	// by-hash files name their contents, which might be stored under another name already
+	if (!stbuf && blobstore::IsActive())
+	{
+		constexpr string_view byHashSha256 = "/by-hash/SHA256/";
+		auto pos = m_sPathRel.rfind(byHashSha256);
+		time_t mtime;
+		mstring sSum;
+		if (pos != stmiss)
+			sSum = m_sPathRel.substr(pos + byHashSha256.size());
+		auto len = sSum.empty() ? -1 : blobstore::Provide(sSum, sPathAbs, &mtime);
+		if (len >= 0)
+		{
+			tHttpDate modDate(mtime);
+			StoreHeadToStorage(sPathAbs + ".head", len, &modDate, nullptr, &sSum);
+			stbuf.update(sPathAbs.c_str());
+		}
+	}
+
+	m_nSizeCachedInitial = stbuf ? stbuf.st_size : -1;
 	m_nSizeChecked = -1;
 
-	if (!ParseHeadFromStorage(sPathAbs + ".head", &m_nContentLength, &m_responseModDate, &m_responseOrigin))
+	if (!stbuf || !g_headCache.Get(m_sPathRel, stbuf, &m_nContentLength, &m_responseModDate, &m_responseOrigin))
 	{
-		return error_clean();
+		if (!ParseHeadFromStorage(sPathAbs + ".head", &m_nContentLength, &m_responseModDate, &m_responseOrigin))
+			return error_clean();
+		// only worth it when there is no download activity expected
+		if (stbuf && m_nContentLength == m_nSizeCachedInitial)
+			g_headCache.Put(m_sPathRel, stbuf, m_nContentLength, m_responseModDate, m_responseOrigin);
 	}
 
 	LOG("good head");
@@ -166,7 +335,10 @@ void fileitem::UpdateHeadTimestamp()
 {
 	if(m_sPathRel.empty())
 		return;
-	utimes(SZABSPATH(m_sPathRel + ".head"), nullptr);
+	if (metadb::IsActive())
+		metadb::Touch(m_sPathRel);
+	else
+		utimes(SZABSPATH(m_sPathRel + ".head"), nullptr);
 }
 
 std::pair<fileitem::FiStatus, tRemoteStatus> fileitem::WaitForFinish()
@@ -211,10 +383,11 @@ bool fileitem_with_storage::withError(string_view message, fileitem::EDestroyMod
 
 bool fileitem_with_storage::SaveHeader(bool truncatedKeepOnlyOrigInfo)
 {
+	g_headCache.Drop(m_sPathRel);
 	auto headPath = SABSPATHEX(m_sPathRel, ".head");
 	if (truncatedKeepOnlyOrigInfo)
 		return StoreHeadToStorage(headPath, -1, nullptr, &m_responseOrigin);
-	return StoreHeadToStorage(headPath, m_nContentLength, &m_responseModDate, &m_responseOrigin);
+	return StoreHeadToStorage(headPath, m_nContentLength, &m_responseModDate, &m_responseOrigin, &m_sSha256);
 };
 
 bool fileitem::DlStarted(string_view rawHeader, const tHttpDate& modDate, cmstring& origin, tRemoteStatus status, off_t bytes2seek, off_t bytesAnnounced)
@@ -261,12 +434,51 @@ bool fileitem::DlStarted(string_view rawHeader, const tHttpDate& modDate, cmstri
 	return true;
 }
 
-bool fileitem_with_storage::DlAddData(string_view chunk, lockuniq&)
+// stores all data at the specified position, returns 0 or the error code
+static int StoreAt(int fd, string_view data, off_t pos)
+{
+	while (!data.empty())
+	{
+		auto r = pwrite(fd, data.data(), data.size(), pos);
+		if (r == -1)
+		{
+			if (EINTR != errno && EAGAIN != errno)
+				return errno;
+			continue;
+		}
+		pos += r;
+		data.remove_prefix(r);
+	}
+	return 0;
+}
+
+// StoreAt for the write-behind buffer, also preallocating the space after it (if nAllocLen is
+// set). With io_uring, that's done in one submission, and the data is synced to disk.
+static int StoreFlushed(int fd, string_view data, off_t pos, off_t nAllocStart, off_t nAllocLen)
+{
+	auto r = uring::WriteSynced(fd, data.data(), data.size(), pos, nAllocStart, nAllocLen);
+	if (r == -ENOSYS)
+	{
+		if (nAllocLen > 0)
+			falloc_helper(fd, nAllocStart, nAllocLen);
+		return StoreAt(fd, data, pos);
+	}
+	if (r < 0)
+		return -r;
+	if (size_t(r) == data.size())
+		return 0;
+	data.remove_prefix(r);
+	if (auto err = StoreAt(fd, data, pos + r))
+		return err;
+	return fdatasync_helper(fd) ? errno : 0;
+}
+
+bool fileitem_with_storage::DlAddData(string_view chunk, lockuniq& uli)
 {
 	LOGSTARTFUNC;
 	ASSERT_HAVE_LOCK;
 	// something might care, most likely... also about BOUNCE action
-	notifyAll();
+	base_with_condition::notifyAll();
 
 	m_nIncommingCount += chunk.size();
 	LOG("adding chunk of " << chunk.size() << " bytes at " << m_nSizeChecked);
@@ -281,20 +493,316 @@ bool fileitem_with_storage::DlAddData(string_view chunk, lockuniq&)
 	if (m_status > FIST_COMPLETE) // DLSTOP, DLERROR
 		return false;
 
+	// segment helpers rely on the main download position, no buffering there
+	size_t nCap = m_pSegments ? 0 : (size_t(max(cfg::wbbufsize, 0)) * 1024 + WB_ALIGN - 1) & ~size_t(WB_ALIGN - 1);
+	if (nCap && !m_pWbBuf && 0 != posix_memalign((void**) &m_pWbBuf, WB_ALIGN, nCap))
+	{
+		m_pWbBuf = nullptr;
+		nCap = 0;
+	}
+	if (!nCap)
+	{
+		if (!WbFlush(&uli))
+			return false;
+		if (auto err = StoreAt(m_filefd, chunk, m_nSizeChecked))
+		{
+			errno = err;
+			return withError("Write error");
+		}
+		m_nSizeChecked += chunk.size();
+		HashStored(m_nSizeChecked, chunk, &uli);
+		PreallocAhead();
+		// only those which can make progress now
+		NotifySubscribers(false);
+		return true;
+	}
 	while (!chunk.empty())
 	{
-		int r = write(m_filefd, chunk.data(), chunk.size());
-		if (r == -1)
+		if (!m_nWbFill)
+			m_nWbSince = GetTime();
+		// fill up to the next aligned file position
+		auto nRoom = nCap - size_t(m_nSizeChecked % WB_ALIGN) - m_nWbFill;
+		auto n = min(chunk.size(), nRoom);
+		memcpy(m_pWbBuf + m_nWbFill, chunk.data(), n);
+		m_nWbFill += n;
+		chunk.remove_prefix(n);
+		if (n == nRoom && !WbFlush(&uli))
+			return false;
+	}
+	// readers shall not starve on slow downloads
+	if (m_nWbFill && GetTime() - m_nWbSince >= 1)
+		return WbFlush(&uli);
+	return true;
+}
+
+bool fileitem_with_storage::DlFlush(lockuniq& uli)
+{
+	if (!WbFlush(&uli))
+		return false;
+	// parts from segment helpers or a previous download are not in the digest yet
+	HashStored(m_nSizeChecked, string_view(), &uli);
+	return m_status <= FIST_COMPLETE;
+}
+
+bool fileitem_with_storage::WbFlush(lockuniq *pLock)
+{
+	ASSERT_HAVE_LOCK;
+	if (!m_nWbFill)
+		return true;
+	// only the downloader thread touches the buffer, the lock is needed for the state only
+	off_t pos = m_nSizeChecked;
+	string_view data(m_pWbBuf, m_nWbFill);
+	// space for the following data, requested together with the write
+	off_t nAllocStart = 0, nAllocLen = 0;
+	NextPrealloc(pos + off_t(data.size()), nAllocStart, nAllocLen);
+	if (pLock)
+		pLock->unLock();
+	HashStored(pos + off_t(data.size()), data);
+	auto err = StoreFlushed(m_filefd, data, pos, nAllocStart, nAllocLen);
+	if (pLock)
+		pLock->reLock();
+	m_nWbFill = 0;
+	// something went wrong in the meantime?
+	if (m_status > FIST_COMPLETE)
+		return false;
+	if (err)
+	{
+		errno = err;
+		return withError("Write error");
+	}
+	m_nSizeChecked = pos + off_t(data.size());
+	NotifySubscribers(false);
+	return true;
+}
+
+bool fileitem_with_storage::NextPrealloc(off_t nPos, off_t &nStart, off_t &nLen)
+{
+	if (cfg::allocspace <= 0 || m_nContentLength <= 0 || m_filefd == -1
+			|| nPos + cfg::allocspace / 2 < m_nPreallocEnd)
+	{
+		return false;
+	}
+	nStart = max(m_nPreallocEnd, nPos);
+	// larger steps for larger files, so that the filesystem can pick larger extents
+	nLen = min(m_nContentLength - nStart,
+			min(max(off_t(cfg::allocspace), nStart / 2), off_t(PREALLOC_STEP_MAX)));
+	if (nLen <= 0)
+		return false;
+	m_bPreallocated = true;
+	m_nPreallocEnd = nStart + nLen;
+	return true;
+}
+
+void fileitem_with_storage::PreallocAhead()
+{
+	off_t nStart, nLen;
+	if (NextPrealloc(m_nSizeChecked, nStart, nLen))
+		falloc_helper(m_filefd, nStart, nLen);
+}
+
+// Feeds the stored data up to nEnd into the digest. The tail (if set) is the last part of it,
+// anything before is read back from the file, most likely from the page cache. That can be a
+// lot (resumed downloads, parts from segment helpers), so the lock is released meanwhile if
+// pLock is set; only the downloader thread touches the digest state.
+void fileitem_with_storage::HashStored(off_t nEnd, string_view tail, lockuniq *pLock)
+{
+	if (!m_pHasher)
+		return;
+	auto nTailStart = nEnd - off_t(tail.size());
+	if (pLock && m_nHashedPos < nTailStart)
+	{
+		pLock->unLock();
+		HashStored(nTailStart);
+		pLock->reLock();
+		if (!m_pHasher)
+			return;
+	}
+	char buf[16384];
+	while (m_nHashedPos < nTailStart)
+	{
+		auto n = pread(m_filefd, buf, min(off_t(sizeof(buf)), nTailStart - m_nHashedPos), m_nHashedPos);
+		if (n <= 0)
 		{
-			if (EINTR != errno && EAGAIN != errno)
-				return withError("Write error");
+			if (n < 0 && errno == EINTR)
+				continue;
+			m_pHasher.reset();
+			return;
 		}
-		m_nSizeChecked += r;
-		chunk.remove_prefix(r);
+		m_pHasher->add(buf, n);
+		m_nHashedPos += n;
+	}
+	if (m_nHashedPos > nTailStart)
+		tail.remove_prefix(min(off_t(tail.size()), m_nHashedPos - nTailStart));
+	m_pHasher->add(tail.data(), tail.size());
+	m_nHashedPos += tail.size();
+}
+
+bool fileitem_with_storage::DlStarted(string_view rawHeader, const tHttpDate& modDate, cmstring& origin, tRemoteStatus status, off_t bytes2seek, off_t bytesAnnounced)
+{
+	// not flushed before the restart means not wanted
+	m_nWbFill = 0;
+	// hot restart before the end of the digest, the data is going to be replaced
+	if (m_pHasher && bytes2seek < m_nHashedPos)
+	{
+		m_pHasher = csumBase::GetChecker(CSTYPE_SHA256);
+		m_nHashedPos = 0;
+	}
+	return fileitem::DlStarted(rawHeader, modDate, origin, move(status), bytes2seek, bytesAnnounced);
+}
+
+void fileitem_with_storage::DlFinish(bool forceUpdateHeader)
+{
+	WbFlush(nullptr);
+	bool bHashed = false;
+	if (m_pHasher && m_status < FIST_COMPLETE
+			&& (m_nContentLength < 0 || m_nContentLength == m_nSizeChecked))
+	{
+		// normally caught up by DlFlush already
+		HashStored(m_nSizeChecked);
+		if (m_pHasher)
+		{
+			uint8_t sum[MAXCSLEN];
+			m_pHasher->finish(sum);
+			m_sSha256 = BytesToHexString(sum, GetCSTypeLen(CSTYPE_SHA256));
+			// to be stored with the header
+			forceUpdateHeader = true;
+			bHashed = true;
+		}
+	}
+	m_pHasher.reset();
+	fileitem::DlFinish(forceUpdateHeader);
+	if (bHashed && m_status == FIST_COMPLETE && m_eDestroy == KEEP)
+		blobstore::Adopt(SABSPATH(m_sPathRel), m_sSha256, m_nSizeChecked);
+}
+
+void fileitem_with_storage::DlSetError(const tRemoteStatus& errState, EDestroyMode destroyMode)
+{
+	m_nWbFill = 0;
+	fileitem::DlSetError(errState, destroyMode);
+}
+
+bool fileitem_with_storage::DlSegmentWrite(off_t pos, string_view data)
+{
+	LOGSTARTFUNCx(pos, data.size());
+	ASSERT_HAVE_LOCK;
+
+	if (!m_pSegments || m_pSegments->bAbandoned
+			|| m_status < FIST_DLGOTHEAD || m_status >= FIST_COMPLETE)
+	{
+		return false;
+	}
+	if (m_filefd == -1 && !SafeOpenOutFile())
+		return false;
+	m_nIncommingCount += data.size();
+	if (auto err = StoreAt(m_filefd, data, pos))
+	{
+		errno = err;
+		return withError("Write error");
 	}
 	return true;
 }
 
+void fileitem_with_storage::DlSegmentsAbandon()
+{
+	ASSERT_HAVE_LOCK;
+	fileitem::DlSegmentsAbandon();
+	// parts stored by the helpers beyond the verified data would look valid on resume
+	if (m_pSegments && m_status != FIST_COMPLETE && m_filefd != -1 && m_nSizeChecked >= 0)
+		ignore_value(ftruncate(m_filefd, m_nSizeChecked));
+}
+
+#ifdef HAVE_LINUX_SPLICE
+ssize_t fileitem_with_storage::DlSpliceData(int sockfd, const int* pipefds, size_t nMax, lockuniq& uli)
+{
+	LOGSTARTFUNC;
+	ASSERT_HAVE_LOCK;
+	base_with_condition::notifyAll();
+
+	if (m_bNoSpliceWrite)
+		return -ENOTSUP;
+	if(m_filefd == -1 && !SafeOpenOutFile())
+		return -EIO;
+	if (AC_UNLIKELY(m_filefd == -1 || m_status < FIST_DLGOTHEAD))
+		return withError("Suspicious fileitem status"), -EIO;
+	if (m_status > FIST_COMPLETE) // DLSTOP, DLERROR
+		return -EIO;
+	// whatever DlAddData has collected comes first
+	if (!WbFlush(&uli))
+		return -EIO;
+
+	auto n = splice(sockfd, nullptr, pipefds[1], nullptr, nMax, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (n <= 0)
+		return n < 0 ? -errno : 0;
+	m_nIncommingCount += n;
+	LOG("splicing chunk of " << n << " bytes at " << m_nSizeChecked);
+
+	// the digest needs the data in user space, take a copy of the pipe contents instead of
+	// reading it back from the file later
+	if (m_pHasher)
+	{
+		HashStored(m_nSizeChecked, string_view(), &uli);
+		if (m_status > FIST_COMPLETE)
+			return -EIO;
+		auto nCopy = tee(pipefds[0], pipefds[3], n, SPLICE_F_NONBLOCK);
+		char buf[16384];
+		for (auto nRest = max(nCopy, ssize_t(0)); nRest > 0;)
+		{
+			auto r = read(pipefds[2], buf, min(nRest, (ssize_t) sizeof(buf)));
+			if (r <= 0)
+				return withError("Pipe error"), -EIO;
+			if (m_pHasher)
+				m_pHasher->add(buf, r);
+			nRest -= r;
+		}
+		if (nCopy == n)
+			m_nHashedPos += n;
+		else
+			m_pHasher.reset();
+	}
+
+	for (auto nRest = n; nRest > 0;)
+	{
+		loff_t pos = m_nSizeChecked;
+		auto r = splice(pipefds[0], nullptr, m_filefd, &pos, nRest, SPLICE_F_MOVE);
+		if (r > 0)
+		{
+			m_nSizeChecked += r;
+			nRest -= r;
+			continue;
+		}
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r == 0 || (errno != EINVAL && errno != ENOSYS))
+			return withError("Write error"), -EIO;
+
+		// not supported by the filesystem, copy the rest and stop splicing for this file
+		m_bNoSpliceWrite = true;
+		char buf[16384];
+		while (nRest > 0)
+		{
+			auto nRead = read(pipefds[0], buf, min(nRest, (ssize_t) sizeof(buf)));
+			if (nRead <= 0)
+				return withError("Pipe error"), -EIO;
+			for (auto p = buf; nRead > 0;)
+			{
+				auto w = pwrite(m_filefd, p, nRead, m_nSizeChecked);
+				if (w < 0 && (errno == EINTR || errno == EAGAIN))
+					continue;
+				if (w <= 0)
+					return withError("Write error"), -EIO;
+				m_nSizeChecked += w;
+				nRest -= w;
+				nRead -= w;
+				p += w;
+			}
+		}
+	}
+	PreallocAhead();
+	NotifySubscribers(false);
+	return n;
+}
+#endif
+
 bool fileitem_with_storage::SafeOpenOutFile()
 {
 	LOGSTARTFUNC;
@@ -303,11 +811,14 @@ bool fileitem_with_storage::SafeOpenOutFile()
 	if (AC_UNLIKELY(m_spattr.bNoStore))
 		return false;
 
+	ramcache::Drop(m_sPathRel);
+	fasttier::Drop(m_sPathRel);
 	MoveRelease2Sidestore();
 
 	auto sPathAbs(SABSPATH(m_sPathRel));
 
-	int flags = O_WRONLY | O_CREAT | O_BINARY;
+	// readable for the digest computation, see HashStored
+	int flags = O_RDWR | O_CREAT | O_BINARY;
 
 	mkbasedir(sPathAbs);
 
@@ -351,6 +862,26 @@ bool fileitem_with_storage::SafeOpenOutFile()
 	// maybe the old file was a symlink pointing at readonly file
 	if (m_filefd == -1 && ! replace_file())
 		return false;
+	// or the contents are shared with other files, see blobstore.h
+	struct stat stOpened;
+	if (0 == fstat(m_filefd, &stOpened) && stOpened.st_nlink > 1)
+	{
+		if (m_nSizeChecked <= 0)
+		{
+			if (!replace_file())
+				return false;
+		}
+		else
+		{
+			// resuming, keep the old data
+			checkforceclose(m_filefd);
+			if (!blobstore::Unshare(sPathAbs))
+				return withError("Cannot copy shared cache files");
+			m_filefd = open(sPathAbs.c_str(), flags, cfg::fileperms);
+			if (m_filefd == -1)
+				return withError("Cannot open cache files");
+		}
+	}
 
 	ldbg("file opened?! returned: " << m_filefd);
 
@@ -382,6 +913,12 @@ bool fileitem_with_storage::SafeOpenOutFile()
 		return withError("Checked size beyond EOF");
 	}
 
+	// the old digest is void now; when resuming, the existing data is read back once with
+	// the next chunk, see HashStored
+	m_sSha256.clear();
+	m_nHashedPos = 0;
+	m_pHasher = csumBase::GetChecker(CSTYPE_SHA256);
+
 	auto sHeadPath(sPathAbs + ".head");
 	ldbg("Storing header as " + sHeadPath);
 	if (!SaveHeader(false))
@@ -393,6 +930,7 @@ bool fileitem_with_storage::SafeOpenOutFile()
 	/** Tweak FS to receive a file of remoteSize in one sequence,
 	 * considering current m_nSizeChecked as well.
 	 */
+	m_nPreallocEnd = m_nSizeChecked;
 	if (cfg::allocspace > 0 && m_nContentLength > 0)
 	{
 		// XXX: we have the stream size parsed before but storing that member all the time just for this purpose isn't exactly great
@@ -403,6 +941,7 @@ bool fileitem_with_storage::SafeOpenOutFile()
 		{
 			falloc_helper(m_filefd, m_nSizeChecked, preservedSequenceLen);
 			m_bPreallocated = true;
+			m_nPreallocEnd += preservedSequenceLen;
 		}
 	}
 
@@ -436,6 +975,22 @@ ssize_t fileitem_with_storage::SendData(int out_fd, int in_fd, off_t &nSendPos,
 #endif
 }
 
+unique_fd fileitem_with_storage::GetFileFd()
+{
+	if (fasttier::IsActive())
+	{
+		off_t nSize;
+		{
+			setLockGuard;
+			nSize = m_status == FIST_COMPLETE ? off_t(m_nSizeChecked) : -1;
+		}
+		int fd = nSize < 0 ? -1 : fasttier::Open(m_sPathRel, nSize);
+		if (fd != -1)
+			return unique_fd(fd);
+	}
+	return fileitem::GetFileFd();
+}
+
 mstring fileitem_with_storage::NormalizePath(cmstring &sPathRaw)
 {
 	return cfg::stupidfs ? DosEscape(sPathRaw) : sPathRaw;
@@ -444,6 +999,8 @@ mstring fileitem_with_storage::NormalizePath(cmstring &sPathRaw)
 
 fileitem_with_storage::~fileitem_with_storage()
 {
+	free(m_pWbBuf);
+
 	if (AC_UNLIKELY(m_spattr.bNoStore))
 		return;
 
@@ -465,6 +1022,8 @@ fileitem_with_storage::~fileitem_with_storage()
 	{
 		if(m_bPreallocated)
 		{
+			// drop the reserved space beyond EOF
+			calcPath();
 			Cstat st(sPathAbs);
 			if (st)
 				ignore_value(truncate(sPathAbs.c_str(), st.st_size)); // CHECKED!
@@ -474,7 +1033,7 @@ fileitem_with_storage::~fileitem_with_storage()
 	case EDestroyMode::TRUNCATE:
 	{
 		calcPath();
-		if (0 != ::truncate(sPathAbs.c_str(), 0))
+		if (0 != blobstore::TruncateUnshared(sPathAbs))
 			unlink(sPathAbs.c_str());
 		fileitem_with_storage::SaveHeader(true);
 		break;
@@ -489,7 +1048,7 @@ fileitem_with_storage::~fileitem_with_storage()
 	{
 		calcPath();
 		unlink(sPathAbs.c_str());
-		unlink(sPathHead.c_str());
+		RemoveHeadFromStorage(sPathHead);
 		break;
 	}
 	case EDestroyMode::DELETE_KEEP_HEAD:
@@ -578,4 +1137,90 @@ void fileitem::DlSetError(const tRemoteStatus& errState, fileitem::EDestroyMode
 		m_eDestroy = kmode;
 }
 
+bool fileitem::DlSegmentsSetup(off_t nSegSize)
+{
+	LOGSTARTFUNCx(nSegSize);
+	ASSERT_HAVE_LOCK;
+
+	if (m_pSegments || nSegSize <= 0 || m_nContentLength <= 0 || m_nSizeChecked < 0
+			|| m_status >= FIST_COMPLETE)
+	{
+		return false;
+	}
+	auto nCount = (m_nContentLength + nSegSize - 1) / nSegSize;
+	// at least one more after the one which the main download is working on
+	if (nCount - m_nSizeChecked / nSegSize < 2)
+		return false;
+	m_pSegments.reset(new tSegments { nSegSize, std::vector<uint8_t>(nCount, tSegments::FREE) });
+	for (off_t i = 0; i < m_nSizeChecked / nSegSize; ++i)
+		m_pSegments->state[i] = tSegments::STORED;
+	return true;
+}
+
+int fileitem::DlSegmentClaim(off_t &nStart, off_t &nEnd)
+{
+	ASSERT_HAVE_LOCK;
+
+	if (!m_pSegments || m_pSegments->bAbandoned || m_status >= FIST_COMPLETE)
+		return -1;
+	auto& segs = *m_pSegments;
+	// leave the current segment of the main download and the next one to it
+	auto nMainIdx = m_nSizeChecked / segs.nSegSize;
+	for (off_t i = off_t(segs.state.size()) - 1; i > nMainIdx + 1; --i)
+	{
+		if (segs.state[i] != tSegments::FREE)
+			continue;
+		segs.state[i] = tSegments::CLAIMED;
+		nStart = i * segs.nSegSize;
+		nEnd = std::min(nStart + segs.nSegSize, m_nContentLength);
+		return int(i);
+	}
+	return -1;
+}
+
+void fileitem::DlSegmentRelease(unsigned idx, bool bStored)
+{
+	ASSERT_HAVE_LOCK;
+
+	if (!m_pSegments || idx >= m_pSegments->state.size())
+		return;
+	m_pSegments->state[idx] = bStored ? tSegments::STORED : tSegments::FREE;
+}
+
+off_t fileitem::DlSegmentRoom(off_t pos)
+{
+	if (!m_pSegments)
+		return m_nContentLength - pos;
+	auto nSegEnd = (pos / m_pSegments->nSegSize + 1) * m_pSegments->nSegSize;
+	return std::min(nSegEnd, m_nContentLength) - pos;
+}
+
+void fileitem::DlSegmentsAbandon()
+{
+	ASSERT_HAVE_LOCK;
+	if (m_pSegments)
+		m_pSegments->bAbandoned = true;
+}
+
+bool fileitem::DlSegmentsSkip()
+{
+	ASSERT_HAVE_LOCK;
+
+	if (!m_pSegments)
+		return false;
+	auto& segs = *m_pSegments;
+	bool moved = false;
+	while (m_nSizeChecked < m_nContentLength && 0 == m_nSizeChecked % segs.nSegSize)
+	{
+		auto idx = m_nSizeChecked / segs.nSegSize;
+		if (segs.state[idx] != tSegments::STORED)
+			break;
+		m_nSizeChecked = std::min((idx + 1) * segs.nSegSize, m_nContentLength);
+		moved = true;
+	}
+	if (moved)
+		notifyAll();
+	return moved;
+}
+
 }
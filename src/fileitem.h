@@ -10,7 +10,10 @@
 #include "header.h"
 #include "fileio.h"
 #include "httpdate.h"
-#include <map>
+#include "csmapping.h"
+#include <unordered_map>
+#include <vector>
+#include <memory>
 
 namespace acng
 {
@@ -19,7 +22,7 @@ class fileitem;
 struct tDlJob;
 class cacheman;
 typedef std::shared_ptr<fileitem> tFileItemPtr;
-typedef std::map<mstring, tFileItemPtr> tFiGlobMap;
+typedef std::unordered_map<mstring, tFileItemPtr> tFiGlobMap;
 struct tAppStartStop;
 
 class IFileItemRegistry;
@@ -92,6 +95,22 @@ public:
 	FiStatus GetStatus() { setLockGuard; return m_status; }
 	FiStatus GetStatusUnlocked(off_t &nGoodDataSize) { nGoodDataSize = m_nSizeChecked; return m_status; }
     FiStatus GetStatusUnlocked() { return m_status; }
+	/**
+	 * Lock-free variant of GetStatusUnlocked. If the reported status is final, the reported size is final too.
+	 */
+	FiStatus GetStatusSnapshot(off_t &nGoodDataSize) { auto ret = m_status.load(); nGoodDataSize = m_nSizeChecked; return ret; }
+
+	/**
+	 * @brief Request a wakeup when more than nWatermark bytes are available or when the status is no longer seenStatus
+	 * The notification is an eventfd counter increment. The registration is dropped when it was
+	 * triggered; only one registration per descriptor is kept.
+	 * @return false if the condition is already met, nothing registered then
+	 */
+	bool Subscribe(int evfd, off_t nWatermark, FiStatus seenStatus);
+	void Unsubscribe(int evfd);
+
+	//! Wake up all condition waiters and all subscribers, item must be locked
+	void notifyAll();
 
 //	//! returns true if complete or DL not started yet but partial file is present and contains requested range and file contents is static
 //	bool CheckUsableRange_unlocked(off_t nRangeLastByte);
@@ -116,6 +135,7 @@ public:
     bool IsVolatile() { return m_spattr.bVolatile; }
     bool IsHeadOnly() { return m_spattr.bHeadOnly; }
     off_t GetRangeLimit() { return m_spattr.nRangeLimit; }
+    cmstring& GetPathRel() { return m_sPathRel; }
 
 	uint64_t m_nIncommingCount = 0;
 
@@ -132,7 +152,7 @@ public:
 
     string_view m_contentType = "octet/stream";
 
-protected:
+SUTPROTECTED:
 
 	bool m_bPreallocated = false;
 	/**
@@ -147,11 +167,21 @@ protected:
 
 	unsigned m_nDlRefsCount = 0;
 
+	struct tSubscriber
+	{
+		int fd;
+		off_t watermark;
+	};
+	std::vector<tSubscriber> m_subscribers;
+	//! Wake up the subscribers whose condition is met (or all if forced), item must be locked
+	void NotifySubscribers(bool force);
+
     tSpecialPurposeAttr m_spattr;
 
-	off_t m_nSizeChecked = -1;
+	// atomic to allow snapshots without locking, but modified with the lock held
+	std::atomic<off_t> m_nSizeChecked = -1;
 	std::atomic<int> usercount = ATOMIC_VAR_INIT(0);
-	FiStatus m_status = FIST_FRESH;
+	std::atomic<FiStatus> m_status = FIST_FRESH;
 	EDestroyMode m_eDestroy = EDestroyMode::KEEP;
 	mstring m_sPathRel;
 	time_t m_nTimeDlStarted = 0;
@@ -181,6 +211,26 @@ protected:
 	*
 	*/
 	virtual bool DlAddData(string_view, lockuniq&)  { return false;};
+	/**
+	 * Move up to nMax bytes of body data directly from the socket into storage, through the pipe.
+	 * The pipe is empty before and after successful operation.
+	 * @param pipefds Transfer pipe, followed by a second pipe of at least the same capacity
+	 * which may be used to duplicate the data
+	 *
+	 * Fileitem must be locked before by unique lock pointed by uli object.
+	 *
+	 * @return Number of stored bytes, 0 on EOF, negative error code (-ENOTSUP if not supported by this item)
+	 */
+	virtual ssize_t DlSpliceData(int /* sockfd */, const int* /* pipefds */, size_t /* nMax */, lockuniq&) { return -ENOTSUP; }
+	/**
+	 * Store the data which DlAddData has buffered so far, so that m_nSizeChecked covers all
+	 * data received. The lock is released while writing.
+	 *
+	 * @return false on storage errors, the item is in error state then
+	 */
+	virtual bool DlFlush(lockuniq&) { return true; }
+	//! Data is held back for DlFlush; only to be checked by the downloader, no locking needed
+	virtual bool DlHasBuffered() { return false; }
 	/**
 	 * @brief Mark the download as finished, and verify that sizeChecked as sane at that moment or move to error state.
 	 */
@@ -194,9 +244,50 @@ protected:
 
 	virtual void DlSetError(const tRemoteStatus& errState, EDestroyMode destroyMode);
 
+	/**
+	 * Bookkeeping of a download which is split into segments fetched in parallel. The main
+	 * download writes sequentially and owns m_nSizeChecked, helpers store the segments they
+	 * claimed at their offsets. m_nSizeChecked only skips over segments which were stored.
+	 */
+	struct tSegments
+	{
+		enum : uint8_t { FREE, CLAIMED, STORED };
+		off_t nSegSize;
+		std::vector<uint8_t> state;
+		// the main download is gone, no more segments shall be started
+		bool bAbandoned = false;
+	};
+	std::unique_ptr<tSegments> m_pSegments;
+
+	/**
+	 * Split the download into segments of the given size.
+	 * @return false if there would not be enough to share with helpers
+	 */
+	bool DlSegmentsSetup(off_t nSegSize);
+	/**
+	 * Pick a free segment for a helper, the one nearest to the end of the file.
+	 * @return Segment index or -1 if nothing is left
+	 */
+	int DlSegmentClaim(off_t &nStart, off_t &nEnd);
+	//! A helper stopped working on the segment, with or without having it stored completely
+	void DlSegmentRelease(unsigned idx, bool bStored);
+	//! Bytes from the position until the next segment boundary (or the end)
+	off_t DlSegmentRoom(off_t pos);
+	/**
+	 * Advance m_nSizeChecked over stored segments, if it's located at the beginning of one.
+	 * @return true if moved
+	 */
+	bool DlSegmentsSkip();
+	//! Store segment data from a helper at the specified position
+	virtual bool DlSegmentWrite(off_t /* pos */, string_view /* data */) { return false; }
+	//! The main download is gone before completion, stop the helpers and drop their data
+	virtual void DlSegmentsAbandon();
+
 	// flag for shared objects and a self-reference for fast and exact deletion, together with m_globRef
 	std::weak_ptr<IFileItemRegistry> m_owner;
-	tFiGlobMap::iterator m_globRef;
+	// the registry entry (stable across rehashing) and the shard where it lives
+	tFiGlobMap::value_type* m_globRef = nullptr;
+	unsigned m_nGlobShard = 0;
 
 	friend class TFileItemHolder;
 
@@ -229,17 +320,31 @@ public:
     virtual ~fileitem_with_storage();
 
     FiStatus Setup() override;
+	unique_fd GetFileFd() override;
 
 	// send helper like wrapper for sendfile. Just declare virtual here to make it better customizable later.
 	virtual ssize_t SendData(int confd, int filefd, off_t &nSendPos, size_t nMax2SendNow) override;
 
 	static mstring NormalizePath(cmstring &sPathRaw);
 
-protected:
+SUTPROTECTED:
 	void MoveRelease2Sidestore();
 	int m_filefd = -1;
 
+	bool DlStarted(string_view rawHeader, const tHttpDate& modDate, cmstring& origin, tRemoteStatus status, off_t bytes2seek, off_t bytesAnnounced) override;
 	bool DlAddData(string_view chunk, lockuniq&) override;
+	// also catches up with the digest, without holding the lock meanwhile
+	bool DlFlush(lockuniq& uli) override;
+	bool DlHasBuffered() override { return m_nWbFill; }
+	void DlFinish(bool forceUpdateHeader) override;
+	void DlSetError(const tRemoteStatus& errState, EDestroyMode destroyMode) override;
+#ifdef HAVE_LINUX_SPLICE
+	ssize_t DlSpliceData(int sockfd, const int* pipefds, size_t nMax, lockuniq&) override;
+	// splicing into the file was rejected by the OS
+	bool m_bNoSpliceWrite = false;
+#endif
+	bool DlSegmentWrite(off_t pos, string_view data) override;
+	void DlSegmentsAbandon() override;
 
 	bool withError(string_view message, fileitem::EDestroyMode destruction
 			= fileitem::EDestroyMode::KEEP);
@@ -247,6 +352,26 @@ protected:
 	bool SaveHeader(bool truncatedKeepOnlyOrigInfo) override;
 private:
 	bool SafeOpenOutFile();
+
+	// write-behind buffer (see WriteBehindBuffer), holding data which follows m_nSizeChecked
+	char *m_pWbBuf = nullptr;
+	size_t m_nWbFill = 0;
+	// when the first data was buffered
+	time_t m_nWbSince = 0;
+	// writes the buffer, without holding the lock meanwhile if pLock is set
+	bool WbFlush(lockuniq *pLock);
+	// end of the preallocated range of the file
+	off_t m_nPreallocEnd = 0;
+	// range to preallocate when the data reaches nPos, reserved as done
+	bool NextPrealloc(off_t nPos, off_t &nStart, off_t &nLen);
+	void PreallocAhead();
+
+	// SHA256 of the stored data, fed while storing it
+	std::unique_ptr<csumBase> m_pHasher;
+	off_t m_nHashedPos = 0;
+	// hex string of the digest once the download is complete
+	mstring m_sSha256;
+	void HashStored(off_t nEnd, string_view tail = string_view(), lockuniq *pLock = nullptr);
 };
 
 
@@ -9,6 +9,7 @@
 #include "fileio.h"
 #include "filereader.h"
 #include "httpdate.h"
+#include "metadb.h"
 
 #include <map>
 #include <iostream>
@@ -235,6 +236,10 @@ header::eHeadPos header::resolvePos(string_view key)
 int header::LoadFromFile(const string &sPath)
 {
 	clear();
+	mstring key;
+	metadb::tRecord rec;
+	if (metadb::KeyFromHeadPath(sPath, key) && metadb::Get(key, rec))
+		return Load(metadb::FormatHead(rec));
 #if 0
 	filereader buf;
 	return buf.OpenFile(sPath, true) && LoadFromBuf(buf.GetBuffer(), buf.GetSize());
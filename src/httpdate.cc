@@ -2,6 +2,7 @@
 #include "meta.h"
 #include "filereader.h"
 #include "acfg.h"
+#include "metadb.h"
 
 using namespace std;
 
@@ -160,10 +161,25 @@ bool tHttpDate::operator==(const char *other) const
         return !otherSet;
 }
 
-string_view contLenPfx(WITHLEN("Content-Length: ")), laMoPfx(WITHLEN("Last-Modified: ")), origSrcPfx(WITHLEN("X-Original-Source: "));
+string_view contLenPfx(WITHLEN("Content-Length: ")), laMoPfx(WITHLEN("Last-Modified: ")), origSrcPfx(WITHLEN("X-Original-Source: ")), sha256Pfx(WITHLEN("X-Content-Sha256: "));
 
-bool ParseHeadFromStorage(cmstring &path, off_t *contLen, tHttpDate *lastModified, mstring *origSrc)
+bool ParseHeadFromStorage(cmstring &path, off_t *contLen, tHttpDate *lastModified, mstring *origSrc, mstring *sha256)
 {
+    mstring key;
+    metadb::tRecord rec;
+    if (metadb::KeyFromHeadPath(path, key) && metadb::Get(key, rec))
+    {
+        if (contLen && rec.contLen >= 0)
+            *contLen = rec.contLen;
+        if (lastModified && rec.lastModified.isSet())
+            *lastModified = rec.lastModified;
+        if (origSrc && !rec.origin.empty())
+            *origSrc = rec.origin;
+        if (sha256 && !rec.sha256.empty())
+            *sha256 = rec.sha256;
+        return true;
+    }
+    // legacy format, or MetaDb not active
     acbuf buf;
     if(!buf.initFromFile(path.c_str()))
         return -1;
@@ -197,11 +213,18 @@ bool ParseHeadFromStorage(cmstring &path, off_t *contLen, tHttpDate *lastModifie
             *origSrc = it;
             origSrc = nullptr;
         }
+        else if (sha256 && startsWith(it, sha256Pfx))
+        {
+            it.remove_prefix(sha256Pfx.size());
+            trimBoth(it);
+            *sha256 = it;
+            sha256 = nullptr;
+        }
     }
     return true;
 }
 
-bool StoreHeadToStorage(cmstring &path, off_t contLen, tHttpDate *lastModified, mstring *origSrc)
+bool StoreHeadToStorage(cmstring &path, off_t contLen, tHttpDate *lastModified, mstring *origSrc, const mstring *sha256)
 {
     if (path.empty())
         return false;
@@ -212,18 +235,38 @@ bool StoreHeadToStorage(cmstring &path, off_t contLen, tHttpDate *lastModified,
     auto temp2 = path;
     temp2[temp2.size()-1] = '+';
 #endif
+    metadb::tRecord rec;
+    rec.contLen = contLen;
+    if (lastModified)
+        rec.lastModified = *lastModified;
+    if (origSrc)
+        rec.origin = *origSrc;
+    if (sha256)
+        rec.sha256 = *sha256;
+    mstring key;
+    if (metadb::KeyFromHeadPath(path, key) && metadb::IsActive())
+    {
+        rec.atime = GetTime();
+        if (!metadb::Put(key, rec))
+            return false;
+        // would be outdated now
+        unlink(path.c_str());
+        return true;
+    }
     tSS fmt(250);
-    fmt << "HTTP/1.1 200 OK\r\n"sv;
-	if (contLen >= 0)
-		fmt << "Content-Length: "sv << contLen << svRN;
-    if (lastModified && lastModified->isSet())
-        fmt << "Last-Modified: "sv << lastModified->view() << svRN;
-    if (origSrc && !origSrc->empty())
-        fmt << "X-Original-Source: "sv << *origSrc << svRN;
-    fmt << svRN;
+    fmt << metadb::FormatHead(rec);
 	return fmt.dumpall(path.c_str(), O_CREAT, cfg::fileperms, INT_MAX, true);
 }
 
+int RemoveHeadFromStorage(cmstring &path)
+{
+    mstring key;
+    bool dropped = metadb::KeyFromHeadPath(path, key) && metadb::Drop(key);
+    if (0 == unlink(path.c_str()) || dropped)
+        return 0;
+    return -1;
+}
+
 tRemoteStatus::tRemoteStatus(string_view s, int errorCode, bool stripHttpPrefix)
 {
 	tSplitWalk split(s);
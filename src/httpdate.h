@@ -121,10 +121,16 @@ struct ACNG_API tRemoteStatus
  * @param contLen Content-Length to add (optional)
  * @param lastModified Last-Modified date to add (optional)
  * @param origSrc Original source mark
+ * @param sha256 Hex string of the SHA256 digest of the body, as computed while downloading (optional)
  * @return True if succeeded
  */
-bool ACNG_API ParseHeadFromStorage(cmstring &path, off_t *contLen, tHttpDate *lastModified, mstring *origSrc);
-bool ACNG_API StoreHeadToStorage(cmstring &path, off_t contLen, tHttpDate *lastModified, mstring *origSrc);
+bool ACNG_API ParseHeadFromStorage(cmstring &path, off_t *contLen, tHttpDate *lastModified, mstring *origSrc, mstring *sha256 = nullptr);
+bool ACNG_API StoreHeadToStorage(cmstring &path, off_t contLen, tHttpDate *lastModified, mstring *origSrc, const mstring *sha256 = nullptr);
+/**
+ * @brief Remove the head file, or its record in MetaDb
+ * @return 0 on success, -1 with errno set by unlink otherwise
+ */
+int ACNG_API RemoveHeadFromStorage(cmstring &path);
 
 }
 
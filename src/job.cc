@@ -13,6 +13,7 @@
 #include "fileio.h" // for ::stat and related macros
 #include "maintenance.h"
 #include "evabase.h"
+#include "fasttier.h"
 
 #include <algorithm>
 #include <cstdio>
@@ -23,6 +24,11 @@
 #include <dirent.h>
 #include <event2/buffer.h>
 #include <errno.h>
+#include <sys/uio.h>
+#include <poll.h>
+#ifdef HAVE_LINUX_EVENTFD
+#include <sys/eventfd.h>
+#endif
 
 using namespace std;
 
@@ -246,6 +252,8 @@ job::~job()
 		stcode = m_pItem.get()->m_responseStatus.code;
 		inCount = m_pItem.get()->TakeTransferCount();
 	}
+	if (m_nFileDataCount > 0 && m_filefd.valid())
+		fasttier::CountSent(m_pItem.get()->GetPathRel(), m_filefd.get(), m_nFileDataCount);
 
 	bool bErr = m_sFileLoc.empty() || stcode >= 400;
 
@@ -253,6 +261,9 @@ job::~job()
 				m_sFileLoc + (bErr ? (miscError + ltos(stcode) + ']') : sEmptyString),
 				move(m_xff), inCount,
 				m_nAllDataCount, bErr);
+#ifdef HAVE_LINUX_EVENTFD
+	checkforceclose(m_wakeFd);
+#endif
 }
 
 
@@ -454,6 +465,8 @@ void job::Prepare(const header &h, string_view headBuf, cmstring& callerHostname
 
 	LOGSTARTFUNC;
 
+	m_pSendFlow = bwsched::GetServeFlow(callerHostname);
+
 #ifdef DEBUGLOCAL
 	cfg::localdirs["stuff"]="/tmp/stuff";
 	log::dbg(m_pReqHead->ToString());
@@ -798,6 +811,17 @@ job::eJobResult job::SendData(int confd, bool haveMoreJobs)
 		return return_discon();
 	};
 
+	// body data quota, see bwsched
+	auto quota = [&](off_t n) -> off_t
+	{
+		return m_pSendFlow && n > 0 ? off_t(m_pSendFlow->Acquire(n)) : n;
+	};
+	auto refund = [&](off_t granted, ssize_t used)
+	{
+		if (m_pSendFlow && granted > used)
+			m_pSendFlow->Refund(granted - max(used, ssize_t(0)));
+	};
+
 	if (confd < 0)
 	{
 		return return_discon(); // shouldn't be here
@@ -808,6 +832,33 @@ job::eJobResult job::SendData(int confd, bool haveMoreJobs)
 		return return_discon(); // just stop and close connection
 	}
 
+	if (m_pRamItem && m_activity == STATE_SEND_DATA)
+	{
+		// header remainder and the requested part of the body in one call
+		auto& body = m_pRamItem->body;
+		off_t nEnd = m_nReqRangeTo >= 0 ? min(off_t(body.size()), m_nReqRangeTo + 1) : off_t(body.size());
+		auto nBody = quota(nEnd - m_nSendPos);
+		iovec iov[2] = {
+			{ (void*) m_sendbuf.rptr(), m_sendbuf.size() },
+			{ (void*) (body.data() + m_nSendPos), size_t(nBody) }
+		};
+		auto r = writev(confd, iov, 2);
+		refund(nBody, r - ssize_t(m_sendbuf.size()));
+		if (r == -1)
+		{
+			if (errno == EAGAIN || errno == EINTR || errno == EWOULDBLOCK)
+				return R_AGAIN;
+			return return_discon();
+		}
+		m_nAllDataCount += r;
+		size_t nHeadSent = min(size_t(r), size_t(m_sendbuf.size()));
+		m_sendbuf.drop(nHeadSent);
+		m_nSendPos += r - nHeadSent;
+		if (m_sendbuf.empty() && m_nSendPos >= nEnd)
+			return return_stream_ok();
+		return R_AGAIN;
+	}
+
 	if (!m_sendbuf.empty())
 	{
 		ldbg("prebuf sending: "<< m_sendbuf.c_str());
@@ -842,18 +893,50 @@ job::eJobResult job::SendData(int confd, bool haveMoreJobs)
 		if (!fi)
 			return false;
 
+		auto isSendable = [&]()
+		{
+			if (fistate >= fileitem::FIST_COMPLETE)
+				return true;
+			if (nBodySizeSoFar > m_nSendPos)
+				return true;
+			return m_bIsHeadOnly && fistate >= fileitem::FIST_DLGOTHEAD;
+		};
+		// quick check without touching the item lock, most relevant for complete files and readers following a download
+		fistate = fi->GetStatusSnapshot(nBodySizeSoFar);
+		if (isSendable())
+			return fistate <= fileitem::FIST_COMPLETE;
+
+#ifdef HAVE_LINUX_EVENTFD
+		if (m_wakeFd == -1)
+			m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (m_wakeFd != -1)
+		{
+			// the downloader triggers us when there is more than we have sent already
+			while (!isSendable())
+			{
+				if (fi->Subscribe(m_wakeFd, m_nSendPos, fistate))
+				{
+					// XXX: in 2023 or later, add a 5s timeout and send a 102 or so for waiting. Because older version of apt-cacher-ng might not understand it and fail.
+					pollfd pfd { m_wakeFd, POLLIN, 0 };
+					auto r = poll(&pfd, 1, cfg::nettimeout * 1000);
+					if (r == 0 || (r < 0 && errno != EINTR))
+						return fi->Unsubscribe(m_wakeFd), false;
+					eventfd_t dummy;
+					ignore_value(eventfd_read(m_wakeFd, &dummy));
+				}
+				fistate = fi->GetStatusSnapshot(nBodySizeSoFar);
+			}
+			LOG(int(fistate));
+			return fistate <= fileitem::FIST_COMPLETE;
+		}
+#endif
 		// make sure to collect enough data to continue
 		lockuniq g(*fi);
 		while(true)
 		{
 			dbgline;
 			fistate = fi->GetStatusUnlocked(nBodySizeSoFar);
-			if (fistate >= fileitem::FIST_COMPLETE)
-				break;
-			dbgline;
-			if (nBodySizeSoFar > m_nSendPos)
-				break;
-			if (m_bIsHeadOnly && fistate >= fileitem::FIST_DLGOTHEAD)
+			if (isSendable())
 				break;
 			// XXX: in 2023 or later, add a 5s timeout and send a 102 or so for waiting. Because older version of apt-cacher-ng might not understand it and fail.
 			bool timedOut = fi->wait_for(g, cfg::nettimeout, 1);
@@ -906,14 +989,21 @@ job::eJobResult job::SendData(int confd, bool haveMoreJobs)
 		auto limit = nBodySizeSoFar - m_nSendPos;
 		if (m_nReqRangeTo >= 0)
 			limit = min(m_nReqRangeTo + 1 - m_nSendPos, limit);
+		// the item might have been completed right after the last chunk was sent
+		if (limit <= 0 && fistate == fileitem::FIST_COMPLETE && m_nSendPos == nBodySizeSoFar)
+			return return_stream_ok();
 		if (limit <= 0)
 			return R_DISCON;
 		ldbg("~senddata: to " << nBodySizeSoFar << ", OLD m_nSendPos: " << m_nSendPos);
+		limit = quota(limit);
 		int n = fi->SendData(confd, m_filefd.get(), m_nSendPos, limit);
+		refund(limit, n);
 		ldbg("~senddata: " << n << " new m_nSendPos: " << m_nSendPos);
 		if (n < 0)
 			return return_discon();
 		m_nAllDataCount += n;
+		if (m_filefd.valid())
+			m_nFileDataCount += n;
 		if (fistate == fileitem::FIST_COMPLETE && m_nSendPos == nBodySizeSoFar)
 			return return_stream_ok();
 		else if (m_nReqRangeTo >= 0 && m_nSendPos >= m_nReqRangeTo + 1)
@@ -943,11 +1033,14 @@ job::eJobResult job::SendData(int confd, bool haveMoreJobs)
 	case (STATE_SEND_CHUNK_DATA):
 	{
 		// this is only entered after STATE_SEND_CHUNK_HEADER
-		int n = fi->SendData(confd, m_filefd.get(), m_nSendPos, m_nChunkEnd - m_nSendPos);
+		auto limit = quota(m_nChunkEnd - m_nSendPos);
+		int n = fi->SendData(confd, m_filefd.get(), m_nSendPos, limit);
+		refund(limit, n);
 		ldbg("~sendchunk: " << n << " new m_nSendPos: " << m_nSendPos);
 		if (n < 0)
 			return HandleSuddenError();
 		m_nAllDataCount += n;
+		m_nFileDataCount += n;
 		if (m_nSendPos == m_nChunkEnd)
 		{
 			m_sendbuf << svRN;
@@ -1025,7 +1118,22 @@ inline void job::CookResponseHeader()
 	if (!fi)
 		return quickResponse("500 Invalid cache object", false, STATE_DISCO_ASAP);
 
-	lockguard g(*fi);
+	// content description for a full body response, item must be locked
+	auto cookItemHead = [fi]()
+	{
+		tSS ret;
+		ret << "Content-Type: " << fi->m_contentType << svRN;
+		if (fi->m_responseModDate.isSet() && ! fi->m_responseModDate.view().empty())
+		{
+			ret << "Last-Modified: " << fi->m_responseModDate.view() << svRN;
+		}
+		ret << "Content-Length: " << fi->m_nContentLength << svRN;
+		if (!fi->m_responseOrigin.empty())
+			ret << "X-Original-Source: " << fi->m_responseOrigin << svRN;
+		return mstring(ret.view());
+	};
+
+	lockuniq g(*fi);
 
 	auto& remoteHead = fi->GetRawResponseHeader();
 	if(!remoteHead.empty())
@@ -1067,6 +1175,18 @@ inline void job::CookResponseHeader()
 	// possible or considered here (because too nasty to track later errors,
 	// better just resend it, this is a rare case anyway)
 	auto contLen = fi->m_nContentLength;
+
+	// the body is going to be sent, maybe from memory; needs the item unlocked
+	auto obtainRamItem = [&]()
+	{
+		if (m_bIsHeadOnly || fist != fileitem::FIST_COMPLETE)
+			return;
+		g.unLock();
+		m_pRamItem = ramcache::Obtain(*fi, cookItemHead);
+		// replaced meanwhile, not matching the prepared response
+		if (m_pRamItem && off_t(m_pRamItem->body.size()) != contLen)
+			m_pRamItem.reset();
+	};
 #ifdef FORCE_CHUNKED
 #warning FORCE_CHUNKED active!
 	auto goChunked = true;
@@ -1111,20 +1231,21 @@ inline void job::CookResponseHeader()
 				  << "Content-Length: "sv << cl << svRN
 				  << src;
 		AppendMetaHeaders();
+		obtainRamItem();
 		return;
 	}
 	// everything else is plain full-body response
 	m_nReqRangeTo = -1;
 	m_nReqRangeFrom = 0;
-	PrependHttpVariant() << "200 OK" << svRN
-						 << "Content-Type: " << fi->m_contentType << svRN;
-	if (fi->m_responseModDate.isSet() && ! fi->m_responseModDate.view().empty())
+	PrependHttpVariant() << "200 OK" << svRN;
+	obtainRamItem();
+	if (m_pRamItem)
+		m_sendbuf << m_pRamItem->head;
+	else
 	{
-		m_sendbuf << "Last-Modified: " << fi->m_responseModDate.view() << svRN;
+		g.reLockSafe();
+		m_sendbuf << cookItemHead();
 	}
-	m_sendbuf << "Content-Length: " << contLen << svRN
-			  << src;
-
 	AppendMetaHeaders();
 	return;
 }
@@ -5,6 +5,8 @@
 #include "acbuf.h"
 #include <sys/types.h>
 #include "acregistry.h"
+#include "ramcache.h"
+#include "bwsched.h"
 
 #include <set>
 
@@ -50,9 +52,17 @@ public:
 	TFileItemHolder m_pItem;
 
 	unique_fd m_filefd;    
+	// complete body from memory, if available, replaces m_filefd
+	ramcache::tRamItemPtr m_pRamItem;
+#ifdef HAVE_LINUX_EVENTFD
+	// progress notifications from the file item while waiting for data, closed in destructor
+	int m_wakeFd = -1;
+#endif
     bool m_bIsHttp11 = true;
 	bool m_bIsHeadOnly = false;
     ISharedConnectionResources &m_pParentCon;
+	// delivery speed limit, shared with other connections of the same client
+	bwsched::tFlowPtr m_pSendFlow;
 
 	enum EKeepAliveMode : uint8_t
 	{
@@ -74,6 +84,8 @@ public:
     off_t m_nSendPos = 0;
     off_t m_nChunkEnd = -1;
     off_t m_nAllDataCount = 0;
+	// body data sent from m_filefd, for the fast storage accounting
+	off_t m_nFileDataCount = 0;
 
 	job(const job&);
 	job& operator=(const job&);
@@ -0,0 +1,511 @@
+#include "metadb.h"
+#include "acfg.h"
+#include "meta.h"
+#include "debug.h"
+#include "fileio.h"
+
+#include <atomic>
+#include <limits>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define MDB_MAGIC "ACNGMDB1"
+#define MDB_MAGIC_LEN 8
+// the mapping grows in steps of this size
+#define MDB_MAP_STEP (64 << 20)
+// rewrite the log when it's mostly garbage and big enough to bother
+#define MDB_COMPACT_MIN (16 << 20)
+// access times are only updated when older than this (seconds)
+#define MDB_TOUCH_STEP 3600
+
+using namespace std;
+
+namespace acng
+{
+namespace metadb
+{
+
+enum : uint8_t
+{
+	OP_PUT = 1, OP_DROP = 2
+};
+
+struct tRecHead
+{
+	// length of the payload which follows
+	uint32_t len;
+	uint32_t crc;
+};
+
+template<typename TLen>
+static void AddStr(mstring& out, string_view s)
+{
+	TLen n = min(s.size(), size_t(numeric_limits<TLen>::max()));
+	out.append((const char*) &n, sizeof(n));
+	out.append(s.data(), n);
+}
+
+template<typename T>
+static void AddVal(mstring& out, T val)
+{
+	out.append((const char*) &val, sizeof(val));
+}
+
+static mstring Encode(uint8_t op, string_view key, const tRecord *pRec)
+{
+	mstring out(sizeof(tRecHead), '\0');
+	AddVal(out, op);
+	AddStr<uint16_t>(out, key);
+	if (pRec)
+	{
+		AddVal<int64_t>(out, pRec->contLen);
+		AddVal<int64_t>(out, pRec->atime);
+		AddStr<uint8_t>(out, pRec->lastModified.view());
+		AddStr<uint16_t>(out, pRec->origin);
+		AddStr<uint8_t>(out, pRec->sha256);
+	}
+	tRecHead h { uint32_t(out.size() - sizeof(tRecHead)), 0 };
+	h.crc = crc32(0, (const Bytef*) out.data() + sizeof(h), h.len);
+	memcpy(&out[0], &h, sizeof(h));
+	return out;
+}
+
+class tReader
+{
+	const char *m_p, *m_end;
+public:
+	bool ok = true;
+	tReader(const char *p, size_t len) : m_p(p), m_end(p + len) {}
+	template<typename T> T Val()
+	{
+		T ret = T();
+		if (m_end - m_p < ptrdiff_t(sizeof(T)))
+			return ok = false, ret;
+		memcpy(&ret, m_p, sizeof(T));
+		m_p += sizeof(T);
+		return ret;
+	}
+	template<typename TLen> string_view Str()
+	{
+		auto n = Val<TLen>();
+		if (!ok || m_end - m_p < ptrdiff_t(n))
+			return ok = false, string_view();
+		string_view ret(m_p, n);
+		m_p += n;
+		return ret;
+	}
+};
+
+class tStore
+{
+	int m_fd = -1;
+	const char *m_pMap = nullptr;
+	size_t m_nMapLen = 0;
+	// end of the valid log, and the part of it which is still referenced
+	off_t m_nEnd = 0, m_nLive = 0;
+	// next size which is worth a compaction attempt, raised when an attempt fails
+	off_t m_nCompactAt = MDB_COMPACT_MIN;
+	mstring m_sPath;
+	// key hash -> position of the put record
+	unordered_multimap<size_t, off_t> m_index;
+
+	bool Map(size_t nNeeded)
+	{
+		if (nNeeded <= m_nMapLen)
+			return true;
+		if (m_pMap)
+			munmap((void*) m_pMap, m_nMapLen);
+		m_nMapLen = (max(nNeeded, size_t(m_nEnd)) / MDB_MAP_STEP + 1) * MDB_MAP_STEP;
+		auto p = mmap(nullptr, m_nMapLen, PROT_READ, MAP_SHARED, m_fd, 0);
+		if (p == MAP_FAILED)
+		{
+			m_pMap = nullptr;
+			m_nMapLen = 0;
+			return false;
+		}
+		m_pMap = (const char*) p;
+		return true;
+	}
+
+	// payload of the record at pos, empty if out of range or damaged
+	string_view Payload(off_t pos, off_t nLimit)
+	{
+		tRecHead h;
+		if (pos + off_t(sizeof(h)) > nLimit || !Map(pos + sizeof(h)))
+			return string_view();
+		memcpy(&h, m_pMap + pos, sizeof(h));
+		if (h.len > nLimit - pos - sizeof(h) || !Map(pos + sizeof(h) + h.len))
+			return string_view();
+		string_view ret(m_pMap + pos + sizeof(h), h.len);
+		if (h.crc != crc32(0, (const Bytef*) ret.data(), ret.size()))
+			return string_view();
+		return ret;
+	}
+
+	off_t RecSize(off_t pos)
+	{
+		tRecHead h;
+		memcpy(&h, m_pMap + pos, sizeof(h));
+		return sizeof(h) + h.len;
+	}
+
+	static string_view Key(string_view payload, uint8_t *pOp = nullptr)
+	{
+		tReader rd(payload.data(), payload.size());
+		auto op = rd.Val<uint8_t>();
+		if (pOp)
+			*pOp = op;
+		auto ret = rd.Str<uint16_t>();
+		return rd.ok ? ret : string_view();
+	}
+
+	decltype(m_index)::iterator Find(string_view key)
+	{
+		auto range = m_index.equal_range(hash<string_view>()(key));
+		for (auto it = range.first; it != range.second; ++it)
+		{
+			if (Key(Payload(it->second, m_nEnd)) == key)
+				return it;
+		}
+		return m_index.end();
+	}
+
+	bool Append(const mstring& rec)
+	{
+		for (size_t done = 0; done < rec.size();)
+		{
+			auto n = pwrite(m_fd, rec.data() + done, rec.size() - done, m_nEnd + done);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+			{
+				// don't leave a partial record behind
+				ignore_value(ftruncate(m_fd, m_nEnd));
+				return false;
+			}
+			done += n;
+		}
+		m_nEnd += rec.size();
+		return true;
+	}
+
+	// drop the records not referenced anymore by rewriting the log
+	bool Compact()
+	{
+		auto sTemp = m_sPath + ".new";
+		unique_fd tmp(open(sTemp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, cfg::fileperms));
+		if (!tmp.valid())
+			return false;
+		tSS buf;
+		buf << MDB_MAGIC;
+		off_t nPos = MDB_MAGIC_LEN;
+		vector<off_t> newPos;
+		newPos.reserve(m_index.size());
+		for (const auto& kv : m_index)
+		{
+			auto n = RecSize(kv.second);
+			buf.append(m_pMap + kv.second, n);
+			newPos.emplace_back(nPos);
+			nPos += n;
+			if (buf.size() > MDB_MAP_STEP && buf.dumpall(tmp.m_p) < 0)
+				return false;
+		}
+		if (buf.dumpall(tmp.m_p) < 0 || fdatasync(tmp.m_p) || flock(tmp.m_p, LOCK_EX | LOCK_NB)
+				|| rename(sTemp.c_str(), m_sPath.c_str()))
+		{
+			return false;
+		}
+		auto itPos = newPos.begin();
+		for (auto& kv : m_index)
+			kv.second = *itPos++;
+		munmap((void*) m_pMap, m_nMapLen);
+		m_pMap = nullptr;
+		m_nMapLen = 0;
+		std::swap(m_fd, tmp.m_p);
+		m_nEnd = m_nLive = nPos;
+		return true;
+	}
+
+	void CompactIfWasteful()
+	{
+		if (m_nEnd <= m_nCompactAt || m_nLive * 2 >= m_nEnd)
+			return;
+		if (Compact())
+			m_nCompactAt = MDB_COMPACT_MIN;
+		else
+		{
+			log::err(tErrnoFmter("Cannot compact metadata store: "));
+			m_nCompactAt = m_nEnd + MDB_COMPACT_MIN;
+		}
+	}
+
+public:
+	mutex m_mx;
+
+	// the descriptor is replaced by compaction, work on a copy to not hold the lock meanwhile
+	bool Sync()
+	{
+		unique_fd fd;
+		{
+			lock_guard<mutex> g(m_mx);
+			fd.m_p = dup(m_fd);
+		}
+		return fd.valid() && 0 == fdatasync_helper(fd.m_p);
+	}
+
+	~tStore()
+	{
+		if (m_pMap)
+			munmap((void*) m_pMap, m_nMapLen);
+		checkforceclose(m_fd);
+	}
+
+	bool Open(cmstring& sPath, mstring& sErr)
+	{
+		m_sPath = sPath;
+		mkbasedir(sPath);
+		m_fd = open(sPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, cfg::fileperms);
+		if (m_fd == -1)
+			return sErr = "Cannot open " + sPath + ": " + tErrnoFmter(), false;
+		if (flock(m_fd, LOCK_EX | LOCK_NB))
+			return sErr = sPath + " is used by another process", false;
+		auto nSize = lseek(m_fd, 0, SEEK_END);
+		if (nSize < 0)
+			return sErr = "Cannot read " + sPath + ": " + tErrnoFmter(), false;
+		if (nSize == 0)
+		{
+			m_nEnd = 0;
+			if (!Append(MDB_MAGIC) || !Sync())
+				return sErr = "Cannot write " + sPath + ": " + tErrnoFmter(), false;
+			return true;
+		}
+		if (nSize < MDB_MAGIC_LEN || !Map(nSize) || memcmp(m_pMap, MDB_MAGIC, MDB_MAGIC_LEN))
+			return sErr = sPath + " is not a metadata store", false;
+
+		off_t pos = MDB_MAGIC_LEN;
+		for (string_view payload; !(payload = Payload(pos, nSize)).empty(); pos += sizeof(tRecHead) + payload.size())
+		{
+			uint8_t op;
+			auto key = Key(payload, &op);
+			m_nEnd = pos;
+			auto it = Find(key);
+			if (it != m_index.end())
+			{
+				m_nLive -= RecSize(it->second);
+				m_index.erase(it);
+			}
+			if (op == OP_PUT)
+			{
+				m_index.emplace(hash<string_view>()(key), pos);
+				m_nLive += sizeof(tRecHead) + payload.size();
+			}
+		}
+		m_nEnd = pos;
+		if (pos < nSize)
+		{
+			log::err(tSS() << "Metadata store " << sPath << " damaged at " << pos << ", dropped "
+					<< (nSize - pos) << " bytes");
+			ignore_value(ftruncate(m_fd, pos));
+		}
+		CompactIfWasteful();
+		return true;
+	}
+
+	bool Get(cmstring& key, tRecord& rec)
+	{
+		auto it = Find(key);
+		if (it == m_index.end())
+			return false;
+		auto payload = Payload(it->second, m_nEnd);
+		tReader rd(payload.data(), payload.size());
+		rd.Val<uint8_t>();
+		rd.Str<uint16_t>();
+		rec.contLen = rd.Val<int64_t>();
+		rec.atime = rd.Val<int64_t>();
+		auto lm = rd.Str<uint8_t>();
+		rec.lastModified = lm.empty() ? tHttpDate() : tHttpDate(lm);
+		rec.origin = rd.Str<uint16_t>();
+		rec.sha256 = rd.Str<uint8_t>();
+		return rd.ok;
+	}
+
+	bool Put(cmstring& key, const tRecord* pRec)
+	{
+		auto it = Find(key);
+		if (!pRec && it == m_index.end())
+			return false;
+		auto pos = m_nEnd;
+		if (!Append(Encode(pRec ? OP_PUT : OP_DROP, key, pRec)))
+			return false;
+		if (it != m_index.end())
+		{
+			m_nLive -= RecSize(it->second);
+			m_index.erase(it);
+		}
+		if (pRec)
+		{
+			m_index.emplace(hash<string_view>()(key), pos);
+			m_nLive += m_nEnd - pos;
+		}
+		// don't let the log grow without bounds while running
+		CompactIfWasteful();
+		return true;
+	}
+
+	void ForEach(const std::function<void(cmstring&, const tRecord&)>& visitor)
+	{
+		tRecord rec;
+		mstring key;
+		for (const auto& kv : m_index)
+		{
+			key = Key(Payload(kv.second, m_nEnd));
+			if (Get(key, rec))
+				visitor(key, rec);
+		}
+	}
+};
+
+static std::atomic<tStore*> g_store(nullptr);
+// opening was attempted already, protected by g_openMx for writing
+static std::atomic_bool g_bOpenTried(false);
+static mutex g_openMx;
+static mstring g_sOpenErr;
+
+bool Open(mstring *pErr)
+{
+	if (g_bOpenTried && !pErr)
+		return g_store;
+	lock_guard<mutex> g(g_openMx);
+	if (!g_bOpenTried)
+	{
+		g_sOpenErr.clear();
+		if (cfg::metadb <= 0)
+			g_sOpenErr = "MetaDb is not enabled";
+		else
+		{
+			auto p = new tStore;
+			if (p->Open(CACHE_BASE + cfg::privStoreRelMetaDb, g_sOpenErr))
+				g_store = p;
+			else
+			{
+				log::err(tSS() << "Metadata store not usable, falling back to .head files: " << g_sOpenErr);
+				delete p;
+			}
+		}
+		g_bOpenTried = true;
+	}
+	if (pErr)
+		*pErr = g_sOpenErr;
+	return g_store;
+}
+
+void Close()
+{
+	lock_guard<mutex> g(g_openMx);
+	delete g_store.exchange(nullptr);
+	g_bOpenTried = false;
+}
+
+bool IsActive()
+{
+	return Open();
+}
+
+static tStore* Store()
+{
+	return Open() ? g_store.load() : nullptr;
+}
+
+bool Get(cmstring& sPathRel, tRecord& rec)
+{
+	auto store = Store();
+	if (!store)
+		return false;
+	lock_guard<mutex> g(store->m_mx);
+	return store->Get(sPathRel, rec);
+}
+
+bool Put(cmstring& sPathRel, const tRecord& rec)
+{
+	auto store = Store();
+	if (!store)
+		return false;
+	{
+		lock_guard<mutex> g(store->m_mx);
+		if (!store->Put(sPathRel, &rec))
+			return false;
+	}
+	return store->Sync();
+}
+
+bool Drop(cmstring& sPathRel)
+{
+	auto store = Store();
+	if (!store)
+		return false;
+	{
+		lock_guard<mutex> g(store->m_mx);
+		if (!store->Put(sPathRel, nullptr))
+			return false;
+	}
+	// a lost drop is harmless, the record of the missing file gets dropped again later
+	store->Sync();
+	return true;
+}
+
+void Touch(cmstring& sPathRel)
+{
+	auto store = Store();
+	if (!store)
+		return;
+	auto now = GetTime();
+	lock_guard<mutex> g(store->m_mx);
+	tRecord rec;
+	if (!store->Get(sPathRel, rec) || rec.atime + MDB_TOUCH_STEP > now)
+		return;
+	rec.atime = now;
+	store->Put(sPathRel, &rec);
+}
+
+void ForEach(const std::function<void(cmstring&, const tRecord&)>& visitor)
+{
+	auto store = Store();
+	if (!store)
+		return;
+	lock_guard<mutex> g(store->m_mx);
+	store->ForEach(visitor);
+}
+
+bool KeyFromHeadPath(cmstring& sHeadPathAbs, mstring& sPathRel)
+{
+	if (!startsWith(sHeadPathAbs, CACHE_BASE) || !endsWithSzAr(sHeadPathAbs, ".head"))
+		return false;
+	sPathRel = sHeadPathAbs.substr(CACHE_BASE_LEN, sHeadPathAbs.size() - CACHE_BASE_LEN - 5);
+	return !sPathRel.empty();
+}
+
+mstring FormatHead(const tRecord& rec)
+{
+	tSS fmt(250);
+	fmt << "HTTP/1.1 200 OK\r\n"sv;
+	if (rec.contLen >= 0)
+		fmt << "Content-Length: "sv << rec.contLen << svRN;
+	if (rec.lastModified.isSet())
+		fmt << "Last-Modified: "sv << rec.lastModified.view() << svRN;
+	if (!rec.origin.empty())
+		fmt << "X-Original-Source: "sv << rec.origin << svRN;
+	if (!rec.sha256.empty())
+		fmt << "X-Content-Sha256: "sv << rec.sha256 << svRN;
+	fmt << svRN;
+	return mstring(fmt.view());
+}
+
+}
+}
@@ -0,0 +1,68 @@
+#ifndef METADB_H
+#define METADB_H
+
+#include "actypes.h"
+#include "httpdate.h"
+
+#include <functional>
+
+namespace acng
+{
+
+/**
+ * Optional replacement for the .head files next to the cached objects (MetaDb option).
+ *
+ * All records live in one append-only log in the private cache area, with a checksum on
+ * each record. New and removed records are synced to disk before returning, access time
+ * updates are not. After a crash, the log is cut at the first damaged record. The log is
+ * memory-mapped for reading, and an in-memory index maps key hashes to record positions.
+ * Obsolete records are dropped when the log is opened, by rewriting it if it is mostly
+ * garbage.
+ *
+ * Keys are relative paths of the data files. Paths of .head files are translated by the
+ * header storage functions (see httpdate.h), which also read legacy .head files when a
+ * record is missing.
+ */
+namespace metadb
+{
+
+struct tRecord
+{
+	off_t contLen = -1;
+	tHttpDate lastModified;
+	mstring origin;
+	// hex string, see fileitem_with_storage::HashStored
+	mstring sha256;
+	// last use, with TrackFileUse
+	time_t atime = 0;
+};
+
+/**
+ * Open the store if MetaDb is enabled, only done once per process. The store is locked
+ * for exclusive use by this process.
+ * @return false if disabled or not usable (with the reason in pErr, if set)
+ */
+bool ACNG_API Open(mstring *pErr = nullptr);
+//! Store is open and in use
+bool ACNG_API IsActive();
+//! Close the store, the next access opens it again; not to be used while others access it
+void ACNG_API Close();
+
+bool ACNG_API Get(cmstring& sPathRel, tRecord& rec);
+bool ACNG_API Put(cmstring& sPathRel, const tRecord& rec);
+//! @return true if a record was removed
+bool ACNG_API Drop(cmstring& sPathRel);
+//! Update the access time, unless the stored one is recent enough anyway
+void ACNG_API Touch(cmstring& sPathRel);
+//! Visit all records, without modifying the store in the callback
+void ACNG_API ForEach(const std::function<void(cmstring& sPathRel, const tRecord& rec)>& visitor);
+
+//! Relative path of the data file if the path is a .head file in the cache directory
+bool ACNG_API KeyFromHeadPath(cmstring& sHeadPathAbs, mstring& sPathRel);
+//! Record contents in the format of a .head file
+mstring ACNG_API FormatHead(const tRecord& rec);
+
+}
+}
+
+#endif // METADB_H
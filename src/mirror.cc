@@ -397,7 +397,7 @@ void pkgmirror::HandlePkgEntry(const tRemoteFileInfo &entry)
 				cmstring sDeltaPathAbs(SZABSPATH(TEMPDELTA));
 
 				::unlink(sDeltaPathAbs.c_str());
-				::unlink((sDeltaPathAbs+".head").c_str());
+				RemoveHeadFromStorage(sDeltaPathAbs+".head");
 
 				if(eDlResult::OK == Download(TEMPDELTA, false, eDlMsgPrio::HIDE_ALL, &uri))
 				{
@@ -0,0 +1,270 @@
+#include "mirrorstats.h"
+#include "debug.h"
+#include "meta.h"
+#include "lockable.h"
+#include "ahttpurl.h"
+#include "acfg.h"
+
+#include <atomic>
+#include <functional>
+
+#include <stdio.h>
+
+// hash buckets of the host table, entries are never removed
+#define MS_BUCKETS 256
+// first cool-down period, doubled with each further error in a row
+#define MS_COOLDOWN_BASE 10
+#define MS_COOLDOWN_MAX 600
+// reference size for cost estimation
+#define MS_COST_SIZE 1000000
+// don't judge the throughput by tiny files, latency dominates there
+#define MS_MIN_RATE_SAMPLE 65536
+// failed pipelining attempts in a row until the host is pinned to single requests
+#define MS_PIPE_PIN_FAILS 3
+#define MS_PIPE_PIN_TIME 3600
+
+using namespace std;
+using namespace std::chrono;
+
+namespace acng
+{
+namespace mirrorstats
+{
+
+struct tEntry
+{
+	const mstring key, name;
+	tEntry * const next;
+	// smoothed values, 0 means no data yet
+	atomic<uint64_t> connUs = ATOMIC_VAR_INIT(0), respUs = ATOMIC_VAR_INIT(0),
+			bytesPerSec = ATOMIC_VAR_INIT(0);
+	atomic<uint64_t> nDone = ATOMIC_VAR_INIT(0), nErrors = ATOMIC_VAR_INIT(0);
+	atomic<unsigned> nErrorsInRow = ATOMIC_VAR_INIT(0);
+	// in seconds of the steady clock
+	atomic<int64_t> coolUntil = ATOMIC_VAR_INIT(0);
+	// learned pipeline depth, 0 means no data yet; the credit collects good responses
+	// until the next step up
+	atomic<unsigned> pipeDepth = ATOMIC_VAR_INIT(0), pipeCredit = ATOMIC_VAR_INIT(0),
+			nPipeFailsInRow = ATOMIC_VAR_INIT(0);
+	atomic<int64_t> pipePinnedUntil = ATOMIC_VAR_INIT(0);
+	// the message is only touched in error cases
+	mutex msgMx;
+	mstring lastError;
+
+	tEntry(cmstring& k, cmstring& nam, tEntry* n) : key(k), name(nam), next(n) {}
+};
+
+static atomic<tEntry*> g_buckets[MS_BUCKETS];
+// serializes insertions only, readers walk the lists without locking
+static mutex g_insertMx;
+
+static atomic<tEntry*>& Bucket(cmstring& key)
+{
+	return g_buckets[hash<mstring>()(key) % MS_BUCKETS];
+}
+
+static tEntry* Find(cmstring& key)
+{
+	for (auto p = Bucket(key).load(memory_order_acquire); p; p = p->next)
+	{
+		if (p->key == key)
+			return p;
+	}
+	return nullptr;
+}
+
+static tEntry& Get(const tHttpUrl& host)
+{
+	auto key = host.GetHostPortKey();
+	auto p = Find(key);
+	if (p)
+		return *p;
+	lock_guard<mutex> g(g_insertMx);
+	auto& head = Bucket(key);
+	for (p = head.load(memory_order_acquire); p; p = p->next)
+	{
+		if (p->key == key)
+			return *p;
+	}
+	auto name = host.sHost.find(':') == stmiss ? host.sHost : "[" + host.sHost + "]";
+	p = new tEntry(key, name + ":" + ltos(host.GetPort()), head.load(memory_order_relaxed));
+	head.store(p, memory_order_release);
+	return *p;
+}
+
+// exponentially weighted moving average, new samples count a quarter
+static void Smooth(atomic<uint64_t>& val, uint64_t sample)
+{
+	auto old = val.load(memory_order_relaxed);
+	uint64_t upd;
+	do
+	{
+		upd = old ? (old * 3 + sample) / 4 : sample;
+	}
+	while (!val.compare_exchange_weak(old, max(upd, uint64_t(1)), memory_order_relaxed));
+}
+
+static uint64_t UsecSince(tStamp t)
+{
+	return duration_cast<microseconds>(Now() - t).count();
+}
+
+static int64_t SecNow()
+{
+	return duration_cast<seconds>(Now().time_since_epoch()).count();
+}
+
+void ReportConnect(const tHttpUrl& host, tStamp started)
+{
+	Smooth(Get(host).connUs, UsecSince(started));
+}
+
+void ReportResponse(const tHttpUrl& host, tStamp requested)
+{
+	Smooth(Get(host).respUs, UsecSince(requested));
+}
+
+void ReportDone(const tHttpUrl& host, uint64_t nBytes, tStamp headerReceived)
+{
+	auto& e = Get(host);
+	e.nDone++;
+	// works again, forgive the past
+	if (e.nErrorsInRow.exchange(0, memory_order_relaxed))
+		e.coolUntil = 0;
+	if (nBytes < MS_MIN_RATE_SAMPLE)
+		return;
+	auto us = max(UsecSince(headerReceived), uint64_t(1));
+	Smooth(e.bytesPerSec, nBytes * 1000000 / us);
+}
+
+void ReportError(const tHttpUrl& host, cmstring& sReason)
+{
+	LOGSTARTFUNCxs(host.sHost, sReason);
+	auto& e = Get(host);
+	e.nErrors++;
+	auto n = min(++e.nErrorsInRow, 7u);
+	e.coolUntil = SecNow() + min(MS_COOLDOWN_BASE << (n - 1), MS_COOLDOWN_MAX);
+	lock_guard<mutex> g(e.msgMx);
+	e.lastError = sReason;
+}
+
+bool IsCoolingDown(const tHttpUrl& host, mstring* pReason)
+{
+	auto p = Find(host.GetHostPortKey());
+	if (!p || p->coolUntil.load(memory_order_relaxed) <= SecNow())
+		return false;
+	if (pReason)
+	{
+		lock_guard<mutex> g(p->msgMx);
+		*pReason = p->lastError;
+	}
+	return true;
+}
+
+uint64_t GetCost(const tHttpUrl& host)
+{
+	auto p = Find(host.GetHostPortKey());
+	if (!p)
+		return 0;
+	uint64_t conn = p->connUs, resp = p->respUs, rate = p->bytesPerSec;
+	if (!conn && !resp && !rate)
+		return 0;
+	return conn + resp + (rate ? uint64_t(MS_COST_SIZE) * 1000000 / rate : 0);
+}
+
+// the configured depth is the upper limit, new hosts start in the middle
+static unsigned PipeDepth(tEntry* p)
+{
+	unsigned maxDepth = max(cfg::pipelinelen, 1);
+	auto ret = p ? p->pipeDepth.load(memory_order_relaxed) : 0;
+	if (!ret)
+		ret = max(maxDepth / 2, 1u);
+	return min(ret, maxDepth);
+}
+
+unsigned GetPipelineDepth(const tHttpUrl& host)
+{
+	auto p = Find(host.GetHostPortKey());
+	if (p && p->pipePinnedUntil.load(memory_order_relaxed) > SecNow())
+		return 1;
+	return PipeDepth(p);
+}
+
+void ReportPipelineOk(const tHttpUrl& host, uint64_t nBytes)
+{
+	auto& e = Get(host);
+	e.nPipeFailsInRow.store(0, memory_order_relaxed);
+	// deeper pipelines only help when the latency dominates, i.e. the body took no
+	// longer than a few response times to arrive
+	uint64_t resp = e.respUs, rate = e.bytesPerSec;
+	if (resp && rate && nBytes * 1000000 / rate > 4 * resp)
+		return;
+	// one step up after a full pipeline worth of good responses
+	auto depth = PipeDepth(&e);
+	if (++e.pipeCredit < depth)
+		return;
+	e.pipeCredit = 0;
+	if (depth < unsigned(cfg::pipelinelen))
+		e.pipeDepth = depth + 1;
+}
+
+void ReportPipelineFailure(const tHttpUrl& host)
+{
+	LOGSTARTFUNCx(host.sHost);
+	auto& e = Get(host);
+	e.pipeCredit = 0;
+	e.pipeDepth = max(PipeDepth(&e) / 2, 1u);
+	if (++e.nPipeFailsInRow >= MS_PIPE_PIN_FAILS)
+	{
+		e.pipeDepth = 1;
+		e.pipePinnedUntil = SecNow() + MS_PIPE_PIN_TIME;
+	}
+}
+
+mstring GetReport()
+{
+	mstring ret;
+	auto now = SecNow();
+	char buf[1024];
+	for (auto& b : g_buckets)
+	{
+		for (auto p = b.load(memory_order_acquire); p; p = p->next)
+		{
+			auto cool = p->coolUntil - now;
+			mstring msg;
+			{
+				lock_guard<mutex> g(p->msgMx);
+				msg = html_sanitize(p->lastError);
+			}
+			snprintf(buf, sizeof(buf), "<tr bgcolor=\"white\">"
+					"<td class=\"colcont\">%s</td>"
+					"<td class=\"colcont\">%s</td>"
+					"<td class=\"colcont\">%.1f ms</td>"
+					"<td class=\"colcont\">%.1f ms</td>"
+					"<td class=\"colcont\">%s/s</td>"
+					"<td class=\"colcont\">%u%s</td>"
+					"<td class=\"colcont\">%lu</td>"
+					"<td class=\"colcont\">%lu</td>"
+					"<td class=\"colcont\">%s</td>"
+					"</tr>\n",
+					html_sanitize(p->name).c_str(),
+					cool > 0 ? ("cooling down, " + ltos(cool) + "s").c_str() : "ok",
+					p->connUs / 1000.0, p->respUs / 1000.0,
+					offttosH(p->bytesPerSec).c_str(),
+					p->pipePinnedUntil > now ? 1 : PipeDepth(p),
+					p->pipePinnedUntil > now ? " (pinned)" : "",
+					(unsigned long) p->nDone, (unsigned long) p->nErrors,
+					msg.c_str());
+			ret += buf;
+		}
+	}
+	if (ret.empty())
+	{
+		ret = "<tr bgcolor=\"white\"><td class=\"colcont\" colspan=9>"
+				"<i>No remote hosts contacted yet</i></td></tr>";
+	}
+	return ret;
+}
+
+}
+}
@@ -0,0 +1,59 @@
+#ifndef MIRRORSTATS_H
+#define MIRRORSTATS_H
+
+#include "actypes.h"
+
+#include <chrono>
+
+namespace acng
+{
+class tHttpUrl;
+
+/**
+ * Process-wide health and latency records of remote hosts, identified by host and port.
+ * Shared by all download agents, so a failing mirror is avoided by all of them for a while
+ * and the fastest one of a backend list can be preferred.
+ */
+namespace mirrorstats
+{
+
+typedef std::chrono::steady_clock::time_point tStamp;
+inline tStamp Now() { return std::chrono::steady_clock::now(); }
+
+//! Time to establish a new connection
+void ReportConnect(const tHttpUrl& host, tStamp started);
+//! Time from sending the request until the response header was received
+void ReportResponse(const tHttpUrl& host, tStamp requested);
+//! Body data of a completed download, received since the header
+void ReportDone(const tHttpUrl& host, uint64_t nBytes, tStamp headerReceived);
+//! Failure which made the host unusable for now, starts or extends its cool-down
+void ReportError(const tHttpUrl& host, cmstring& sReason);
+
+/**
+ * Check whether the host is temporarily avoided.
+ * @param pReason Optional, receives the last error message then
+ */
+bool IsCoolingDown(const tHttpUrl& host, mstring* pReason = nullptr);
+
+/**
+ * Number of requests which can be sent to that host before its first response arrives,
+ * between 1 and PipelineDepth. Learned from the behavior of the host.
+ */
+unsigned GetPipelineDepth(const tHttpUrl& host);
+//! A response arrived completely while more requests were queued behind it
+void ReportPipelineOk(const tHttpUrl& host, uint64_t nBytes);
+//! Pipelined requests were lost or their responses were garbled
+void ReportPipelineFailure(const tHttpUrl& host);
+
+/**
+ * Estimated cost of a typical download from that host (lower is better), 0 if not known yet.
+ */
+uint64_t GetCost(const tHttpUrl& host);
+
+//! HTML table rows for the report page
+mstring GetReport();
+
+}
+}
+
+#endif // MIRRORSTATS_H
@@ -10,6 +10,7 @@
 #include "dlcon.h"
 #include "csmapping.h"
 #include "httpdate.h"
+#include "metadb.h"
 
 #include <iostream>
 #include <fstream>
@@ -293,6 +294,8 @@ void pkgimport::HandlePkgEntry(const tRemoteFileInfo &entry)
 
 	string sDestHeadAbs=sDestAbs+".head";
 	cmstring& sFromAbs=hit->second.sPath;
+	// the content was identified by it, so it can be stored like a digest from a download
+	auto sDigest(BytesToHexString(entry.fpr.csum, GetCSTypeLen(entry.fpr.csType)));
 
 	SendChunk(string("<font color=green>HIT: ")+sFromAbs
 			+ "<br>\nDESTINATION: "+sDestAbs+"</font><br>\n");
@@ -306,7 +309,11 @@ void pkgimport::HandlePkgEntry(const tRemoteFileInfo &entry)
 		//cerr << "Same target file, ignoring."<<endl;
 		hit->second.bFileUsed=true;
 		SendChunk("<span class=\"WARNING\">Same file exists</span><br>\n");
-		if(0!=access(sDestHeadAbs.c_str(), F_OK))
+		// the header might be stored in MetaDb instead of a file
+		mstring sKey;
+		metadb::tRecord rec;
+		if (!(metadb::KeyFromHeadPath(sDestHeadAbs, sKey) && metadb::Get(sKey, rec))
+				&& 0 != access(sDestHeadAbs.c_str(), F_OK))
 		{
 			SendChunk("<span class=\"WARNING\">Header is missing, will recreate...</span>\n<br>\n");
 			goto gen_header;
@@ -327,7 +334,8 @@ void pkgimport::HandlePkgEntry(const tRemoteFileInfo &entry)
 	gen_header:
 
 	unlink(sDestHeadAbs.c_str());
-	if (!StoreHeadToStorage(sDestAbs+".head", entry.fpr.size, nullptr, nullptr))
+	if (!StoreHeadToStorage(sDestAbs+".head", entry.fpr.size, nullptr, nullptr,
+			entry.fpr.csType == CSTYPE_SHA256 ? &sDigest : nullptr))
 	{
 		log::err("Unable to store generated header");
 		return; // junk may remain but that's a job for cleanup later
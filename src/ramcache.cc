@@ -0,0 +1,134 @@
+#include "ramcache.h"
+#include "debug.h"
+#include "meta.h"
+#include "acfg.h"
+#include "fileitem.h"
+#include "fileio.h"
+#include "lockable.h"
+
+#include <list>
+#include <unordered_map>
+
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace acng
+{
+namespace ramcache
+{
+
+/**
+ * LRU storage, limited by the sum of body sizes.
+ */
+class tRamCache : public base_with_mutex
+{
+	struct tEntry
+	{
+		tRamItemPtr item;
+		off_t contLen;
+		tHttpDate modDate;
+		std::list<mstring>::iterator lruPos;
+	};
+	std::unordered_map<mstring, tEntry> m_entries;
+	// most recently used first
+	std::list<mstring> m_lru;
+	off_t m_nUsed = 0;
+
+	void Remove(decltype(m_entries)::iterator it)
+	{
+		m_nUsed -= it->second.item->body.size();
+		m_lru.erase(it->second.lruPos);
+		m_entries.erase(it);
+	}
+
+public:
+	tRamItemPtr Get(cmstring& sPathRel, off_t contLen, const tHttpDate& modDate)
+	{
+		setLockGuard;
+		auto it = m_entries.find(sPathRel);
+		if (it == m_entries.end())
+			return tRamItemPtr();
+		if (it->second.contLen != contLen || it->second.modDate != modDate)
+		{
+			Remove(it);
+			return tRamItemPtr();
+		}
+		m_lru.splice(m_lru.begin(), m_lru, it->second.lruPos);
+		return it->second.item;
+	}
+	void Put(cmstring& sPathRel, off_t contLen, const tHttpDate& modDate, tRamItemPtr item)
+	{
+		setLockGuard;
+		auto it = m_entries.find(sPathRel);
+		if (it != m_entries.end())
+			Remove(it);
+		while (!m_lru.empty() && m_nUsed + off_t(item->body.size()) > cfg::ramcachesize)
+			Remove(m_entries.find(m_lru.back()));
+		m_lru.emplace_front(sPathRel);
+		m_nUsed += item->body.size();
+		m_entries.emplace(sPathRel, tEntry { move(item), contLen, modDate, m_lru.begin() });
+	}
+	void Drop(cmstring& sPathRel)
+	{
+		setLockGuard;
+		auto it = m_entries.find(sPathRel);
+		if (it != m_entries.end())
+			Remove(it);
+	}
+} g_ramCache;
+
+tRamItemPtr Obtain(fileitem& fi, const std::function<mstring()>& cookHead)
+{
+	if (cfg::ramcachesize <= 0 || !dynamic_cast<fileitem_with_storage*>(&fi))
+		return tRamItemPtr();
+
+	mstring sPathRel, head;
+	off_t contLen;
+	tHttpDate modDate;
+	{
+		lockguard g(fi);
+		contLen = fi.m_nContentLength;
+		if (fi.GetStatusUnlocked() != fileitem::FIST_COMPLETE || contLen < 0
+				|| contLen > cfg::ramcachemaxfile || contLen > cfg::ramcachesize)
+		{
+			return tRamItemPtr();
+		}
+		sPathRel = fi.GetPathRel();
+		modDate = fi.m_responseModDate;
+		auto ret = g_ramCache.Get(sPathRel, contLen, modDate);
+		if (ret)
+			return ret;
+		head = cookHead();
+	}
+
+	auto fd = fi.GetFileFd();
+	struct stat st;
+	if (!fd.valid() || fstat(fd.get(), &st) || st.st_size != contLen)
+		return tRamItemPtr();
+	auto item = make_shared<tRamItem>();
+	item->head.swap(head);
+	item->body.resize(contLen);
+	for (off_t pos = 0; pos < contLen;)
+	{
+		auto n = pread(fd.get(), &item->body[pos], contLen - pos, pos);
+		if (n <= 0)
+		{
+			if (n < 0 && errno == EINTR)
+				continue;
+			return tRamItemPtr();
+		}
+		pos += n;
+	}
+	g_ramCache.Put(sPathRel, contLen, modDate, item);
+	return item;
+}
+
+void Drop(cmstring& sPathRel)
+{
+	if (cfg::ramcachesize > 0)
+		g_ramCache.Drop(sPathRel);
+}
+
+}
+}
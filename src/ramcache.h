@@ -0,0 +1,41 @@
+#ifndef RAMCACHE_H
+#define RAMCACHE_H
+
+#include "actypes.h"
+
+#include <functional>
+#include <memory>
+
+namespace acng
+{
+class fileitem;
+
+/**
+ * Size-bounded memory cache of small, completely downloaded files.
+ * Each entry carries the body and the item specific part of the response header.
+ */
+namespace ramcache
+{
+
+struct tRamItem
+{
+	// header lines describing the contents, as cooked for a full body response
+	mstring head;
+	mstring body;
+};
+typedef std::shared_ptr<const tRamItem> tRamItemPtr;
+
+/**
+ * Get the contents of a complete cache item, loading it into memory first if needed.
+ * @param cookHead Creates the header part for the new entry, called with the item locked
+ * @return Entry matching the current item state, or nothing when it's not suitable for caching
+ */
+tRamItemPtr Obtain(fileitem& fi, const std::function<mstring()>& cookHead);
+
+//! Forget the entry for the cache file (relative path)
+void Drop(cmstring& sPathRel);
+
+}
+}
+
+#endif // RAMCACHE_H
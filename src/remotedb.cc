@@ -12,6 +12,8 @@
 #include "portutils.h"
 
 #include <list>
+#include <set>
+#include <tuple>
 #include <iostream>
 
 // XXX: legacy from acfg.h, improve?
@@ -72,6 +74,17 @@ void AddRemapFlag(const string & token, const string &repname)
 		if(!where.m_deltasrc.SetHttpUrl(value))
 			cerr << "Couldn't parse Debdelta source URL, ignored " <<value <<endl;
 	}
+	else if(key=="maxspeed" || key=="weight")
+	{
+		char *end = nullptr;
+		auto n = strtoul(value.c_str(), &end, 10);
+		if (value.empty() || *end || (key == "weight" && !n))
+		{
+			cerr << "Warning, bad " << key << " value for " << repname << ": " << value << endl;
+			return;
+		}
+		(key == "weight" ? where.m_nDlWeight : where.m_nMaxDlSpeed) = n;
+	}
 	else if(key=="proxy")
 	{
 		static std::list<tHttpUrl> alt_proxies;
@@ -236,6 +249,25 @@ const tRepoData * remotedb::GetRepoData(cmstring &vname)
 	return & it->second;
 }
 
+vector<tHttpUrl> remotedb::GetDirectBackends()
+{
+	vector<tHttpUrl> ret;
+	if (GetProxyInfo())
+		return ret;
+	set<tuple<string, uint16_t, bool>> seen;
+	for (const auto& repo : repoparms)
+	{
+		if (repo.second.m_pProxy && !repo.second.m_pProxy->sHost.empty())
+			continue;
+		for (const auto& be : repo.second.m_backends)
+		{
+			if (seen.emplace(be.sHost, be.GetPort(), be.bSSL).second)
+				ret.emplace_back(be);
+		}
+	}
+	return ret;
+}
+
 unsigned ReadBackendsFile(const string & sFile, const string &sRepName)
 {
 	unsigned nAddCount=0;
@@ -17,6 +17,9 @@ struct tRepoData
         std::vector<mstring> m_keyfiles;
         tHttpUrl m_deltasrc;
         tHttpUrl *m_pProxy = nullptr;
+        // in KiB/s, 0 for unlimited, see bwsched
+        unsigned m_nMaxDlSpeed = 0;
+        unsigned m_nDlWeight = 1;
         virtual ~tRepoData();
 };
 
@@ -41,6 +44,12 @@ public:
 
         virtual void PostConfig();
 
+        /**
+         * Backends of all repositories which are contacted directly (i.e. not through a proxy),
+         * one entry per host, port and protocol.
+         */
+        virtual std::vector<tHttpUrl> GetDirectBackends();
+
         virtual time_t BackgroundCleanup();
 
 		virtual ~remotedb() =default;
@@ -6,6 +6,10 @@
 #include "filereader.h"
 #include "fileio.h"
 #include "job.h"
+#include "mirrorstats.h"
+#include "tcpconnect.h"
+#include "blobstore.h"
+#include "fasttier.h"
 
 #include <iostream>
 
@@ -264,7 +268,8 @@ tDeleter::tDeleter(const tRunParms& parms, const mstring& vmode)
 				{
 					sHidParms << (del ? "Deleting " : "Truncating ") << path << suf << "<br>\n";
 					auto p = cfg::cacheDirSlash + path + suf;
-					int r = del ? unlink(p.c_str()) : truncate(p.c_str(), 0);
+					int r = !del ? blobstore::TruncateUnshared(p)
+							: (*suf ? RemoveHeadFromStorage(p) : unlink(p.c_str()));
 					if (r && errno != ENOENT)
 					{
 						tErrnoFmter ferrno("<span class=\"ERROR\">[ error: ");
@@ -355,6 +360,12 @@ void tMaintPage::SendProp(cmstring &key)
 			return SendChunk(sReportButton);
 		return SendChunk(log::GetStatReport());
 	}
+	if(key=="mirrorStats")
+		return SendChunk(mirrorstats::GetReport());
+	if(key=="tlsStats")
+		return SendChunk(GetTlsStats());
+	if(key=="fastTierStats")
+		return SendChunk(fasttier::GetReport());
 	static cmstring defStringChecked("checked");
 	if(key == "aOeDefaultChecked")
 		return SendChunk(cfg::exfailabort ? defStringChecked : sEmptyString);
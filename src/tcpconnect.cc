@@ -17,11 +17,16 @@
 #include "evabase.h"
 #include "aconnect.h"
 #include "portutils.h"
+#include "remotedb.h"
+#include "mirrorstats.h"
 
-#include <tuple>
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <unordered_map>
 
 #include <signal.h>
-#include <sys/select.h>
+#include <poll.h>
 
 #ifdef HAVE_SSL
 #include <openssl/evp.h>
@@ -57,13 +62,6 @@ tcpconnect::~tcpconnect()
 {
 	LOGSTART("tcpconnect::~tcpconnect, terminating outgoing connection class");
 	Disconnect();
-#ifdef HAVE_SSL
-	if(m_ctx)
-	{
-		SSL_CTX_free(m_ctx);
-		m_ctx=0;
-	}
-#endif
 	if(m_pStateObserver)
 	{
 		m_pStateObserver->OnRelease();
@@ -83,20 +81,80 @@ void tcpconnect::Disconnect()
 #ifdef HAVE_SSL
 	if(m_bio)
 		BIO_free_all(m_bio), m_bio=nullptr;
+	if(m_ssl)
+	{
+		// without the closing notification, the session would be marked as not resumable
+		if (SSL_is_init_finished(m_ssl))
+			SSL_shutdown(m_ssl);
+		SSL_free(m_ssl), m_ssl=nullptr;
+	}
 #endif
 
 	m_lastFile.reset();
 
 	termsocket_quick(m_conFd);
 }
+struct tIdleCon
+{
+	tDlStreamHandle handle;
+	time_t since;
+};
 acmutex spareConPoolMx;
-multimap<tuple<string,uint16_t SSL_OPT_ARG(bool) >,
-		std::pair<tDlStreamHandle, time_t> > spareConPool;
+// idle connections per host/port/protocol, the most recently used at the back
+unordered_map<string, deque<tIdleCon>> spareConPool;
+unsigned spareConCount = 0;
+// last lookup in the pool, to detect the end of an idle period
+time_t lastPoolUse = 0;
+
+std::thread prewarmThread;
+std::atomic_bool prewarmRunning(false);
+
+static string MakePoolKey(cmstring &sHostname, uint16_t nPort, bool bSsl)
+{
+	return makeHostPortKey(sHostname, nPort) + (bSsl ? "s" : "");
+}
+
+bool tcpconnect::IsIdleAlive()
+{
+	pollfd pfd { m_conFd, POLLIN, 0 };
+	int r = poll(&pfd, 1, 0);
+	if (r == 0)
+		return true;
+	if (r < 0 || (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)))
+		return false;
+	char c;
+#ifdef HAVE_SSL
+	if (m_ssl)
+	{
+		// let OpenSSL process the records, anything but data is not visible here
+		ERR_clear_error();
+		r = SSL_peek(m_ssl, &c, 1);
+		if (r > 0)
+			return true;
+		auto err = SSL_get_error(m_ssl, r);
+		return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE;
+	}
+#endif
+	r = recv(m_conFd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	return r > 0 || (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR));
+}
+
+#ifdef HAVE_SSL
+static void FreeSslShared();
+#endif
 
 ACNG_API void CloseAllCachedConnections()
 {
-	lockguard g(spareConPoolMx);
-	spareConPool.clear();
+	if (prewarmThread.joinable())
+		prewarmThread.join();
+	{
+		lockguard g(spareConPoolMx);
+		spareConPool.clear();
+		spareConCount = 0;
+	}
+#ifdef HAVE_SSL
+	FreeSslShared();
+#endif
 }
 
 tDlStreamHandle dl_con_factory::CreateConnected(cmstring &sHostname, uint16_t nPort,
@@ -115,30 +173,48 @@ tDlStreamHandle dl_con_factory::CreateConnected(cmstring &sHostname, uint16_t nP
 #endif
 
 	bool bReused=false;
-	auto key = make_tuple(sHostname, nPort SSL_OPT_ARG(bSsl) );
 
 	if(!nocache)
 	{
+		bool bWokeUp = false;
 		// mutex context
-		lockguard __g(spareConPoolMx);
-		auto it=spareConPool.find(key);
-		if(spareConPool.end() != it)
 		{
-			p=it->second.first;
-			spareConPool.erase(it);
-			bReused = true;
-			ldbg("got connection " << p.get() << " from the idle pool");
-
-			// it was reset in connection recycling, restart now
-			if(pStateTracker)
+			lockguard __g(spareConPoolMx);
+			auto now = GetTime();
+			bWokeUp = now > lastPoolUse + TIME_SOCKET_EXPIRE_CLOSE;
+			lastPoolUse = now;
+			auto it = spareConPool.find(MakePoolKey(sHostname, nPort, bSsl));
+			while (spareConPool.end() != it && !it->second.empty())
 			{
-				p->m_pStateObserver = pStateTracker;
-				pStateTracker->OnAccess();
-			}
+				auto cand = move(it->second.back());
+				it->second.pop_back();
+				spareConCount--;
+				if (now >= cand.since + TIME_SOCKET_EXPIRE_CLOSE || !cand.handle->IsIdleAlive())
+				{
+					ldbg("dropping stale connection " << cand.handle.get());
+					continue;
+				}
+				p = move(cand.handle);
+				bReused = true;
+				ldbg("got connection " << p.get() << " from the idle pool");
+
+				// it was reset in connection recycling, restart now
+				if(pStateTracker)
+				{
+					p->m_pStateObserver = pStateTracker;
+					pStateTracker->OnAccess();
+				}
 #ifdef DEBUG
-			nReuseCount.fetch_add(1);
+				nReuseCount.fetch_add(1);
 #endif
+				break;
+			}
+			if (spareConPool.end() != it && it->second.empty())
+				spareConPool.erase(it);
 		}
+		// first download after a quiet period, likely more to come soon
+		if (bWokeUp)
+			StartPrewarm();
 	}
 
 	if(!p)
@@ -212,21 +288,30 @@ void dl_con_factory::RecycleIdleConnection(tDlStreamHandle & handle) const
 #endif
 
 	auto& host = handle->GetHostname();
-	if (!host.empty())
+	if (!host.empty() && cfg::conpoolperhost > 0)
 	{
 		time_t now = GetTime();
 		lockguard __g(spareConPoolMx);
 		ldbg("caching connection " << handle.get());
 
+		auto& q = spareConPool[MakePoolKey(host, handle->GetPort(), IFSSLORFALSE(handle->m_bio))];
+		// make room for the fresh one by dropping the oldest
+		if (q.size() >= unsigned(cfg::conpoolperhost))
+		{
+			q.pop_front();
+			spareConCount--;
+		}
 		// a DOS?
-		if (spareConPool.size() < 50)
+		if (spareConCount < unsigned(max(cfg::conpoolsize, 0)))
 		{
-			spareConPool.emplace(make_tuple(host, handle->GetPort()
-					SSL_OPT_ARG(handle->m_bio) ), make_pair(handle, now));
+			q.push_back({move(handle), now});
+			spareConCount++;
 #ifndef MINIBUILD
 			cleaner::GetInstance().ScheduleFor(now + TIME_SOCKET_EXPIRE_CLOSE, cleaner::TYPE_EXCONNS);
 #endif
 		}
+		else if (q.empty())
+			spareConPool.erase(MakePoolKey(host, handle->GetPort(), IFSSLORFALSE(handle->m_bio)));
 	}
 
 	handle.reset();
@@ -237,29 +322,21 @@ time_t dl_con_factory::BackgroundCleanup()
 	lockguard __g(spareConPoolMx);
 	time_t now=GetTime();
 
-	fd_set rfds;
-	FD_ZERO(&rfds);
-	int nMaxFd=0;
-
-	// either drop the old ones, or stuff them into a quick select call to find the good sockets
+	// either drop the old ones, or check the others for remote disconnection
 	for (auto it = spareConPool.begin(); it != spareConPool.end();)
 	{
-		if (now >= (it->second.second + TIME_SOCKET_EXPIRE_CLOSE))
-			it = spareConPool.erase(it);
-		else
+		auto& q = it->second;
+		for (auto qit = q.begin(); qit != q.end();)
 		{
-			int fd = it->second.first->GetFD();
-			FD_SET(fd, &rfds);
-			nMaxFd = max(nMaxFd, fd);
-			++it;
+			if (now >= qit->since + TIME_SOCKET_EXPIRE_CLOSE || !qit->handle->IsIdleAlive())
+			{
+				qit = q.erase(qit);
+				spareConCount--;
+			}
+			else
+				++qit;
 		}
-	}
-	// if they have to send something, that must the be the CLOSE signal
-	int r=select(nMaxFd + 1, &rfds, nullptr, nullptr, CTimeVal().For(0, 1));
-	// on error, also do nothing, or stop when r fds are processed
-	for (auto it = spareConPool.begin(); r>0 && it != spareConPool.end(); r--)
-	{
-		if(FD_ISSET(it->second.first->GetFD(), &rfds))
+		if (q.empty())
 			it = spareConPool.erase(it);
 		else
 			++it;
@@ -268,6 +345,72 @@ time_t dl_con_factory::BackgroundCleanup()
 	return spareConPool.empty() ? END_OF_TIME : GetTime()+TIME_SOCKET_EXPIRE_CLOSE/4+1;
 }
 
+void dl_con_factory::StartPrewarm() const
+{
+#ifndef MINIBUILD
+	if (cfg::prewarmcons <= 0 || !cfg::persistoutgoing || evabase::in_shutdown)
+		return;
+	if (prewarmRunning.exchange(true))
+		return;
+	lockguard g(spareConPoolMx);
+	// the previous run is finished, for sure
+	if (prewarmThread.joinable())
+		prewarmThread.join();
+	try
+	{
+		prewarmThread = std::thread([this]()
+		{
+			Prewarm();
+			prewarmRunning = false;
+		});
+	}
+	catch (...)
+	{
+		prewarmRunning = false;
+	}
+#endif
+}
+
+void dl_con_factory::Prewarm() const
+{
+#ifndef MINIBUILD
+	LOGSTARTFUNC;
+	auto nWanted = unsigned(min(cfg::prewarmcons, cfg::conpoolperhost));
+	for (const auto& be : remotedb::GetInstance().GetDirectBackends())
+	{
+#ifndef HAVE_SSL
+		if (be.bSSL)
+			continue;
+#endif
+		auto key = MakePoolKey(be.sHost, be.GetPort(), be.bSSL);
+		while (!evabase::in_shutdown)
+		{
+			{
+				lockguard g(spareConPoolMx);
+				auto it = spareConPool.find(key);
+				if (spareConCount >= unsigned(max(cfg::conpoolsize, 0))
+						|| (it != spareConPool.end() && it->second.size() >= nWanted))
+				{
+					break;
+				}
+			}
+			mstring sErr;
+			auto tStart = mirrorstats::Now();
+			auto con = CreateConnected(be.sHost, be.GetPort(), sErr, nullptr, nullptr,
+					be.bSSL, cfg::fasttimeout, true);
+			if (!con)
+			{
+				USRDBG("Connection pre-warming failed for " << key << ": " << sErr);
+				mirrorstats::ReportError(be, sErr);
+				break;
+			}
+			mirrorstats::ReportConnect(be, tStart);
+			RecycleIdleConnection(con);
+		}
+	}
+#endif
+}
+
 void tcpconnect::KillLastFile()
 {
 #ifndef MINIBUILD
@@ -282,19 +425,21 @@ void dl_con_factory::dump_status()
 {
 	lockguard __g(spareConPoolMx);
 	tSS msg;
-	msg << "TCP connection cache:\n";
+	msg << "TCP connection cache (" << spareConCount << " idle):\n";
 	for (const auto& x : spareConPool)
 	{
-		if(! x.second.first)
+		for (const auto& con : x.second)
 		{
-			msg << "[BAD HANDLE] recycle at " << x.second.second << "\n";
-			continue;
-		}
+			if(! con.handle)
+			{
+				msg << "[BAD HANDLE] recycle at " << con.since << "\n";
+				continue;
+			}
 
-		msg << x.second.first->m_conFd << ": for "
-				<< get<0>(x.first) << ":" << get<1>(x.first)
-				<< ", recycled at " << x.second.second
-				<< "\n";
+			msg << con.handle->m_conFd << ": for " << x.first
+					<< ", recycled at " << con.since
+					<< "\n";
+		}
 	}
 #ifdef DEBUG
 	msg << "dbg counts, con: " << nConCount.load()
@@ -305,6 +450,111 @@ void dl_con_factory::dump_status()
 	log::err(msg);
 }
 #ifdef HAVE_SSL
+
+// keep a few tickets per host, for parallel connections
+#define SSL_SESSIONS_PER_HOST 4
+#define SSL_SESSION_HOSTS_MAX 256
+
+/*
+ * The client context is shared by all connections, the verification settings only depend on the
+ * global configuration. Resumable sessions are cached here per host:port, not in the context.
+ */
+acmutex sslCtxMx;
+SSL_CTX *sslCtx = nullptr;
+unordered_map<string, deque<SSL_SESSION*>> sslSessions;
+atomic<uint64_t> nSslHandshakes(0), nSslResumed(0), nSslHandshakeUs(0);
+
+static void StoreSslSession(cmstring& key, SSL_SESSION *sess);
+
+static int OnNewSslSession(SSL *ssl, SSL_SESSION *sess)
+{
+	auto me = (tcpconnect*) SSL_get_app_data(ssl);
+	if (!me || !SSL_SESSION_is_resumable(sess))
+		return 0;
+	// taking over the reference
+	StoreSslSession(makeHostPortKey(me->GetHostname(), me->GetPort()), sess);
+	return 1;
+}
+
+static SSL_CTX* GetSslCtx()
+{
+	lockguard g(sslCtxMx);
+	if (sslCtx)
+		return sslCtx;
+	sslCtx = SSL_CTX_new(SSLv23_client_method());
+	if (!sslCtx)
+		return nullptr;
+	SSL_CTX_load_verify_locations(sslCtx,
+			cfg::cafile.empty() ? nullptr : cfg::cafile.c_str(),
+			cfg::capath.empty() ? nullptr : cfg::capath.c_str());
+	SSL_CTX_set_session_cache_mode(sslCtx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+#ifdef SSL_OP_ENABLE_KTLS
+	if (cfg::kerneltls)
+		SSL_CTX_set_options(sslCtx, SSL_OP_ENABLE_KTLS);
+#else
+	if (cfg::kerneltls)
+		log::err("Kernel TLS is not supported by the OpenSSL version in use");
+#endif
+	SSL_CTX_sess_set_new_cb(sslCtx, OnNewSslSession);
+	return sslCtx;
+}
+
+static void StoreSslSession(cmstring& key, SSL_SESSION *sess)
+{
+	lockguard g(sslCtxMx);
+	if (sslSessions.size() >= SSL_SESSION_HOSTS_MAX && !sslSessions.count(key))
+	{
+		for (auto s : sslSessions.begin()->second)
+			SSL_SESSION_free(s);
+		sslSessions.erase(sslSessions.begin());
+	}
+	auto& q = sslSessions[key];
+	if (q.size() >= SSL_SESSIONS_PER_HOST)
+	{
+		SSL_SESSION_free(q.front());
+		q.pop_front();
+	}
+	q.push_back(sess);
+}
+
+//! Take a session for resumption, the caller owns the reference then
+static SSL_SESSION* TakeSslSession(cmstring& key)
+{
+	lockguard g(sslCtxMx);
+	auto it = sslSessions.find(key);
+	if (it == sslSessions.end())
+		return nullptr;
+	auto ret = it->second.back();
+	it->second.pop_back();
+	if (it->second.empty())
+		sslSessions.erase(it);
+	return ret;
+}
+
+static void FreeSslShared()
+{
+	lockguard g(sslCtxMx);
+	for (auto& x : sslSessions)
+		for (auto s : x.second)
+			SSL_SESSION_free(s);
+	sslSessions.clear();
+	if (sslCtx)
+		SSL_CTX_free(sslCtx), sslCtx = nullptr;
+}
+
+
+mstring GetTlsStats()
+{
+	uint64_t n = nSslHandshakes, nRes = nSslResumed, us = nSslHandshakeUs;
+	if (!n)
+		return "No TLS connections to remote hosts established yet.";
+	char buf[200];
+	snprintf(buf, sizeof(buf), "TLS connections to remote hosts: %lu handshakes, %lu resumed (%.0f%%), "
+			"%.1f ms average handshake time.", (unsigned long) n, (unsigned long) nRes,
+			nRes * 100.0 / n, us / 1000.0 / n);
+	return buf;
+}
+
 bool tcpconnect::SSLinit(mstring &sErr)
 {
 	SSL * ssl(nullptr);
@@ -329,19 +579,15 @@ bool tcpconnect::SSLinit(mstring &sErr)
 		return serr ? withSslHeadPfx(serr) : withLastSslError();
 				};
 
-	// cleaned up in the destructor on EOL
-	if(!m_ctx)
-	{
-		m_ctx = SSL_CTX_new(SSLv23_client_method());
-		if (!m_ctx) return withLastSslError();
-
-		SSL_CTX_load_verify_locations(m_ctx,
-				cfg::cafile.empty() ? nullptr : cfg::cafile.c_str(),
-			cfg::capath.empty() ? nullptr : cfg::capath.c_str());
-	}
+	auto ctx = GetSslCtx();
+	if (!ctx) return withLastSslError();
 
-	ssl = SSL_new(m_ctx);
-	if (!m_ctx) return withLastSslError();
+	// cleaned up in Disconnect
+	if (m_ssl)
+		SSL_free(m_ssl);
+	ssl = m_ssl = SSL_new(ctx);
+	if (!ssl) return withLastSslError();
+	SSL_set_app_data(ssl, this);
 
 	bool disableNameValidation = cfg::nsafriendly == 1;// || (bGuessedTls * cfg::nsafriendly == 2);
 	bool disableAllValidation = cfg::nsafriendly == 1; // || (bGuessedTls * (cfg::nsafriendly == 2 || cfg::nsafriendly == 3));
@@ -349,6 +595,14 @@ bool tcpconnect::SSLinit(mstring &sErr)
 	// for SNI
 	SSL_set_tlsext_host_name(ssl, m_sHostName.c_str());
 
+	auto sessKey = makeHostPortKey(m_sHostName, m_nPort);
+	auto sess = TakeSslSession(sessKey);
+	if (sess)
+	{
+		SSL_set_session(ssl, sess);
+		SSL_SESSION_free(sess);
+	}
+
 	if (!disableNameValidation)
 	{
 		auto param = SSL_get0_param(ssl);
@@ -359,6 +613,7 @@ bool tcpconnect::SSLinit(mstring &sErr)
 		SSL_set_verify(ssl, SSL_VERIFY_PEER, 0);
 	}
 
+	auto tStart = mirrorstats::Now();
 	// mark it connected and prepare for non-blocking mode
  	SSL_set_connect_state(ssl);
  	SSL_set_mode(ssl, SSL_MODE_AUTO_RETRY
@@ -409,6 +664,31 @@ bool tcpconnect::SSLinit(mstring &sErr)
 			return withLastSslError();
 
  	}
+	nSslHandshakes++;
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	m_bKtlsRecv = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+	if (cfg::kerneltls && !m_bKtlsRecv)
+	{
+		static std::atomic_bool reported(false);
+		if (!reported.exchange(true))
+		{
+			log::err("Kernel TLS receive offload not available (\"tls\" kernel module not loaded or "
+					"unsupported cipher), decrypting in user space");
+		}
+	}
+#endif
+	nSslHandshakeUs += chrono::duration_cast<chrono::microseconds>(mirrorstats::Now() - tStart).count();
+	if (SSL_session_reused(ssl))
+	{
+		nSslResumed++;
+		// TLS 1.3 tickets are single-use and replaced via OnNewSslSession, older sessions stay valid
+		if (SSL_version(ssl) < TLS1_3_VERSION)
+		{
+			auto cur = SSL_get1_session(ssl);
+			if (cur)
+				StoreSslSession(sessKey, cur);
+		}
+	}
  	if(m_bio) BIO_free_all(m_bio);
  	m_bio = BIO_new(BIO_f_ssl());
  	if(!m_bio) return withSslHeadPfx("IO initialization error");
@@ -439,6 +719,13 @@ bool tcpconnect::SSLinit(mstring &sErr)
 	return true;
 }
 
+#else
+
+mstring GetTlsStats()
+{
+	return "TLS support is not available.";
+}
+
 #endif
 
 bool tcpconnect::StartTunnel(const tHttpUrl& realTarget, mstring& sError,
@@ -35,9 +35,16 @@ public:
 	inline cmstring & GetHostname() { return m_sHostName; }
 	uint16_t GetPort() { return m_nPort; }
 	void Disconnect();
+	/**
+	 * Check whether an idle connection was closed by the remote side, without blocking.
+	 * TLS records which arrived meanwhile (like session tickets) are processed.
+	 */
+	bool IsIdleAlive();
 
 #ifdef HAVE_SSL
 	inline BIO* GetBIO() { return m_bio;};
+	//! True if the kernel decrypts the incoming data, the socket can be read directly then
+	inline bool HasKtlsRecv() { return m_bKtlsRecv; }
 #endif
 
 protected:
@@ -65,8 +72,8 @@ private:
 protected:
 #ifdef HAVE_SSL
 	BIO *m_bio = nullptr;
-	SSL_CTX * m_ctx = nullptr;
 	SSL * m_ssl = nullptr;
+	bool m_bKtlsRecv = false;
 	bool SSLinit(mstring &sErr);
 #endif
 
@@ -107,12 +114,21 @@ public:
 	virtual ~dl_con_factory() {};
 	void dump_status();
 	time_t BackgroundCleanup();
+	/**
+	 * Fill the idle pool with fresh connections to directly used backends of Remap- repositories,
+	 * see PrewarmConnections. Runs in background, does nothing if already running.
+	 */
+	void StartPrewarm() const;
 protected:
+	void Prewarm() const;
 	friend class tcpconnect;
 };
 
 extern dl_con_factory g_tcp_con_factory;
 
+//! Summary of TLS handshakes with remote servers, for the report page
+ACNG_API mstring GetTlsStats();
+
 /*
 // little tool for related classes, helps counting all object instances
 class instcount
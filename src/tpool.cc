@@ -2,80 +2,182 @@
 #include "meta.h"
 #include "lockable.h"
 
-
 #include <thread>
+#include <atomic>
+#include <algorithm>
 
 namespace acng {
 
-class tpoolImpl : public tpool, public base_with_condition
+/**
+ * Pool with one work queue per thread. New work is handed directly to an idle thread
+ * (waking only that one) or to a fresh thread. When all threads are busy, it is queued at one
+ * of them and taken by whichever thread gets ready first (own queue first, then stealing from
+ * the others).
+ */
+class tpoolImpl : public tpool, public base_with_mutex
 {
+	struct tWorker : public base_with_mutex
+	{
+		// guarded by the own mutex
+		std::deque<std::function<void()>> m_queued;
+		// guarded by the pool mutex
+		std::condition_variable m_wakeup;
+		std::function<void()> m_handoff;
+		unsigned m_slot = 0;
+	};
+
 	unsigned m_nMaxCount, m_nMaxSpare;
-	unsigned m_nCurActive = 0, m_nCurSpare = 0;
-	std::deque<std::function<void()>> m_freshWork;
-	bool m_shutdown = false;
 
-	// tpool interface
+	// all following members are guarded by the pool mutex, with the exception of m_slots contents (see above)
+
+	std::unique_ptr<tWorker[]> m_slots;
+	std::vector<unsigned> m_freeSlots;
+	// LIFO, the most recently active thread is the first candidate
+	std::vector<tWorker*> m_idle;
+	unsigned m_nCurThreads = 0, m_nRoundRobin = 0;
+	// modified with the pool lock held, also checked by working threads without it
+	std::atomic_bool m_shutdown = false;
+	std::condition_variable m_stopped;
+
+	// count of items sitting in m_queued of any worker, modified with the worker lock held
+	std::atomic<unsigned> m_nQueued = 0;
+	// one bit per worker with non-empty m_queued, modified with the worker lock held
+	std::unique_ptr<std::atomic<uint64_t>[]> m_queuedMask;
+	unsigned m_nMaskWords;
+
+	// update the bit of that worker, must be locked
+	void UpdateQueuedMask(tWorker& w)
+	{
+		auto bit = uint64_t(1) << (w.m_slot % 64);
+		if (w.m_queued.empty())
+			m_queuedMask[w.m_slot / 64] &= ~bit;
+		else
+			m_queuedMask[w.m_slot / 64] |= bit;
+	}
+
+	bool TakeFrom(tWorker& w, bool bOwn, std::function<void()>& job)
+	{
+		lockguard g(w);
+		if (w.m_queued.empty())
+			return false;
+		// own work in order, stolen work from the other end
+		if (bOwn)
+		{
+			job = std::move(w.m_queued.front());
+			w.m_queued.pop_front();
+		}
+		else
+		{
+			job = std::move(w.m_queued.back());
+			w.m_queued.pop_back();
+		}
+		m_nQueued--;
+		UpdateQueuedMask(w);
+		return true;
+	}
+
+	bool TakeQueued(tWorker& me, std::function<void()>& job)
+	{
+		auto ownBit = uint64_t(1) << (me.m_slot % 64);
+		if ((m_queuedMask[me.m_slot / 64] & ownBit) && TakeFrom(me, true, job))
+			return true;
+		// only visit the workers which have something
+		for (unsigned i = 0; i < m_nMaskWords; ++i)
+		{
+			for (uint64_t bits = m_queuedMask[i]; bits; bits &= bits - 1)
+			{
+				auto slot = i * 64 + __builtin_ctzll(bits);
+				if (TakeFrom(m_slots[slot], slot == me.m_slot, job))
+					return true;
+			}
+		}
+		return false;
+	}
+
 public:
 
-	void ThreadAction()
+	void ThreadAction(tWorker* me, std::function<void()> job)
 	{
-		lockuniq g(this);
+		lockuniq g;
+		g.assign(*this, false);
 
 		while (true)
 		{
-			if (m_shutdown)
+			// run and release the work item, not in critical section!
+			if (job)
 			{
-				m_nCurSpare--;
-				break;
+				job();
+				job = nullptr;
 			}
-			if (m_freshWork.empty())
-			{
-				wait(g);
+			if (m_nQueued && !m_shutdown && TakeQueued(*me, job))
 				continue;
-			}
-			auto c = move(m_freshWork.front());
-			m_freshWork.pop_front();
 
-			m_nCurSpare--;
-			m_nCurActive++;
-			g.unLock();
-			// run and release the work item, not in critical section!
-			c();
-			c = decltype (c)();
 			g.reLock();
-			m_nCurActive--;
-			if (m_nCurSpare >= m_nMaxSpare || m_shutdown)
+			if (m_shutdown)
+				break;
+			if (m_nQueued)
+			{
+				// another thread is just about to pick it up
+				g.unLock();
+				std::this_thread::yield();
+				continue;
+			}
+			if (m_idle.size() >= m_nMaxSpare)
 				break;
-			m_nCurSpare++;
+			m_idle.emplace_back(me);
+			me->m_wakeup.wait(g._guard, [&]() { return me->m_handoff || m_shutdown; });
+			if (!me->m_handoff)
+				break;
+			job.swap(me->m_handoff);
+			g.unLock();
 		}
-		notifyAll();
+		// still locked here
+		m_idle.erase(std::remove(m_idle.begin(), m_idle.end(), me), m_idle.end());
+		m_freeSlots.emplace_back(me->m_slot);
+		if (--m_nCurThreads == 0)
+			m_stopped.notify_all();
 	};
 
-
 	bool schedule(std::function<void ()> action) override
 	{
 		setLockGuard;
-		if (m_nCurActive + m_nCurActive >= m_nMaxCount)
-		{
+		if (m_shutdown)
 			return false;
+
+		if (!m_idle.empty())
+		{
+			auto w = m_idle.back();
+			m_idle.pop_back();
+			w->m_handoff = std::move(action);
+			w->m_wakeup.notify_one();
+			return true;
 		}
-		if (m_nCurSpare < m_freshWork.size() + 1)
+		if (m_nCurThreads < m_nMaxCount)
 		{
+			auto w = &m_slots[m_freeSlots.back()];
 			try
 			{
-				std::thread thr(&tpoolImpl::ThreadAction, this);
+				std::thread thr(&tpoolImpl::ThreadAction, this, w, std::move(action));
 				thr.detach();
 			}
 			catch (...)
 			{
 				return false;
 			}
-			m_nCurSpare++;
+			m_freeSlots.pop_back();
+			m_nCurThreads++;
+			return true;
 		}
+		// all busy, first come first served, but not unlimited
+		if (m_nQueued >= m_nMaxCount)
+			return false;
 		try
 		{
-			m_freshWork.emplace_back(std::move(action));
-			notifyAll();
+			auto& w = m_slots[m_nRoundRobin++ % m_nMaxCount];
+			lockguard g(w);
+			w.m_queued.emplace_back(std::move(action));
+			m_nQueued++;
+			UpdateQueuedMask(w);
 		}
 		catch (...)
 		{
@@ -88,13 +190,31 @@ public:
 	{
 		lockuniq g(this);
 		m_shutdown = true;
-		notifyAll();
-		while (m_nCurSpare + m_nCurActive)
-			wait(g);
+		for (auto w : m_idle)
+			w->m_wakeup.notify_one();
+		while (m_nCurThreads)
+			m_stopped.wait(g._guard);
+		// drop what was not started
+		for (unsigned i = 0; i < m_nMaxCount; ++i)
+			m_slots[i].m_queued.clear();
+		for (unsigned i = 0; i < m_nMaskWords; ++i)
+			m_queuedMask[i] = 0;
+		m_nQueued = 0;
 	}
 
-	tpoolImpl(unsigned maxCount, unsigned maxSpare) : m_nMaxCount(maxCount), m_nMaxSpare(maxSpare)
+	tpoolImpl(unsigned maxCount, unsigned maxSpare) :
+		m_nMaxCount(std::max(1u, maxCount)), m_nMaxSpare(maxSpare),
+		m_slots(new tWorker[m_nMaxCount]),
+		m_queuedMask(new std::atomic<uint64_t>[(m_nMaxCount + 63) / 64]),
+		m_nMaskWords((m_nMaxCount + 63) / 64)
 	{
+		for (unsigned i = 0; i < m_nMaskWords; ++i)
+			m_queuedMask[i] = 0;
+		for (unsigned i = 0; i < m_nMaxCount; ++i)
+		{
+			m_slots[i].m_slot = i;
+			m_freeSlots.emplace_back(m_nMaxCount - i - 1);
+		}
 	}
 };
 
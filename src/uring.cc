@@ -0,0 +1,262 @@
+#include "uring.h"
+#include "acfg.h"
+#include "debug.h"
+
+#include <errno.h>
+
+#ifdef HAVE_LINUX_IO_URING
+
+#include <atomic>
+#include <memory>
+
+#include <linux/io_uring.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define URING_ENTRIES 32
+// request tags, to find the results of a batch
+#define TAG_WRITE 1
+#define TAG_SYNC 2
+#define TAG_ALLOC 3
+
+using namespace std;
+
+namespace acng
+{
+namespace uring
+{
+
+// set when the kernel refused to create a ring or lacks the operations, no need to try
+// again in other threads
+static std::atomic_bool g_unusable(false);
+
+class tRing
+{
+	int m_fd = -1;
+	void *m_sqPtr = MAP_FAILED, *m_cqPtr = MAP_FAILED;
+	size_t m_sqLen = 0, m_cqLen = 0, m_sqesLen = 0;
+	io_uring_sqe *m_sqes = (io_uring_sqe*) MAP_FAILED;
+	unsigned *m_sqHead, *m_sqTail, *m_sqMask, *m_sqArray;
+	unsigned *m_cqHead, *m_cqTail;
+	unsigned m_cqMask = 0, m_cqesOff = 0;
+	unsigned m_nPrepared = 0, m_nInFlight = 0;
+
+public:
+	// a submission failed, the thread shall not use it again
+	bool m_bBroken = false;
+
+	template<typename T>
+	T* at(void *base, unsigned offset) { return (T*) ((char*) base + offset); }
+
+	int Init()
+	{
+		io_uring_params p {};
+		m_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+		if (m_fd < 0)
+			return -errno;
+		m_sqLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		m_cqLen = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+			m_sqLen = m_cqLen = max(m_sqLen, m_cqLen);
+		m_sqPtr = mmap(0, m_sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+		if (m_sqPtr == MAP_FAILED)
+			return -errno;
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+			m_cqPtr = m_sqPtr;
+		else
+		{
+			m_cqPtr = mmap(0, m_cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+			if (m_cqPtr == MAP_FAILED)
+				return -errno;
+		}
+		m_sqesLen = p.sq_entries * sizeof(io_uring_sqe);
+		m_sqes = (io_uring_sqe*) mmap(0, m_sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+		if (m_sqes == MAP_FAILED)
+			return -errno;
+		m_sqHead = at<unsigned>(m_sqPtr, p.sq_off.head);
+		m_sqTail = at<unsigned>(m_sqPtr, p.sq_off.tail);
+		m_sqMask = at<unsigned>(m_sqPtr, p.sq_off.ring_mask);
+		m_sqArray = at<unsigned>(m_sqPtr, p.sq_off.array);
+		m_cqHead = at<unsigned>(m_cqPtr, p.cq_off.head);
+		m_cqTail = at<unsigned>(m_cqPtr, p.cq_off.tail);
+		m_cqMask = *at<unsigned>(m_cqPtr, p.cq_off.ring_mask);
+		m_cqesOff = p.cq_off.cqes;
+		return 0;
+	}
+	~tRing()
+	{
+		if (m_sqes != MAP_FAILED)
+			munmap(m_sqes, m_sqesLen);
+		if (m_cqPtr != MAP_FAILED && m_cqPtr != m_sqPtr)
+			munmap(m_cqPtr, m_cqLen);
+		if (m_sqPtr != MAP_FAILED)
+			munmap(m_sqPtr, m_sqLen);
+		if (m_fd != -1)
+			close(m_fd);
+	}
+
+	//! Get a cleared submission entry, or nullptr if the ring is full
+	io_uring_sqe* Prep(uint8_t opcode, int fd, uint64_t tag)
+	{
+		auto tail = *m_sqTail + m_nPrepared;
+		if (tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= URING_ENTRIES
+				|| m_nInFlight + m_nPrepared >= URING_ENTRIES)
+		{
+			return nullptr;
+		}
+		auto idx = tail & *m_sqMask;
+		auto sqe = &m_sqes[idx];
+		*sqe = io_uring_sqe {};
+		sqe->opcode = opcode;
+		sqe->fd = fd;
+		sqe->user_data = tag;
+		m_sqArray[idx] = idx;
+		m_nPrepared++;
+		return sqe;
+	}
+
+	/**
+	 * Submit what was prepared and wait until all operations are completed.
+	 * @param onResult Called with tag and result of each completion
+	 * @return 0 or negative error code of the submission, the ring is not usable anymore then
+	 */
+	template<typename F>
+	int SubmitAndWait(F onResult)
+	{
+		__atomic_store_n(m_sqTail, *m_sqTail + m_nPrepared, __ATOMIC_RELEASE);
+		auto toSubmit = m_nPrepared;
+		m_nInFlight += m_nPrepared;
+		m_nPrepared = 0;
+		while (true)
+		{
+			auto head = *m_cqHead;
+			for (; head != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE); ++head)
+			{
+				auto &cqe = at<io_uring_cqe>(m_cqPtr, m_cqesOff)[head & m_cqMask];
+				onResult(cqe.user_data, cqe.res);
+				m_nInFlight--;
+			}
+			__atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+			if (!m_nInFlight)
+				return 0;
+			auto r = syscall(__NR_io_uring_enter, m_fd, toSubmit, m_nInFlight,
+					IORING_ENTER_GETEVENTS, nullptr, 0);
+			if (r >= 0)
+				toSubmit -= min(toSubmit, unsigned(r));
+			else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			{
+				m_bBroken = true;
+				return -errno;
+			}
+		}
+	}
+
+	//! Forget what was prepared
+	void Discard() { m_nPrepared = 0; }
+};
+
+static tRing* GetRing()
+{
+	thread_local std::unique_ptr<tRing> ring;
+	thread_local bool failed = false;
+
+	if (!cfg::useiouring || failed || g_unusable)
+		return nullptr;
+	if (ring && !ring->m_bBroken)
+		return ring.get();
+	if (ring)
+	{
+		// the operations of the failed submission were not started, or are done since
+		log::err("io_uring submission failed, using classic I/O");
+		ring.reset();
+		failed = true;
+		return nullptr;
+	}
+	ring.reset(new tRing);
+	auto err = ring->Init();
+	if (!err)
+		return ring.get();
+	ring.reset();
+	failed = true;
+	if (err == -ENOSYS || err == -EPERM)
+	{
+		g_unusable = true;
+		log::err("io_uring is not available, using classic I/O");
+	}
+	return nullptr;
+}
+
+ssize_t WriteSynced(int fd, const char *data, size_t len, off_t pos, off_t nAllocStart, off_t nAllocLen)
+{
+	auto ring = GetRing();
+	if (!ring)
+		return -ENOSYS;
+	auto wr = ring->Prep(IORING_OP_WRITE, fd, TAG_WRITE);
+	auto sync = ring->Prep(IORING_OP_FSYNC, fd, TAG_SYNC);
+	if (!wr || !sync)
+	{
+		ring->Discard();
+		return -ENOSYS;
+	}
+	wr->addr = (uintptr_t) data;
+	wr->len = len;
+	wr->off = pos;
+	// no sync after a failed or short write
+	wr->flags = IOSQE_IO_LINK;
+	sync->fsync_flags = IORING_FSYNC_DATASYNC;
+	sync->off = pos;
+	sync->len = len;
+	if (nAllocLen > 0)
+	{
+		if (auto alloc = ring->Prep(IORING_OP_FALLOCATE, fd, TAG_ALLOC))
+		{
+			alloc->off = nAllocStart;
+			alloc->addr = nAllocLen;
+			alloc->len = FALLOC_FL_KEEP_SIZE;
+		}
+	}
+	ssize_t nWritten = -ECANCELED, nSyncRes = -ECANCELED;
+	if (ring->SubmitAndWait([&](uint64_t tag, int res)
+	{
+		if (tag == TAG_WRITE)
+			nWritten = res;
+		else if (tag == TAG_SYNC)
+			nSyncRes = res;
+	}))
+	{
+		return -ENOSYS;
+	}
+	// operations are not supported by older kernels
+	if (nWritten == -EINVAL || nSyncRes == -EINVAL)
+	{
+		if (!g_unusable.exchange(true))
+			log::err("io_uring does not support file writes here, using classic I/O");
+		if (nWritten < 0)
+			return -ENOSYS;
+		if (size_t(nWritten) == len && nSyncRes == -EINVAL)
+			nSyncRes = fdatasync(fd) ? -errno : 0;
+	}
+	if (nWritten < 0)
+		return nWritten;
+	if (size_t(nWritten) < len)
+		return nWritten;
+	return nSyncRes < 0 ? nSyncRes : nWritten;
+}
+
+}
+}
+
+#else
+
+namespace acng
+{
+namespace uring
+{
+ssize_t WriteSynced(int, const char*, size_t, off_t, off_t, off_t) { return -ENOSYS; }
+}
+}
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef URING_H
+#define URING_H
+
+#include "config.h"
+
+#include <sys/types.h>
+
+namespace acng
+{
+
+/**
+ * Minimal io_uring access (without liburing), every thread gets its own ring on first use.
+ *
+ * Operations report -ENOSYS when io_uring is disabled or not usable in the running system, the
+ * caller is expected to use the classic system calls then.
+ */
+namespace uring
+{
+
+/**
+ * Write a buffer at the position and flush that range of the file to disk, optionally
+ * preallocating space behind it, all in one submission. Returns when all operations are
+ * completed, i.e. the buffer is no longer used and nothing is left running on the file.
+ * @param nAllocLen Length of the range at nAllocStart to preallocate, zero for none; failure
+ * there is not reported
+ * @return Number of bytes written, less than len if the write was short (the range was not
+ * synced then), or negative error code of the write or the sync
+ */
+ssize_t WriteSynced(int fd, const char *data, size_t len, off_t pos, off_t nAllocStart, off_t nAllocLen);
+
+}
+}
+
+#endif // URING_H
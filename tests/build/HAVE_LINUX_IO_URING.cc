@@ -0,0 +1,11 @@
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+int main()
+{
+   io_uring_params p {};
+   io_uring_sqe sqe {};
+   sqe.opcode = IORING_OP_SEND;
+   sqe.opcode = IORING_OP_FALLOCATE;
+   return syscall(__NR_io_uring_setup, 4, &p) + syscall(__NR_io_uring_enter, 0, 0, 0, 0, 0, 0) + sqe.opcode;
+}
@@ -5,10 +5,14 @@
 
 #include "ahttpurl.h"
 #include "astrop.h"
+#include "tpool.h"
+#include "bwsched.h"
 
 #include "gmock/gmock.h"
 
 #include <unordered_map>
+#include <atomic>
+#include <future>
 
 namespace acng
 {
@@ -262,3 +266,70 @@ http://ftp.ch.debian.org/debian/dists/unstable/contrib/Contents-all.xz
 		EXPECT_EQ(type, FILE_VOLATILE);
 	}
 }
+
+TEST(algorithms, tpool_limits)
+{
+	using namespace acng;
+	auto pool = tpool::Create(4, 2);
+	std::promise<void> go;
+	std::shared_future<void> gate(go.get_future());
+	std::atomic<unsigned> done(0);
+	auto act = [&]() { gate.wait(); done++; };
+	// all threads blocked, then the same amount as backlog
+	for(int i = 0; i < 8; ++i)
+		ASSERT_TRUE(pool->schedule(act));
+	ASSERT_FALSE(pool->schedule(act));
+	go.set_value();
+	for(int i = 0; i < 500 && done < 8; ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	ASSERT_EQ(done, 8u);
+	ASSERT_TRUE(pool->schedule(act));
+	pool->stop();
+	ASSERT_EQ(done, 9u);
+}
+
+TEST(algorithms, bwsched_fairness)
+{
+	using namespace acng;
+	using namespace std::chrono;
+	// 2 MB/s, shared by a flow of weight 3 and one of weight 1; both keep asking, so the
+	// grants are shared by their order in the queue and not by how fast the threads run
+	auto bucket = bwsched::MakeBucket(2000000);
+	bwsched::tFlow heavy({bucket}, 3), light({bucket}, 1);
+	const unsigned nGrants = 240;
+	std::mutex mx;
+	std::vector<char> grants;
+	auto pump = [&](bwsched::tFlow& f, char id)
+	{
+		while (true)
+		{
+			auto n = f.Acquire(16384);
+			ASSERT_EQ(n, 16384u);
+			// pretend only half was used
+			f.Refund(n / 2);
+			std::lock_guard<std::mutex> g(mx);
+			if (grants.size() >= nGrants)
+				return;
+			grants.push_back(id);
+		}
+	};
+	auto start = steady_clock::now();
+	std::thread t1(pump, std::ref(heavy), 'h'), t2(pump, std::ref(light), 'l');
+	t1.join();
+	t2.join();
+	auto secs = duration<double>(steady_clock::now() - start).count();
+	ASSERT_EQ(grants.size(), nGrants);
+	// not faster than the rate permits after the initial burst (250000 bytes); only a
+	// lower bound, a busy machine may take longer
+	EXPECT_GE(secs, (nGrants * 8192.0 - 250000 - 16384) / 2000000);
+	// counted from the point where both are competing
+	auto both = std::max(std::find(grants.begin(), grants.end(), 'h'),
+			std::find(grants.begin(), grants.end(), 'l'));
+	ASSERT_NE(both, grants.end());
+	auto nLight = std::count(both, grants.end(), 'l');
+	auto nHeavy = std::count(both, grants.end(), 'h');
+	ASSERT_GT(nLight, 20);
+	auto ratio = double(nHeavy) / nLight;
+	EXPECT_GT(ratio, 2.5);
+	EXPECT_LT(ratio, 3.5);
+}
@@ -0,0 +1,185 @@
+#include "gtest/gtest.h"
+
+#include "blobstore.h"
+#include "fileitem.h"
+#include "acfg.h"
+#include "fileio.h"
+#include "meta.h"
+
+#include <fstream>
+#include <sstream>
+
+using namespace acng;
+
+namespace
+{
+
+// temporary cache directory with hard link deduplication
+struct tBlobEnv
+{
+	mstring sSavedCacheDirSlash = cfg::cacheDirSlash;
+	int nSavedDedup = cfg::dedup, nSavedAllocSpace = cfg::allocspace, nSavedWbSize = cfg::wbbufsize;
+	mstring sDir;
+
+	tBlobEnv()
+	{
+		char tmpl[] = "/tmp/ut_blobstore.XXXXXX";
+		sDir = mkdtemp(tmpl);
+		cfg::cacheDirSlash = sDir + "/";
+		cfg::dedup = 1;
+		cfg::allocspace = 0;
+		cfg::wbbufsize = 0;
+	}
+	~tBlobEnv()
+	{
+		cfg::cacheDirSlash = sSavedCacheDirSlash;
+		cfg::dedup = nSavedDedup;
+		cfg::allocspace = nSavedAllocSpace;
+		cfg::wbbufsize = nSavedWbSize;
+		ignore_value(system(("rm -rf " + sDir).c_str()));
+	}
+	static mstring BlobPath(cmstring& sSha256)
+	{
+		return CACHE_BASE + cfg::privStoreRelBlobs + "/" + sSha256.substr(0, 2) + "/" + sSha256;
+	}
+};
+
+void WriteFile(cmstring& sPath, const mstring& s)
+{
+	mkbasedir(sPath);
+	std::ofstream out(sPath, std::ios::binary | std::ios::trunc);
+	out << s;
+}
+
+mstring ReadFile(cmstring& sPath)
+{
+	std::ifstream in(sPath, std::ios::binary);
+	std::stringstream ss;
+	ss << in.rdbuf();
+	return ss.str();
+}
+
+bool SameInode(cmstring& a, cmstring& b)
+{
+	Cstat sa(a), sb(b);
+	return sa && sb && sa.st_ino == sb.st_ino && sa.st_dev == sb.st_dev;
+}
+
+const mstring sumA(64, 'a'), sumB(64, 'b');
+
+}
+
+TEST(blobstore, adopt)
+{
+	tBlobEnv env;
+	auto sFirst(SABSPATH("debian/pool/x_1_all.deb")), sSecond(SABSPATH("mirror/pool/x_1_all.deb"));
+	WriteFile(sFirst, "same contents");
+	WriteFile(sSecond, "same contents");
+
+	// first one is registered, stays as it is
+	ASSERT_FALSE(blobstore::Adopt(sFirst, sumA, 13));
+	ASSERT_TRUE(SameInode(sFirst, tBlobEnv::BlobPath(sumA)));
+	// the second becomes another link to it
+	ASSERT_FALSE(SameInode(sFirst, sSecond));
+	ASSERT_TRUE(blobstore::Adopt(sSecond, sumA, 13));
+	ASSERT_TRUE(SameInode(sFirst, sSecond));
+	ASSERT_EQ(Cstat(sFirst).st_nlink, 3u);
+	ASSERT_EQ(ReadFile(sSecond), "same contents");
+	// nothing to do the next time
+	ASSERT_FALSE(blobstore::Adopt(sSecond, sumA, 13));
+
+	// size mismatch, not the same contents, replaces the registered ones
+	auto sOther(SABSPATH("debian/pool/y_1_all.deb"));
+	WriteFile(sOther, "other");
+	ASSERT_FALSE(blobstore::Adopt(sOther, sumA, 5));
+	ASSERT_TRUE(SameInode(sOther, tBlobEnv::BlobPath(sumA)));
+	ASSERT_EQ(Cstat(sFirst).st_nlink, 2u);
+
+	// not a digest, or disabled
+	ASSERT_FALSE(blobstore::Adopt(sFirst, "abc", 13));
+	cfg::dedup = 0;
+	ASSERT_FALSE(blobstore::Adopt(sSecond, sumB, 13));
+	ASSERT_FALSE(Cstat(tBlobEnv::BlobPath(sumB)));
+}
+
+TEST(blobstore, provide)
+{
+	tBlobEnv env;
+	auto sFirst(SABSPATH("debian/pool/x_1_all.deb")), sNew(SABSPATH("mirror/pool/sub/x_1_all.deb"));
+	WriteFile(sFirst, "some contents");
+	ASSERT_FALSE(blobstore::Adopt(sFirst, sumA, 13));
+
+	time_t mtime = 0;
+	ASSERT_EQ(blobstore::Provide(sumA, sNew, &mtime), 13);
+	ASSERT_EQ(mtime, Cstat(sFirst).st_mtime);
+	ASSERT_TRUE(SameInode(sFirst, sNew));
+	ASSERT_EQ(ReadFile(sNew), "some contents");
+
+	// unknown contents, or the target exists already
+	ASSERT_EQ(blobstore::Provide(sumB, SABSPATH("debian/pool/z_1_all.deb")), -1);
+	ASSERT_FALSE(Cstat(SABSPATH("debian/pool/z_1_all.deb")));
+	ASSERT_EQ(blobstore::Provide(sumA, sNew), -1);
+}
+
+TEST(blobstore, sweep)
+{
+	tBlobEnv env;
+	auto sFirst(SABSPATH("debian/pool/x_1_all.deb")), sSecond(SABSPATH("debian/pool/y_1_all.deb"));
+	WriteFile(sFirst, "first");
+	WriteFile(sSecond, "second");
+	ASSERT_FALSE(blobstore::Adopt(sFirst, sumA, 5));
+	ASSERT_FALSE(blobstore::Adopt(sSecond, sumB, 6));
+	ASSERT_EQ(blobstore::Sweep(), 0u);
+
+	// only the one without users is removed
+	unlink(sFirst.c_str());
+	ASSERT_EQ(blobstore::Sweep(), 1u);
+	ASSERT_FALSE(Cstat(tBlobEnv::BlobPath(sumA)));
+	ASSERT_TRUE(Cstat(tBlobEnv::BlobPath(sumB)));
+	ASSERT_EQ(Cstat(sSecond).st_nlink, 2u);
+	ASSERT_EQ(blobstore::Sweep(), 0u);
+}
+
+TEST(blobstore, resume_shared)
+{
+	tBlobEnv env;
+	mstring sPathRel("debian/pool/x_1_all.deb");
+	auto sPathAbs(SABSPATH(sPathRel)), sOther(SABSPATH("mirror/pool/x_1_all.deb"));
+	WriteFile(sPathAbs, "0123456789");
+	ASSERT_FALSE(blobstore::Adopt(sPathAbs, sumA, 10));
+	mkbasedir(sOther);
+	ASSERT_EQ(0, link(sPathAbs.c_str(), sOther.c_str()));
+	ASSERT_TRUE(SameInode(sPathAbs, sOther));
+
+	{
+		// continuing a download of the partially stored file
+		fileitem_with_storage fi(sPathRel);
+		lockuniq g(fi);
+		fi.m_status = fileitem::FIST_DLGOTHEAD;
+		fi.m_nContentLength = 20;
+		fi.m_nSizeChecked = 10;
+		ASSERT_TRUE(fi.DlAddData("abcdefghij", g));
+		ASSERT_TRUE(fi.DlFlush(g));
+		ASSERT_EQ(fi.m_nSizeChecked, 20);
+	}
+	// the data is kept, but the other names still have the old contents
+	ASSERT_FALSE(SameInode(sPathAbs, sOther));
+	ASSERT_EQ(ReadFile(sPathAbs), "0123456789abcdefghij");
+	ASSERT_EQ(ReadFile(sOther), "0123456789");
+	ASSERT_EQ(ReadFile(tBlobEnv::BlobPath(sumA)), "0123456789");
+	ASSERT_EQ(Cstat(sPathAbs).st_nlink, 1u);
+
+	// but starting from scratch replaces the file without copying
+	ASSERT_EQ(0, link(sOther.c_str(), (sPathAbs + ".new").c_str()));
+	ASSERT_EQ(0, rename((sPathAbs + ".new").c_str(), sPathAbs.c_str()));
+	{
+		fileitem_with_storage fi(sPathRel);
+		lockuniq g(fi);
+		fi.m_status = fileitem::FIST_DLGOTHEAD;
+		fi.m_nContentLength = 10;
+		fi.m_nSizeChecked = 0;
+		ASSERT_TRUE(fi.DlAddData("fresh", g));
+	}
+	ASSERT_EQ(ReadFile(sPathAbs), "fresh");
+	ASSERT_EQ(ReadFile(sOther), "0123456789");
+}
@@ -0,0 +1,135 @@
+#include "gtest/gtest.h"
+
+#include "fasttier.h"
+#include "acfg.h"
+#include "fileio.h"
+#include "meta.h"
+
+#include <fstream>
+#include <thread>
+
+#include <fcntl.h>
+
+using namespace acng;
+
+#define MIB (1 << 20)
+
+namespace
+{
+
+// temporary cache directory and fast storage of the specified size (MiB)
+struct tFastTierEnv
+{
+	mstring sSavedCacheDirSlash = cfg::cacheDirSlash, sSavedFastDir = cfg::fastcachedir;
+	int nSavedSize = cfg::fastcachesize, nSavedHits = cfg::fastcachehits;
+	mstring sDir;
+
+	tFastTierEnv(int nSize, int nHits)
+	{
+		char tmpl[] = "/tmp/ut_fasttier.XXXXXX";
+		sDir = mkdtemp(tmpl);
+		cfg::cacheDirSlash = sDir + "/cache/";
+		cfg::fastcachedir = sDir + "/fast";
+		cfg::fastcachesize = nSize;
+		cfg::fastcachehits = nHits;
+	}
+	~tFastTierEnv()
+	{
+		cfg::cacheDirSlash = sSavedCacheDirSlash;
+		cfg::fastcachedir = sSavedFastDir;
+		cfg::fastcachesize = nSavedSize;
+		cfg::fastcachehits = nSavedHits;
+		ignore_value(system(("rm -rf " + sDir).c_str()));
+	}
+};
+
+void MakeCacheFile(cmstring& sPathRel, char c)
+{
+	auto sPathAbs(SABSPATH(sPathRel));
+	mkbasedir(sPathAbs);
+	std::ofstream(sPathAbs, std::ios::binary | std::ios::trunc) << mstring(MIB, c);
+}
+
+unique_fd OpenOrig(cmstring& sPathRel)
+{
+	return unique_fd(open(SZABSPATH(sPathRel), O_RDONLY));
+}
+
+// the copy is made in background, wait for it
+unique_fd AwaitCopy(cmstring& sPathRel)
+{
+	for (int i = 0; i < 500; ++i)
+	{
+		unique_fd fd(fasttier::Open(sPathRel, MIB));
+		if (fd.valid())
+			return fd;
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	return unique_fd();
+}
+
+}
+
+TEST(fasttier, promote)
+{
+	tFastTierEnv env(4, 2);
+	mstring sPathRel("debian/pool/a.deb");
+	MakeCacheFile(sPathRel, 'a');
+
+	// twice the size needs to be sent, partial downloads count partially
+	ASSERT_EQ(fasttier::Open(sPathRel, MIB), -1);
+	auto orig = OpenOrig(sPathRel);
+	fasttier::CountSent(sPathRel, orig.get(), MIB / 2);
+	ASSERT_EQ(fasttier::Open(sPathRel, MIB), -1);
+	fasttier::CountSent(sPathRel, orig.get(), MIB);
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	ASSERT_EQ(fasttier::Open(sPathRel, MIB), -1);
+	fasttier::CountSent(sPathRel, orig.get(), MIB / 2);
+
+	auto copy = AwaitCopy(sPathRel);
+	ASSERT_TRUE(copy.valid());
+	struct stat stCopy, stOrig;
+	ASSERT_EQ(0, fstat(copy.get(), &stCopy));
+	ASSERT_EQ(0, fstat(orig.get(), &stOrig));
+	ASSERT_NE(stCopy.st_ino, stOrig.st_ino);
+	ASSERT_EQ(stCopy.st_size, MIB);
+	char c = 0;
+	ASSERT_EQ(1, pread(copy.get(), &c, 1, MIB - 1));
+	ASSERT_EQ(c, 'a');
+
+	// outdated when the original changes
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	MakeCacheFile(sPathRel, 'b');
+	ASSERT_EQ(fasttier::Open(sPathRel, MIB), -1);
+	ASSERT_FALSE(Cstat(cfg::fastcachedir + "/" + sPathRel));
+}
+
+TEST(fasttier, evict)
+{
+	tFastTierEnv env(2, 1);
+	mstring sBusy("debian/pool/busy.deb"), sIdle("debian/pool/idle.deb"), sNew("debian/pool/new.deb");
+	for (auto p : { &sBusy, &sIdle, &sNew })
+		MakeCacheFile(*p, 'x');
+
+	// the busy one is used a lot from its copy, but less recently than the other one
+	ASSERT_EQ(fasttier::Open(sBusy, MIB), -1);
+	fasttier::CountSent(sBusy, OpenOrig(sBusy).get(), MIB);
+	auto busy = AwaitCopy(sBusy);
+	ASSERT_TRUE(busy.valid());
+	fasttier::CountSent(sBusy, busy.get(), 5 * MIB);
+
+	ASSERT_EQ(fasttier::Open(sIdle, MIB), -1);
+	fasttier::CountSent(sIdle, OpenOrig(sIdle).get(), MIB);
+	ASSERT_TRUE(AwaitCopy(sIdle).valid());
+
+	// no space for the third one, the copy which served less data per size goes away
+	ASSERT_EQ(fasttier::Open(sNew, MIB), -1);
+	fasttier::CountSent(sNew, OpenOrig(sNew).get(), MIB);
+	ASSERT_TRUE(AwaitCopy(sNew).valid());
+	ASSERT_FALSE(Cstat(cfg::fastcachedir + "/" + sIdle));
+	unique_fd fd(fasttier::Open(sBusy, MIB));
+	ASSERT_TRUE(fd.valid());
+
+	for (auto p : { &sBusy, &sIdle, &sNew })
+		fasttier::Drop(*p);
+}
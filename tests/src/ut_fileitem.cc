@@ -0,0 +1,270 @@
+#include "gtest/gtest.h"
+
+#include "fileitem.h"
+#include "acfg.h"
+#include "meta.h"
+
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+using namespace acng;
+
+#define SEG 1000
+
+namespace
+{
+
+// an item which got the response header announcing ten and a half segments
+template<typename TBase>
+struct tSegItem : public TBase
+{
+	tSegItem() : TBase("debian/pool/main/b/big.deb")
+	{
+		this->m_status = fileitem::FIST_DLRECEIVING;
+		this->m_nContentLength = 10 * SEG + SEG / 2;
+		this->m_nSizeChecked = 0;
+	}
+	std::vector<int> ClaimAll()
+	{
+		std::vector<int> ret;
+		off_t nStart, nEnd;
+		for (int idx; (idx = this->DlSegmentClaim(nStart, nEnd)) >= 0;)
+			ret.push_back(idx);
+		return ret;
+	}
+};
+
+// temporary cache directory, with write-behind buffer and preallocation as requested
+struct tTempCache
+{
+	mstring sSavedCacheDirSlash = cfg::cacheDirSlash;
+	int nSavedAllocSpace = cfg::allocspace, nSavedWbSize = cfg::wbbufsize;
+	bool bSavedUring = cfg::useiouring;
+	mstring sDir;
+
+	tTempCache(int nWbSize, int nAllocSpace, bool bUring = false)
+	{
+		char tmpl[] = "/tmp/ut_fileitem.XXXXXX";
+		sDir = mkdtemp(tmpl);
+		cfg::cacheDirSlash = sDir + "/";
+		cfg::wbbufsize = nWbSize;
+		cfg::allocspace = nAllocSpace;
+		cfg::useiouring = bUring;
+	}
+	~tTempCache()
+	{
+		cfg::cacheDirSlash = sSavedCacheDirSlash;
+		cfg::allocspace = nSavedAllocSpace;
+		cfg::wbbufsize = nSavedWbSize;
+		cfg::useiouring = bSavedUring;
+		ignore_value(system(("rm -rf " + sDir).c_str()));
+	}
+};
+
+// an item which got the response header and is about to store the body
+struct tDlItem : public fileitem_with_storage
+{
+	tDlItem(off_t nContLen) : fileitem_with_storage("debian/pool/main/b/big.deb")
+	{
+		m_status = FIST_DLGOTHEAD;
+		m_nContentLength = nContLen;
+		m_nSizeChecked = 0;
+	}
+	Cstat Stat() { return Cstat(SABSPATH(GetPathRel())); }
+	mstring Read()
+	{
+		std::ifstream in(SABSPATH(GetPathRel()), std::ios::binary);
+		std::stringstream ss;
+		ss << in.rdbuf();
+		return ss.str();
+	}
+};
+
+mstring MakeData(size_t len)
+{
+	mstring ret(len, 0);
+	for (size_t i = 0; i < len; ++i)
+		ret[i] = char('a' + (i * 7 + i / 13) % 26);
+	return ret;
+}
+
+}
+
+TEST(segments, outoforder)
+{
+	tSegItem<fileitem> fi;
+	lockguard g(fi);
+	ASSERT_TRUE(fi.DlSegmentsSetup(SEG));
+	ASSERT_FALSE(fi.DlSegmentsSetup(SEG));
+	ASSERT_EQ(fi.m_pSegments->state.size(), 11u);
+
+	// from the end, the last one is short; the first two are left to the main download
+	off_t nStart, nEnd;
+	ASSERT_EQ(fi.DlSegmentClaim(nStart, nEnd), 10);
+	ASSERT_EQ(nStart, 10 * SEG);
+	ASSERT_EQ(nEnd, 10 * SEG + SEG / 2);
+	ASSERT_EQ(fi.ClaimAll(), std::vector<int>({9, 8, 7, 6, 5, 4, 3, 2}));
+
+	// helpers finish in random order, one fails and its segment is handed out again
+	fi.DlSegmentRelease(5, true);
+	fi.DlSegmentRelease(9, false);
+	fi.DlSegmentRelease(3, true);
+	fi.DlSegmentRelease(10, true);
+	fi.DlSegmentRelease(2, true);
+	fi.DlSegmentRelease(42, true);
+	ASSERT_EQ(fi.ClaimAll(), std::vector<int>({9}));
+
+	// the main download writes up to the segment boundaries
+	ASSERT_EQ(fi.DlSegmentRoom(SEG / 2), SEG / 2);
+	ASSERT_EQ(fi.DlSegmentRoom(10 * SEG), SEG / 2);
+	fi.m_nSizeChecked = SEG;
+	ASSERT_FALSE(fi.DlSegmentsSkip());
+	ASSERT_EQ(fi.m_nSizeChecked, SEG);
+
+	// skips the stored ones, stops at the gap of the one still in progress
+	fi.m_nSizeChecked = 2 * SEG;
+	ASSERT_TRUE(fi.DlSegmentsSkip());
+	ASSERT_EQ(fi.m_nSizeChecked, 4 * SEG);
+	ASSERT_FALSE(fi.DlSegmentsSkip());
+	fi.DlSegmentRelease(4, true);
+	ASSERT_TRUE(fi.DlSegmentsSkip());
+	ASSERT_EQ(fi.m_nSizeChecked, 6 * SEG);
+
+	// not at a boundary, nothing to skip
+	fi.m_nSizeChecked = 6 * SEG + 1;
+	fi.DlSegmentRelease(6, true);
+	ASSERT_FALSE(fi.DlSegmentsSkip());
+
+	fi.m_nSizeChecked = 6 * SEG;
+	for (auto idx : {8, 7, 9})
+		fi.DlSegmentRelease(idx, true);
+	ASSERT_TRUE(fi.DlSegmentsSkip());
+	ASSERT_EQ(fi.m_nSizeChecked, fi.m_nContentLength);
+	ASSERT_FALSE(fi.DlSegmentsSkip());
+}
+
+TEST(segments, resume)
+{
+	tSegItem<fileitem> fi;
+	lockguard g(fi);
+	// continuing a partial download, the data before the current segment is there
+	fi.m_nSizeChecked = 3 * SEG + 5;
+	ASSERT_TRUE(fi.DlSegmentsSetup(SEG));
+	for (int i = 0; i < 3; ++i)
+		ASSERT_EQ(fi.m_pSegments->state[i], fileitem::tSegments::STORED);
+	ASSERT_EQ(fi.ClaimAll(), std::vector<int>({10, 9, 8, 7, 6, 5}));
+	fi.DlSegmentRelease(7, false);
+
+	// the main download moves on, the segment right after it is not handed out
+	fi.m_nSizeChecked = 6 * SEG;
+	ASSERT_EQ(fi.ClaimAll(), std::vector<int>());
+	fi.m_nSizeChecked = 5 * SEG;
+	ASSERT_EQ(fi.ClaimAll(), std::vector<int>({7}));
+
+	fi.DlSegmentRelease(7, false);
+	fi.DlSegmentsAbandon();
+	ASSERT_EQ(fi.ClaimAll(), std::vector<int>());
+
+	// not worth it with less than two segments after the current one
+	tSegItem<fileitem> late;
+	lockguard g2(late);
+	late.m_nSizeChecked = 10 * SEG;
+	ASSERT_FALSE(late.DlSegmentsSetup(SEG));
+	late.m_nSizeChecked = 9 * SEG;
+	ASSERT_TRUE(late.DlSegmentsSetup(SEG));
+	late.m_status = fileitem::FIST_COMPLETE;
+	ASSERT_EQ(late.ClaimAll(), std::vector<int>());
+}
+
+TEST(segments, abandoned)
+{
+	auto sSavedCacheDirSlash = cfg::cacheDirSlash;
+	auto nSavedAllocSpace = cfg::allocspace;
+	char tmpl[] = "/tmp/ut_segments.XXXXXX";
+	mstring sDir(mkdtemp(tmpl));
+	cfg::cacheDirSlash = sDir + "/";
+	cfg::allocspace = 0;
+	{
+		tSegItem<fileitem_with_storage> fi;
+		lockguard g(fi);
+		ASSERT_TRUE(fi.DlSegmentsSetup(SEG));
+		off_t nStart, nEnd;
+		ASSERT_EQ(fi.DlSegmentClaim(nStart, nEnd), 10);
+		ASSERT_EQ(fi.DlSegmentClaim(nStart, nEnd), 9);
+		// stored beyond the data of the main download, leaving a gap
+		ASSERT_TRUE(fi.DlSegmentWrite(9 * SEG + 10, "tail"));
+		fi.m_nSizeChecked = 2 * SEG;
+		Cstat st(SABSPATH(fi.GetPathRel()));
+		ASSERT_TRUE(st);
+		ASSERT_EQ(st.st_size, 9 * SEG + 14);
+
+		// that data would be taken as valid when resuming later
+		fi.DlSegmentsAbandon();
+		ASSERT_FALSE(fi.DlSegmentWrite(10 * SEG, "more"));
+		ASSERT_EQ(Cstat(SABSPATH(fi.GetPathRel())).st_size, 2 * SEG);
+	}
+	cfg::cacheDirSlash = sSavedCacheDirSlash;
+	cfg::allocspace = nSavedAllocSpace;
+	ignore_value(system(("rm -rf " + sDir).c_str()));
+}
+
+TEST(writebehind, buffered)
+{
+	// the same with flushing through io_uring, if the kernel has it
+	for (bool bUring : { false, true })
+	{
+		tTempCache env(64, 0, bUring);
+		auto data = MakeData(200000);
+		tDlItem fi(data.size());
+		lockuniq g(fi);
+
+		// small pieces are kept back until flushed
+		ASSERT_TRUE(fi.DlAddData(string_view(data).substr(0, 1000), g));
+		ASSERT_TRUE(fi.DlHasBuffered());
+		ASSERT_EQ(fi.m_nSizeChecked, 0);
+		ASSERT_EQ(fi.Stat().st_size, 0);
+		ASSERT_TRUE(fi.DlFlush(g));
+		ASSERT_FALSE(fi.DlHasBuffered());
+		ASSERT_EQ(fi.m_nSizeChecked, 1000);
+		ASSERT_EQ(fi.Read(), data.substr(0, 1000));
+
+		// a full buffer is written on its own, up to an aligned position
+		for (off_t pos = 1000; pos < 100000; pos += 9000)
+			ASSERT_TRUE(fi.DlAddData(string_view(data).substr(pos, 9000), g));
+		ASSERT_GT(fi.m_nSizeChecked, 1000);
+		ASSERT_EQ(fi.m_nSizeChecked % 4096, 0);
+		ASSERT_EQ(fi.Stat().st_size, fi.m_nSizeChecked);
+
+		ASSERT_TRUE(fi.DlAddData(string_view(data).substr(100000), g));
+		ASSERT_TRUE(fi.DlFlush(g));
+		ASSERT_EQ(fi.m_nSizeChecked, off_t(data.size()));
+		ASSERT_EQ(fi.Read(), data);
+	}
+}
+
+TEST(writebehind, prealloc)
+{
+	tTempCache env(0, 65536);
+	auto data = MakeData(1000);
+	{
+		tDlItem fi(1 << 20);
+		lockuniq g(fi);
+		ASSERT_TRUE(fi.DlAddData(data, g));
+		ASSERT_EQ(fi.m_nSizeChecked, 1000);
+		// reserved ahead, beyond the end of file
+		auto st = fi.Stat();
+		ASSERT_EQ(st.st_size, 1000);
+		ASSERT_GE(st.st_blocks * 512, 65536);
+
+		// moving on reserves more before the data reaches the end of that range
+		auto more = MakeData(60000);
+		ASSERT_TRUE(fi.DlAddData(more, g));
+		ASSERT_GE(fi.Stat().st_blocks * 512, 61000 + 65536);
+	}
+	// the unused reservation is released when the item is gone
+	tDlItem fi(0);
+	auto st = fi.Stat();
+	ASSERT_EQ(st.st_size, 61000);
+	ASSERT_LT(st.st_blocks * 512, 61000 + 65536);
+}
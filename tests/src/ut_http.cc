@@ -139,6 +139,12 @@ TEST(http, cachehead)
 		ASSERT_EQ(nix, testDate);
 		ASSERT_EQ(orig, testOrig);
 	}
+	mstring testSum(64, 'a'), sum;
+	ASSERT_TRUE(StoreHeadToStorage(testHead, testSize, &testDate, &testOrig, &testSum));
+	ASSERT_TRUE(h.LoadFromFile(testHead));
+	ASSERT_EQ(testOrig, h.h[header::XORIG]);
+	ASSERT_TRUE(ParseHeadFromStorage(testHead, nullptr, nullptr, nullptr, &sum));
+	ASSERT_EQ(sum, testSum);
 }
 
 TEST(http, header)
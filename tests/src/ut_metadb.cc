@@ -0,0 +1,228 @@
+#include "gtest/gtest.h"
+
+#include "metadb.h"
+#include "acfg.h"
+#include "fileio.h"
+#include "meta.h"
+
+#include <fstream>
+#include <sstream>
+
+#include <zlib.h>
+
+using namespace acng;
+
+namespace
+{
+
+// temporary cache directory with MetaDb enabled, the store is closed when leaving
+struct tMetaDbEnv
+{
+	mstring sSavedCacheDirSlash = cfg::cacheDirSlash;
+	int nSavedMetaDb = cfg::metadb;
+	mstring sDir, sPath;
+
+	tMetaDbEnv()
+	{
+		char tmpl[] = "/tmp/ut_metadb.XXXXXX";
+		sDir = mkdtemp(tmpl);
+		cfg::cacheDirSlash = sDir + "/";
+		cfg::metadb = 1;
+		sPath = CACHE_BASE + cfg::privStoreRelMetaDb;
+		metadb::Close();
+	}
+	~tMetaDbEnv()
+	{
+		metadb::Close();
+		cfg::cacheDirSlash = sSavedCacheDirSlash;
+		cfg::metadb = nSavedMetaDb;
+		ignore_value(system(("rm -rf " + sDir).c_str()));
+	}
+	mstring ReadLog()
+	{
+		std::ifstream in(sPath, std::ios::binary);
+		std::stringstream ss;
+		ss << in.rdbuf();
+		return ss.str();
+	}
+	void WriteLog(const mstring& s)
+	{
+		std::ofstream out(sPath, std::ios::binary | std::ios::trunc);
+		out << s;
+	}
+};
+
+metadb::tRecord MakeRec(off_t len, cmstring& origin)
+{
+	metadb::tRecord rec;
+	rec.contLen = len;
+	rec.lastModified = tHttpDate(1000000);
+	rec.origin = origin;
+	rec.sha256 = mstring(64, 'c');
+	return rec;
+}
+
+}
+
+TEST(metadb, format)
+{
+	tMetaDbEnv env;
+	ASSERT_TRUE(metadb::Open());
+	mstring key("debian/pool/a.deb");
+	ASSERT_TRUE(metadb::Put(key, MakeRec(42, "http://x/a.deb")));
+	metadb::Close();
+
+	auto log = env.ReadLog();
+	ASSERT_GT(log.size(), 16u);
+	ASSERT_EQ(log.substr(0, 8), "ACNGMDB1");
+	uint32_t len, crc;
+	memcpy(&len, &log[8], 4);
+	memcpy(&crc, &log[12], 4);
+	// one record, nothing else
+	ASSERT_EQ(log.size(), 16u + len);
+	ASSERT_EQ(crc, crc32(0, (const Bytef*) &log[16], len));
+	// put operation, then the key with 16 bit length
+	ASSERT_EQ(log[16], 1);
+	uint16_t keyLen;
+	memcpy(&keyLen, &log[17], 2);
+	ASSERT_EQ(log.substr(19, keyLen), key);
+
+	ASSERT_TRUE(metadb::Drop(key));
+	metadb::Close();
+	auto log2 = env.ReadLog();
+	ASSERT_EQ(log2.substr(0, log.size()), log);
+	// drop operation, only with the key
+	ASSERT_EQ(log2.size(), log.size() + 8 + 1 + 2 + key.size());
+	ASSERT_EQ(log2[log.size() + 8], 2);
+
+	auto head = metadb::FormatHead(MakeRec(42, "http://x/a.deb"));
+	ASSERT_EQ(head, "HTTP/1.1 200 OK\r\nContent-Length: 42\r\n"
+			"Last-Modified: Mon, 12 Jan 1970 13:46:40 GMT\r\n"
+			"X-Original-Source: http://x/a.deb\r\n"
+			"X-Content-Sha256: " + mstring(64, 'c') + "\r\n\r\n");
+}
+
+TEST(metadb, reopen)
+{
+	tMetaDbEnv env;
+	ASSERT_TRUE(metadb::Put("a", MakeRec(1, "http://x/a")));
+	ASSERT_TRUE(metadb::Put("b", MakeRec(2, "http://x/b")));
+	ASSERT_TRUE(metadb::Put("a", MakeRec(3, "http://x/a2")));
+	ASSERT_TRUE(metadb::Put("c", MakeRec(4, "http://x/c")));
+	ASSERT_TRUE(metadb::Drop("b"));
+	ASSERT_FALSE(metadb::Drop("b"));
+	metadb::Close();
+
+	metadb::tRecord rec;
+	ASSERT_TRUE(metadb::Get("a", rec));
+	ASSERT_EQ(rec.contLen, 3);
+	ASSERT_EQ(rec.origin, "http://x/a2");
+	ASSERT_EQ(rec.lastModified, tHttpDate(1000000));
+	ASSERT_EQ(rec.sha256, mstring(64, 'c'));
+	ASSERT_FALSE(metadb::Get("b", rec));
+	ASSERT_TRUE(metadb::Get("c", rec));
+	ASSERT_EQ(rec.contLen, 4);
+	unsigned n = 0;
+	metadb::ForEach([&n](cmstring&, const metadb::tRecord&) { n++; });
+	ASSERT_EQ(n, 2u);
+
+	mstring key;
+	ASSERT_TRUE(metadb::KeyFromHeadPath(CACHE_BASE + "debian/x.deb.head", key));
+	ASSERT_EQ(key, "debian/x.deb");
+	ASSERT_FALSE(metadb::KeyFromHeadPath(CACHE_BASE + "debian/x.deb", key));
+	ASSERT_FALSE(metadb::KeyFromHeadPath("/elsewhere/x.deb.head", key));
+}
+
+TEST(metadb, damaged)
+{
+	tMetaDbEnv env;
+	ASSERT_TRUE(metadb::Put("a", MakeRec(1, "http://x/a")));
+	metadb::Close();
+	auto nGood = env.ReadLog().size();
+	ASSERT_TRUE(metadb::Put("b", MakeRec(2, "http://x/b")));
+	ASSERT_TRUE(metadb::Put("c", MakeRec(3, "http://x/c")));
+	metadb::Close();
+
+	// flip a byte in the payload of the second record, the rest is cut off
+	auto log = env.ReadLog();
+	log[nGood + 20] ^= 0x55;
+	env.WriteLog(log);
+	metadb::tRecord rec;
+	ASSERT_TRUE(metadb::Get("a", rec));
+	ASSERT_EQ(rec.contLen, 1);
+	ASSERT_FALSE(metadb::Get("b", rec));
+	ASSERT_FALSE(metadb::Get("c", rec));
+	ASSERT_EQ(off_t(nGood), Cstat(env.sPath).st_size);
+
+	// incomplete record at the end, as after a crash while appending
+	ASSERT_TRUE(metadb::Put("b", MakeRec(2, "http://x/b")));
+	metadb::Close();
+	log = env.ReadLog();
+	env.WriteLog(log.substr(0, log.size() - 3));
+	ASSERT_TRUE(metadb::Get("a", rec));
+	ASSERT_FALSE(metadb::Get("b", rec));
+	ASSERT_EQ(off_t(nGood), Cstat(env.sPath).st_size);
+
+	// not a store at all
+	metadb::Close();
+	env.WriteLog("something else");
+	mstring sErr;
+	ASSERT_FALSE(metadb::Open(&sErr));
+	ASSERT_FALSE(sErr.empty());
+}
+
+TEST(metadb, compaction)
+{
+	tMetaDbEnv env;
+	// enough garbage to trigger the rewrite when opening (16 MiB, mostly overwritten),
+	// made by repeating the same record since the running store would compact already
+	mstring origin(60000, 'o');
+	ASSERT_TRUE(metadb::Put("a", MakeRec(299, origin)));
+	metadb::Close();
+	auto log = env.ReadLog();
+	auto rec1 = log.substr(8);
+	for (int i = 0; i < 300; ++i)
+		log += rec1;
+	env.WriteLog(log);
+	auto nBefore = Cstat(env.sPath).st_size;
+	ASSERT_GT(nBefore, 16 << 20);
+
+	metadb::tRecord rec;
+	ASSERT_TRUE(metadb::Get("a", rec));
+	ASSERT_EQ(rec.contLen, 299);
+	ASSERT_EQ(rec.origin, origin);
+	auto nAfter = Cstat(env.sPath).st_size;
+	ASSERT_LT(nAfter, 70000);
+
+	// still appendable, and consistent after another reopen
+	ASSERT_TRUE(metadb::Put("c", MakeRec(8, "http://x/c")));
+	metadb::Close();
+	ASSERT_TRUE(metadb::Get("a", rec));
+	ASSERT_EQ(rec.contLen, 299);
+	ASSERT_TRUE(metadb::Get("c", rec));
+	ASSERT_EQ(rec.contLen, 8);
+	ASSERT_GT(Cstat(env.sPath).st_size, nAfter);
+}
+
+TEST(metadb, compaction_running)
+{
+	tMetaDbEnv env;
+	// the log is rewritten while updating, it never gets much beyond the threshold
+	mstring origin(60000, 'o');
+	for (int i = 0; i < 600; ++i)
+	{
+		ASSERT_TRUE(metadb::Put("a", MakeRec(i, origin)));
+		ASSERT_LT(Cstat(env.sPath).st_size, (16 << 20) + 70000);
+	}
+	ASSERT_TRUE(metadb::Put("b", MakeRec(7, "http://x/b")));
+	metadb::tRecord rec;
+	ASSERT_TRUE(metadb::Get("a", rec));
+	ASSERT_EQ(rec.contLen, 599);
+	ASSERT_EQ(rec.origin, origin);
+
+	metadb::Close();
+	ASSERT_TRUE(metadb::Get("a", rec));
+	ASSERT_EQ(rec.contLen, 599);
+	ASSERT_TRUE(metadb::Get("b", rec));
+	ASSERT_EQ(rec.contLen, 7);
+}
@@ -0,0 +1,119 @@
+#include "gtest/gtest.h"
+
+#include "ramcache.h"
+#include "fileitem.h"
+#include "acfg.h"
+#include "meta.h"
+
+#include <fstream>
+
+using namespace acng;
+
+namespace
+{
+
+// temporary cache directory with a RAM cache of the specified size
+struct tRamCacheEnv
+{
+	mstring sSavedCacheDirSlash = cfg::cacheDirSlash;
+	int nSavedSize = cfg::ramcachesize, nSavedMaxFile = cfg::ramcachemaxfile;
+	mstring sDir;
+
+	tRamCacheEnv(int nSize, int nMaxFile)
+	{
+		char tmpl[] = "/tmp/ut_ramcache.XXXXXX";
+		sDir = mkdtemp(tmpl);
+		cfg::cacheDirSlash = sDir + "/";
+		cfg::ramcachesize = nSize;
+		cfg::ramcachemaxfile = nMaxFile;
+	}
+	~tRamCacheEnv()
+	{
+		cfg::cacheDirSlash = sSavedCacheDirSlash;
+		cfg::ramcachesize = nSavedSize;
+		cfg::ramcachemaxfile = nSavedMaxFile;
+		ignore_value(system(("rm -rf " + sDir).c_str()));
+	}
+};
+
+// a completely stored cache file
+struct tCompleteItem : public fileitem_with_storage
+{
+	tCompleteItem(cmstring& sPathRel, const mstring& contents) : fileitem_with_storage(sPathRel)
+	{
+		auto sPathAbs(SABSPATH(sPathRel));
+		mkbasedir(sPathAbs);
+		std::ofstream(sPathAbs, std::ios::binary | std::ios::trunc) << contents;
+		m_status = FIST_COMPLETE;
+		m_nContentLength = m_nSizeChecked = contents.size();
+		m_responseModDate = tHttpDate(1000000);
+	}
+};
+
+}
+
+TEST(ramcache, obtain)
+{
+	tRamCacheEnv env(100, 50);
+	tCompleteItem fi("debian/dists/sid/InRelease", "twenty bytes of data");
+	unsigned nCooked = 0;
+	auto cook = [&nCooked]() { nCooked++; return mstring("Content-Length: 20\r\n"); };
+
+	auto p = ramcache::Obtain(fi, cook);
+	ASSERT_TRUE(p);
+	ASSERT_EQ(p->body, "twenty bytes of data");
+	ASSERT_EQ(p->head, "Content-Length: 20\r\n");
+	ASSERT_EQ(nCooked, 1u);
+	// served from memory, even if the file is gone
+	unlink(SABSPATH(fi.GetPathRel()).c_str());
+	ASSERT_EQ(ramcache::Obtain(fi, cook), p);
+	ASSERT_EQ(nCooked, 1u);
+
+	// the item state changed, the entry is outdated
+	fi.m_responseModDate = tHttpDate(2000000);
+	ASSERT_FALSE(ramcache::Obtain(fi, cook));
+	ASSERT_EQ(nCooked, 2u);
+
+	tCompleteItem again("debian/dists/sid/InRelease", "twenty bytes of data");
+	ASSERT_TRUE(ramcache::Obtain(again, cook));
+	ramcache::Drop(again.GetPathRel());
+	ASSERT_TRUE(ramcache::Obtain(again, cook));
+	ASSERT_EQ(nCooked, 4u);
+	ramcache::Drop(again.GetPathRel());
+}
+
+TEST(ramcache, limits)
+{
+	tRamCacheEnv env(100, 50);
+	unsigned nCooked = 0;
+	auto cook = [&nCooked]() { nCooked++; return mstring(); };
+
+	// too large, or not completely downloaded
+	tCompleteItem big("debian/pool/big.deb", mstring(51, 'x'));
+	ASSERT_FALSE(ramcache::Obtain(big, cook));
+	tCompleteItem partial("debian/pool/partial.deb", mstring(10, 'x'));
+	partial.m_status = fileitem::FIST_DLRECEIVING;
+	ASSERT_FALSE(ramcache::Obtain(partial, cook));
+	ASSERT_EQ(nCooked, 0u);
+
+	// the least recently used ones are dropped to stay in budget
+	tCompleteItem a("debian/pool/a.deb", mstring(40, 'a')), b("debian/pool/b.deb", mstring(40, 'b')),
+			c("debian/pool/c.deb", mstring(40, 'c'));
+	ASSERT_TRUE(ramcache::Obtain(a, cook));
+	ASSERT_TRUE(ramcache::Obtain(b, cook));
+	ASSERT_TRUE(ramcache::Obtain(a, cook));
+	ASSERT_EQ(nCooked, 2u);
+	ASSERT_TRUE(ramcache::Obtain(c, cook));
+	ASSERT_EQ(nCooked, 3u);
+	ASSERT_TRUE(ramcache::Obtain(a, cook));
+	ASSERT_EQ(nCooked, 3u);
+	ASSERT_TRUE(ramcache::Obtain(b, cook));
+	ASSERT_EQ(nCooked, 4u);
+
+	// disabled
+	cfg::ramcachesize = 0;
+	ASSERT_FALSE(ramcache::Obtain(a, cook));
+	cfg::ramcachesize = 100;
+	for (auto p : { &a, &b, &c })
+		ramcache::Drop(p->GetPathRel());
+}